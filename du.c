@@ -2,8 +2,9 @@
  * @file   du.c
  *
  * @brief  Basic implementation of a disk usage reporting tool similar to 'du'
- *         command. This program only supports the `-a` option to include files
- *         in the usage report, not just directories.
+ *         command. The scan itself lives in libdu; this file only parses
+ *         arguments and prints what it reports, either from a live scan or
+ *         from a saved index.
  *
  * @author Juan Diego Becerra (jdb9056@nyu.edu)
  * @date   03-24-2024
@@ -11,34 +12,251 @@
 
 #include "du.h"
 
+static volatile sig_atomic_t stop_requested = 0;  // set by SIGINT and SIGTERM
+
 /**
  * @brief Orchestrates the disk usage calculation process.
  *
  * Parses and validates command line arguments as specified in the usage. Only
  * one path argument is allowed; if not provided, the current directory (".")
- * is used as the default. The function then calls `du` to calculate and report
- * the disk usage starting from the specified path or current directory. Errors
- * during disk usage calculation also result in an exit with failure.
+ * is used as the default. The function then either scans that path with `du`
+ * from libdu, answers the query from a saved index when `--index` is given,
+ * compares the two snapshots given with `--diff`, estimates the usage by
+ * sampling with `--estimate`, or ranks the largest entries of a live scan
+ * with `--top`.
+ * Errors during disk usage calculation also result in an exit with failure.
  *
  * @param argc Number of command line arguments.
  * @param argv Array of command line arguments.
  *
  * @return Returns EXIT_SUCCESS on successful completion of disk usage
  *         calculation, or EXIT_FAILURE on error, such as invalid arguments or
- *         failure in disk usage calculation.
+ *         failure in disk usage calculation. See `Scan` for the statuses
+ *         of `--keep-going` and `--exceeds`.
  */
 int main(int argc, char* argv[]) {
-  if (argc > kMaxArgs) {
-    PrintUsage(argv[0]);
-    return EXIT_FAILURE;
-  }
-
-  int include_files = 0;
+  Config config = {.max_depth = -1,
+                   .checkpoint_interval = kCheckpointInterval,
+                   .refresh = -1};
+  long value;
   int opt;
-  while ((opt = getopt(argc, argv, "a")) != -1) {
+  while ((opt = getopt_long(argc, argv, "ad:t:0lLHP", kLongOptions,
+                            NULL)) != -1) {
     switch (opt) {
       case 'a': {
-        include_files = 1;
+        config.include_files = 1;
+        break;
+      }
+      case '0': {
+        config.null = 1;
+        break;
+      }
+      case 'l': {
+        config.count_links = 1;
+        break;
+      }
+      case 'L': {
+        config.follow = kDuFollowAll;
+        break;
+      }
+      case 'H': {
+        config.follow = kDuFollowRoots;
+        break;
+      }
+      case 'P': {
+        config.follow = kDuFollowNone;
+        break;
+      }
+      case kOptEscape: {
+        config.escape = 1;
+        break;
+      }
+      case 'd': {
+        if (ParseCount(optarg, &value) < 0 || value > INT_MAX) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        config.max_depth = (int)value;
+        break;
+      }
+      case 't': {
+        if (ParseSize(optarg, &config.threshold) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptSaveIndex: {
+        config.save_index = optarg;
+        break;
+      }
+      case kOptIndex: {
+        config.index = optarg;
+        break;
+      }
+      case kOptSaveSnapshot: {
+        config.save_snapshot = optarg;
+        break;
+      }
+      case kOptDiff: {
+        config.diff = 1;
+        break;
+      }
+      case kOptMaxOps: {
+        if (ParseCount(optarg, &config.max_ops_per_sec) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptMaxDirs: {
+        if (ParseCount(optarg, &config.max_dirs_per_sec) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptAdaptive: {
+        config.adaptive_throttle = 1;
+        break;
+      }
+      case kOptEstimate: {
+        config.estimate = 1;
+        break;
+      }
+      case kOptTimeBudget: {
+        if (ParseCount(optarg, &config.time_budget) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptErrorBudget: {
+        if (ParseCount(optarg, &config.error_budget) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptCheckpoint: {
+        config.checkpoint = optarg;
+        break;
+      }
+      case kOptCheckpointInterval: {
+        if (ParseCount(optarg, &config.checkpoint_interval) < 0 ||
+            config.checkpoint_interval == 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptResume: {
+        config.resume = optarg;
+        break;
+      }
+      case kOptLinkMemory: {
+        if (ParseSize(optarg, &config.link_memory) < 0 ||
+            config.link_memory <= 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptApproxLinks: {
+        if (ParseCount(optarg, &config.approx_links) < 0 ||
+            config.approx_links == 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptLinkFpRate: {
+        if (ParseRate(optarg, &config.link_fp_rate) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptThreads: {
+        if (ParseCount(optarg, &config.threads) < 0 || config.threads == 0 ||
+            config.threads > kMaxThreads) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptUnordered: {
+        config.unordered = 1;
+        break;
+      }
+      case kOptKeepGoing: {
+        config.keep_going = 1;
+        break;
+      }
+      case kOptErrorLog: {
+        config.error_log = optarg;
+        break;
+      }
+      case kOptExceeds: {
+        if (ParseSize(optarg, &config.exceeds) < 0 || config.exceeds <= 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptGuide: {
+        config.guide = optarg;
+        break;
+      }
+      case kOptServe: {
+        config.serve = optarg;
+        break;
+      }
+      case kOptRefresh: {
+        if (ParseCount(optarg, &config.refresh) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptAsk: {
+        config.ask = optarg;
+        break;
+      }
+      case kOptFormat: {
+        if (strcmp(optarg, "prometheus") == 0) {
+          config.prometheus = 1;
+        } else if (strcmp(optarg, "du") != 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptOutput: {
+        config.output = optarg;
+        break;
+      }
+      case kOptFiles0From: {
+        config.files0_from = optarg;
+        break;
+      }
+      case kOptWatch: {
+        if (ParseCount(optarg, &config.watch) < 0 || config.watch == 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case kOptProgress: {
+        config.progress = 1;
+        break;
+      }
+      case kOptTop: {
+        if (ParseCount(optarg, &value) < 0) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        config.top = (size_t)value;
         break;
       }
       default: {
@@ -48,235 +266,1152 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  // More than one file provided
-  if (argc - optind > 1) {
+  // More than one file provided, not exactly two snapshots to compare, or a
+  // file besides the one recorded in the checkpoint to resume
+  if ((!config.diff && argc - optind > 1) ||
+      (config.diff && argc - optind != 2) ||
+      (config.resume && argc - optind > 0)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Top-N and depth-limited listings are separate queries, and queries do
+  // not scan anything that could be saved
+  int queries = (config.index != NULL) + config.diff + config.estimate;
+  int saves = (config.save_index != NULL) + (config.save_snapshot != NULL);
+  int explore = config.top && !config.index && !config.diff;
+  if (queries > 1 || (queries && saves) ||
+      (config.top && config.max_depth >= 0) ||
+      ((config.time_budget || config.error_budget) && !config.estimate)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // The threshold filters a live scan, and an index needs every entry
+  if (config.threshold && (queries || config.save_index)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Checkpoints only cover live scans, and a resumed scan no longer visits
+  // what was saved before the checkpoint
+  if ((queries && (config.checkpoint || config.resume)) ||
+      (config.resume && saves)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Spilled hard links are resolved at the end of a single `du` call, and
+  // neither they nor the approximate set are saved in checkpoints
+  int approx = config.approx_links != 0;
+  if ((config.link_fp_rate && !approx) ||
+      ((config.link_memory || approx) &&
+       (queries || config.checkpoint || config.resume)) ||
+      (config.link_memory && approx)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Counting every link leaves no hard links to deduplicate
+  if (config.count_links && (config.link_memory || approx)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Following links changes what a live scan reaches; following every link
+  // takes a set of every entry reached, in serial order, that neither
+  // checkpoints nor the other hard-link modes hold
+  int follow_all = config.follow == kDuFollowAll;
+  if ((config.follow && (queries || explore || config.watch)) ||
+      (follow_all && (config.threads > 1 || config.checkpoint ||
+                      config.resume || config.link_memory || approx))) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Threaded scans resolve hard links in memory as their output is released,
+  // so they cannot be checkpointed or combined with the other hard-link modes
+  if (config.threads > 1 &&
+      (queries || config.checkpoint || config.resume || config.link_memory ||
+       approx)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Only threaded scans have an order to give up, and indexes and snapshots
+  // are built from entries in serial order
+  if (config.unordered &&
+      (config.threads <= 1 || config.save_index || config.save_snapshot)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Only live scans have entries to skip
+  if ((config.keep_going || config.error_log) && queries) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // A live top-N scan reads directories in an order of its own and keeps
+  // only the largest entries, so it has nothing to save, filter or resume
+  if (explore &&
+      (queries || saves || config.threshold || config.checkpoint ||
+       config.resume || config.link_memory || approx || config.threads > 1 ||
+       config.exceeds)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // A quota check prints nothing but its total, and stops at an arbitrary
+  // point of a serial scan
+  if (config.exceeds &&
+      (queries || saves || config.include_files || config.max_depth >= 0 ||
+       config.threshold || config.checkpoint || config.resume ||
+       config.link_memory || config.threads > 1)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Guided scans visit siblings in an order of their own, which neither
+  // threads, checkpoints nor snapshots can follow
+  if (config.guide &&
+      (queries || config.threads > 1 || config.checkpoint || config.resume ||
+       config.save_snapshot)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // A server rescans the whole tree into memory, so it neither filters,
+  // saves nor resumes, and the approximate set would fill up over rescans
+  if ((config.refresh >= 0 && !config.serve) ||
+      (config.serve &&
+       (queries || saves || explore || config.ask || config.exceeds ||
+        config.guide || config.threshold || config.max_depth >= 0 ||
+        config.checkpoint || config.resume || config.unordered || approx))) {
     PrintUsage(argv[0]);
     return EXIT_FAILURE;
   }
 
+  // A client only sends its request
+  if (config.ask &&
+      (argc - optind != 1 || queries || saves || explore || config.exceeds ||
+       config.guide || config.include_files || config.threads ||
+       config.keep_going || config.error_log || config.checkpoint ||
+       config.link_memory || config.max_ops_per_sec ||
+       config.max_dirs_per_sec)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Inode gauges are summed up from every file of a scan in serial order, so
+  // nothing may be filtered out, resumed or replayed
+  if ((config.output && !config.prometheus) ||
+      (config.prometheus &&
+       (queries || saves || explore || config.exceeds || config.serve ||
+        config.ask || config.threshold || config.checkpoint ||
+        config.resume || config.link_memory || config.unordered ||
+        config.null || config.escape))) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Listed roots are scanned one after the other by a single serial scan,
+  // which has nothing to save, resume or spill
+  if (config.files0_from &&
+      (argc - optind > 0 || queries || saves || explore || config.exceeds ||
+       config.serve || config.ask || config.checkpoint || config.resume ||
+       config.link_memory || config.threads > 1)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // A watch keeps a tree of its own in memory and sweeps it serially, so it
+  // only takes the options that shape what is printed
+  if (config.watch &&
+      (queries || saves || explore || config.exceeds || config.serve ||
+       config.ask || config.prometheus || config.files0_from ||
+       config.threshold || config.checkpoint || config.resume ||
+       config.link_memory || approx || config.threads > 1 || config.guide ||
+       config.max_ops_per_sec || config.max_dirs_per_sec ||
+       config.adaptive_throttle)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Progress is only reported by live scans that print as they go
+  if (config.progress && (queries || explore || config.serve || config.ask ||
+                          config.watch)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (config.ask) {
+    return Ask(&config, argv[optind]);
+  }
+
+  if (config.diff) {
+    return Diff(&config, argv[optind], argv[optind + 1]);
+  }
+
+  if (config.estimate) {
+    return Estimate(&config, (optind < argc) ? argv[optind] : ".");
+  }
+
+  if (config.index) {
+    return Query(&config, (optind < argc) ? argv[optind] : NULL);
+  }
+
   const char* pathname = (optind < argc) ? argv[optind] : ".";
-  if (du(pathname, include_files) < 0) {
+  if (explore) {
+    return Explore(&config, pathname);
+  }
+  if (config.serve) {
+    return Serve(&config, pathname);
+  }
+  if (config.watch) {
+    return Watch(&config, pathname);
+  }
+  return Scan(&config, pathname);
+}
+
+/**
+ * @brief Scans a path and prints its disk usage, saving the scan as an index
+ *        if requested.
+ *
+ * With `--exceeds`, only prints the total, which stops growing as soon as it
+ * passes the limit, and answers through the exit status.
+ *
+ * @param config   Command line configuration.
+ * @param rootpath The path to the directory or file to scan.
+ *
+ * @return Returns EXIT_SUCCESS on success, or EXIT_FAILURE on error. With
+ *         `--exceeds`, returns EXIT_SUCCESS if the tree exceeds the limit,
+ *         kExitWithin if it does not, or kExitPartial if entries were
+ *         skipped before the limit was passed.
+ */
+static int Scan(Config* config, const char* rootpath) {
+  DuOptions opts;
+  DuDefaultOptions(&opts);
+  opts.include_files = config->include_files;
+  opts.threshold = config->threshold;
+  opts.max_ops_per_sec = (double)config->max_ops_per_sec;
+  opts.max_dirs_per_sec = (double)config->max_dirs_per_sec;
+  opts.adaptive_throttle = config->adaptive_throttle;
+  opts.link_memory = (size_t)config->link_memory;
+  opts.threads = (int)config->threads;
+  opts.unordered = config->unordered;
+  opts.keep_going = config->keep_going;
+  opts.count_links = config->count_links;
+  opts.follow = config->follow;
+  opts.exceeds = config->exceeds;
+  opts.visit = config->exceeds ? NULL : PrintEntry;
+  opts.on_error = PrintError;
+  opts.ctx = config;
+
+  DuFilter* filter = NULL;
+  if (config->approx_links) {
+    double fp_rate = config->link_fp_rate ? config->link_fp_rate : kLinkFpRate;
+    filter = DuFilterCreate((size_t)config->approx_links, fp_rate);
+    if (!filter) {
+      PrintError(rootpath, kDuOpAlloc, ENOMEM, config);
+      return EXIT_FAILURE;
+    }
+    opts.link_filter = filter;
+  }
+
+  if (config->save_snapshot) {
+    // Snapshots must list entries in a canonical order to be comparable
+    opts.sorted = 1;
+    config->snapshot = DuSnapshotCreate(config->save_snapshot);
+    if (!config->snapshot) {
+      fprintf(stderr, "Error: Failed to create snapshot '%s': %s\n",
+              config->save_snapshot, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (config->save_index) {
+    config->tree = DuTreeCreate();
+    if (!config->tree) {
+      PrintError(rootpath, kDuOpAlloc, ENOMEM, config);
+      return EXIT_FAILURE;
+    }
+  }
+
+  DuIndex guide;
+  if (config->guide) {
+    if (OpenGuide(config, &guide) < 0) {
+      return EXIT_FAILURE;
+    }
+    opts.guide = &guide;
+  }
+
+  if (OpenErrorLog(config) < 0) {
     return EXIT_FAILURE;
   }
 
-  return EXIT_SUCCESS;
+  if (config->prometheus) {
+    // Every file counts towards the inode gauges of its directories
+    opts.include_files = 1;
+    config->metrics = DuMetricsCreate(config->output, config->max_depth,
+                                      config->include_files);
+    if (!config->metrics) {
+      fprintf(stderr, "Error: Failed to write gauges to '%s': %s\n",
+              config->output ? config->output : "stdout", strerror(errno));
+      return CloseErrorLog(config, EXIT_FAILURE);
+    }
+  }
+
+  // SIGUSR1 reports the progress of any scan, and `--progress` reports it
+  // every kProgressInterval too; the scan goes on if neither can be
+  DuProgress* progress = DuProgressStart(
+      config->progress ? kProgressInterval : 0, PrintProgress, config);
+  if (!progress && config->progress) {
+    fprintf(stderr, "Note: Progress cannot be reported: %s\n",
+            strerror(errno));
+  }
+  opts.progress = progress;
+
+  blkcnt_t total = 0;
+  int result;
+  if (config->files0_from) {
+    result = ScanRoots(config, &opts);
+  } else if (config->checkpoint || config->resume) {
+    result = ScanCheckpointed(config, &opts, rootpath);
+  } else {
+    result = du(rootpath, &opts, &total);
+  }
+  DuProgressStop(progress);
+  int status = result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (config->guide) {
+    DuIndexClose(&guide);
+  }
+
+  status = CloseErrorLog(config, status);
+
+  // Skipped entries can only make the total smaller, so passing the limit
+  // is an answer even with some of them
+  if (config->exceeds && status != EXIT_FAILURE) {
+    PrintDiskUsage(config, total, rootpath);
+    if (result == 1) {
+      status = EXIT_SUCCESS;
+    } else if (status == EXIT_SUCCESS) {
+      status = kExitWithin;
+    }
+  }
+
+  if (filter) {
+    fprintf(stderr,
+            "Note: Hard links deduplicated approximately with a %zu-byte "
+            "filter; false-positive rate %.2g%%, expected undercount at "
+            "most %.0f KiB.\n",
+            DuFilterBytes(filter),
+            DuFilterFalsePositiveRate(filter) * 100,
+            DuFilterErrorBound(filter));
+    DuFilterFree(filter);
+  }
+
+  if (config->tree) {
+    if (status == EXIT_SUCCESS &&
+        DuTreeSave(config->tree, config->save_index) < 0) {
+      fprintf(stderr, "Error: Failed to save index '%s': %s\n",
+              config->save_index, strerror(errno));
+      status = EXIT_FAILURE;
+    }
+    DuTreeFree(config->tree);
+    config->tree = NULL;
+  }
+
+  if (config->snapshot) {
+    if (DuSnapshotClose(config->snapshot) < 0 && status == EXIT_SUCCESS) {
+      fprintf(stderr, "Error: Failed to write snapshot '%s': %s\n",
+              config->save_snapshot, strerror(errno));
+      status = EXIT_FAILURE;
+    }
+    config->snapshot = NULL;
+  }
+
+  // Skipped entries only leave their directories smaller, as in the text
+  // output, so a partial scan still replaces the previous gauges
+  if (config->metrics) {
+    if (DuMetricsClose(config->metrics, status != EXIT_FAILURE) < 0 &&
+        status != EXIT_FAILURE) {
+      fprintf(stderr, "Error: Failed to write gauges to '%s': %s\n",
+              config->output ? config->output : "stdout", strerror(errno));
+      status = EXIT_FAILURE;
+    }
+    config->metrics = NULL;
+  }
+
+  return status;
 }
 
 /**
- * @brief Calculates the disk usage of the given directory or file.
+ * @brief Runs a scan in slices of `--checkpoint-interval` seconds, saving a
+ *        checkpoint after each, or continues one from `--resume`.
  *
- * Initializes a dynamic array to track seen inodes to avoid counting hard
- * links multiple times. It performs a depth-first search (DFS) to recursively
- * calculate the disk usage of the directory and its contents, optionally
- * including files if specified.
+ * The checkpoint is removed once the scan completes.
  *
- * @param rootpath      The path to the directory or file whose disk usage is to
- *                      be calculated.
- * @param include_files Flag indicating whether to include files in the usage
- *                      calculation.
+ * @param config   Command line configuration.
+ * @param opts     Scan options and callbacks.
+ * @param rootpath The path to scan, ignored when resuming.
  *
- * @return Returns 0 on success or -1 on error.
+ * @return Returns 0 on success, 1 if the visitor stopped the scan, or -1 on
+ *         error, like `du`.
  */
-int du(const char* rootpath, int include_files) {
-  int error = 0;
-  const size_t kInitSize = 8;
+static int ScanCheckpointed(Config* config, const DuOptions* opts,
+                            const char* rootpath) {
+  DuOptions sorted = *opts;
+  sorted.sorted = 1;  // checkpoints record positions as entry names
 
-  DynamicArray* seen = InitDynamicArray(kInitSize, sizeof(ino_t));
-  if (!seen) {
-    perror("failed to initialize dynamic array");
+  DuIter* it = config->resume ? DuIterLoad(config->resume, &sorted)
+                              : DuOpen(rootpath, &sorted);
+  if (!it) {
+    if (config->resume) {
+      fprintf(stderr, "Error: Failed to resume from '%s': %s\n",
+              config->resume, strerror(errno));
+    } else {
+      PrintError(rootpath, kDuOpAlloc, ENOMEM, config);
+    }
     return -1;
   }
 
-  dfs(rootpath, seen, &error, include_files);
-  FreeDynamicArray(seen);
+  int status;
+  do {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += config->checkpoint_interval;
+
+    status = DuNext(it, 0, &deadline);
+    if (status == 1 && config->checkpoint &&
+        DuIterSave(it, config->checkpoint) < 0) {
+      fprintf(stderr, "Error: Failed to save checkpoint '%s': %s\n",
+              config->checkpoint, strerror(errno));
+      status = -1;
+    }
+  } while (status == 1);
+  DuClose(it);
+
+  if (status == 0 && config->checkpoint) {
+    remove(config->checkpoint);
+  }
+  return status;
+}
 
-  if (error) {
+/**
+ * @brief Scans every root listed in `--files0-from`, streaming the list so
+ *        that it is never held in memory.
+ *
+ * @param config Command line configuration.
+ * @param opts   Scan options and callbacks.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the scan, or -1 on
+ *         error, like `du`.
+ */
+static int ScanRoots(Config* config, const DuOptions* opts) {
+  RootList list = {.file = stdin};
+  if (strcmp(config->files0_from, "-") != 0 &&
+      !(list.file = fopen(config->files0_from, "r"))) {
+    fprintf(stderr, "Error: Failed to open '%s': %s\n", config->files0_from,
+            strerror(errno));
     return -1;
   }
 
-  return 0;
+  int status = DuScanRoots(NextRoot, &list, opts);
+  if (list.error == EINVAL) {
+    fprintf(stderr, "Error: Invalid zero-length file name in '%s'.\n",
+            config->files0_from);
+    status = -1;
+  } else if (list.error) {
+    fprintf(stderr, "Error: Failed to read '%s': %s\n", config->files0_from,
+            strerror(list.error));
+    status = -1;
+  }
+
+  free(list.root);
+  if (list.file != stdin) {
+    fclose(list.file);
+  }
+  return status;
 }
 
 /**
- * @brief Performs a depth-first search to calculate disk usage.
+ * @brief Answers a query from a saved index without touching the filesystem.
  *
- * Recursively calculates the disk usage of a directory and its contents or
- * a single file. This function is designed to be called by 'du' and updates
- * the 'error' variable if an error occurs during the calculation.
+ * Prints the subtree of `path` in post-order, limited by `--max-depth`, or its
+ * `--top` largest entries.
  *
- * @param rootpath      The directory or file path to calculate usage for.
- * @param seen          Dynamic array to keep track of seen inodes to handle
- *                      hard links.
- * @param error         Pointer to an integer to record any errors encountered
- *                      during execution.
- * @param include_files Flag indicating whether to include files in the usage
- *                      calculation.
+ * @param config Command line configuration.
+ * @param path   Path to query, or NULL for the root of the index.
  *
- * @return Returns the total disk usage in kilobytes of the specified path and
- *         its contents, or 0 if an error is encountered.
+ * @return Returns EXIT_SUCCESS on success, or EXIT_FAILURE on error.
  */
-blkcnt_t dfs(const char* rootpath, DynamicArray* seen, int* error,
-             int include_files) {
-  struct stat statbuf;
-  blkcnt_t total = 0;
+static int Query(Config* config, const char* path) {
+  DuIndex index;
+  if (DuIndexOpen(&index, config->index) < 0) {
+    fprintf(stderr, "Error: Failed to open index '%s': %s\n", config->index,
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
 
-  if (lstat(rootpath, &statbuf) < 0) {
-    fprintf(stderr, "Error: Failed to get stat for '%s'.\n", rootpath);
-    *error = errno;
-    return 0;
+  char root[PATH_MAX];
+  int64_t node = 0;
+  if (!path) {
+    DuIndexName(&index, 0, root, sizeof(root));
+    path = root;
+  } else if ((node = DuIndexLookup(&index, path)) < 0) {
+    fprintf(stderr, "Error: '%s' not found in index '%s'.\n", path,
+            config->index);
+    DuIndexClose(&index);
+    return EXIT_FAILURE;
   }
 
-  blkcnt_t disk_usage_kb = statbuf.st_blocks / 2;
+  int status;
+  if (config->top) {
+    status = DuIndexTop(&index, (uint32_t)node, path, config->top, PrintEntry,
+                        config);
+  } else {
+    status = DuIndexWalk(&index, (uint32_t)node, path, config->max_depth,
+                         PrintEntry, config);
+  }
+  DuIndexClose(&index);
 
-  if (!S_ISDIR(statbuf.st_mode)) {
-    ino_t ino = statbuf.st_ino;
+  if (status < 0) {
+    fprintf(stderr, "Error: Index '%s' is corrupt.\n", config->index);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
-    if (S_ISREG(statbuf.st_mode) && statbuf.st_nlink > 1) {
-      if (SearchInode(seen, ino)) {
-        return 0;
-      }
+/**
+ * @brief Compares two snapshots and prints the entries whose disk usage
+ *        changed, largest absolute change first.
+ *
+ * @param config   Command line configuration; `--top` limits the report.
+ * @param old_path Path of the earlier snapshot.
+ * @param new_path Path of the later snapshot.
+ *
+ * @return Returns EXIT_SUCCESS on success, or EXIT_FAILURE on error.
+ */
+static int Diff(Config* config, const char* old_path, const char* new_path) {
+  if (DuSnapshotDiff(old_path, new_path, config->top, PrintDelta, config) <
+      0) {
+    fprintf(stderr, "Error: Failed to compare snapshots '%s' and '%s': %s\n",
+            old_path, new_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
-      if (InsertInode(seen, ino) < 0) {
-        fprintf(stderr, "Error: Unable to insert inode '%lu'. Resizing failed.\n",
-                statbuf.st_ino);
-        *error = errno;
-        return 0;
-      }
+/**
+ * @brief Estimates the disk usage of a path and of its subdirectories by
+ *        random sampling, and prints the estimates with their 95% confidence
+ *        half-widths.
+ *
+ * @param config   Command line configuration holding the budgets.
+ * @param rootpath The path to the directory or file to estimate.
+ *
+ * @return Returns EXIT_SUCCESS on success, or EXIT_FAILURE on error.
+ */
+static int Estimate(Config* config, const char* rootpath) {
+  DuEstimateOptions opts = {
+      .time_budget = (double)config->time_budget,
+      .error_budget = (double)config->error_budget / 100,
+      .report = PrintEstimate,
+      .on_error = PrintError,
+      .ctx = config,
+  };
+
+  if (DuEstimateRun(rootpath, &opts) < 0) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Scans a path largest directory first, as sized by `--guide`, and
+ *        prints its `--top` largest entries, with provisional lists while
+ *        the scan runs.
+ *
+ * @param config   Command line configuration.
+ * @param rootpath The path to the directory or file to scan.
+ *
+ * @return Returns EXIT_SUCCESS on success, kExitPartial if entries were
+ *         skipped, or EXIT_FAILURE on error.
+ */
+static int Explore(Config* config, const char* rootpath) {
+  DuExploreOptions opts = {
+      .top = config->top,
+      .interval = kTopInterval,
+      .include_files = config->include_files,
+      .keep_going = config->keep_going,
+      .count_links = config->count_links,
+      .report = PrintRanking,
+      .on_error = PrintError,
+      .ctx = config,
+  };
+
+  DuIndex guide;
+  if (config->guide) {
+    if (OpenGuide(config, &guide) < 0) {
+      return EXIT_FAILURE;
     }
+    opts.guide = &guide;
+  }
+
+  int status = EXIT_FAILURE;
+  if (OpenErrorLog(config) == 0) {
+    status = DuExploreRun(rootpath, &opts) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    status = CloseErrorLog(config, status);
+  }
+
+  if (config->guide) {
+    DuIndexClose(&guide);
+  }
+  return status;
+}
+
+/**
+ * @brief Keeps scanning a path and answers queries about it on the
+ *        `--serve` socket until interrupted.
+ *
+ * @param config   Command line configuration.
+ * @param rootpath The path to the directory or file to scan.
+ *
+ * @return Returns EXIT_SUCCESS once interrupted, kExitPartial if entries
+ *         were skipped, or EXIT_FAILURE on error.
+ */
+static int Serve(Config* config, const char* rootpath) {
+  DuOptions opts;
+  DuDefaultOptions(&opts);
+  opts.include_files = config->include_files;
+  opts.max_ops_per_sec = (double)config->max_ops_per_sec;
+  opts.max_dirs_per_sec = (double)config->max_dirs_per_sec;
+  opts.adaptive_throttle = config->adaptive_throttle;
+  opts.link_memory = (size_t)config->link_memory;
+  opts.threads = (int)config->threads;
+  opts.keep_going = config->keep_going;
+  opts.count_links = config->count_links;
+  opts.follow = config->follow;
+  opts.on_error = PrintError;
+  opts.ctx = config;
+
+  DuServeOptions serve = {
+      .socket_path = config->serve,
+      .refresh = (double)(config->refresh < 0 ? kServeRefresh
+                                              : config->refresh),
+      .scan = &opts,
+      .stop = &stop_requested,
+  };
+
+  CatchStop();
+  if (OpenErrorLog(config) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  if (DuServe(rootpath, &serve) < 0) {
+    fprintf(stderr, "Error: Failed to serve on '%s': %s\n", config->serve,
+            strerror(errno));
+    status = EXIT_FAILURE;
+  }
+  return CloseErrorLog(config, status);
+}
+
+/**
+ * @brief Scans a path into memory and prints its disk usage, then sweeps it
+ *        every `--watch` seconds and prints the entries that changed, until
+ *        interrupted.
+ *
+ * @param config   Command line configuration.
+ * @param rootpath The path to the directory or file to watch.
+ *
+ * @return Returns EXIT_SUCCESS once interrupted, kExitPartial if entries
+ *         were skipped, or EXIT_FAILURE on error.
+ */
+static int Watch(Config* config, const char* rootpath) {
+  DuWatchOptions opts = {
+      .interval = (double)config->watch,
+      .include_files = config->include_files,
+      .keep_going = config->keep_going,
+      .count_links = config->count_links,
+      .stop = &stop_requested,
+      .visit = PrintUpdate,
+      .sweep = EndSweep,
+      .on_error = PrintError,
+      .ctx = config,
+  };
+
+  CatchStop();
+  if (OpenErrorLog(config) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  int status = DuWatchRun(rootpath, &opts) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  return CloseErrorLog(config, status);
+}
+
+/**
+ * @brief Sends a request to a `--serve` server and prints its answer.
+ *
+ * @param config  Command line configuration.
+ * @param request Request line.
+ *
+ * @return Returns EXIT_SUCCESS on success, or EXIT_FAILURE if the server
+ *         could not be reached or answered with an error.
+ */
+static int Ask(const Config* config, const char* request) {
+  int status = DuServeAsk(config->ask, request, stdout);
+  if (status < 0) {
+    fprintf(stderr, "Error: Failed to query '%s': %s\n", config->ask,
+            strerror(errno));
+  }
+  return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Visitor that prints every entry handed over by the scanner, or read
+ *        back from an index, up to the configured depth. Entries are also
+ *        collected into the tree or the snapshot being saved, if any.
+ *
+ * @param entry Entry accounted by the scanner.
+ * @param ctx   Command line configuration.
+ *
+ * @return Returns 0 so the scan continues, or 1 if the entry could not be
+ *         saved.
+ */
+static int PrintEntry(const DuEntry* entry, void* ctx) {
+  Config* config = (Config*)ctx;
+
+  if (config->tree && DuTreeAdd(entry, config->tree)) {
+    return 1;
+  }
 
-    if (include_files) {
-      PrintDiskUsage(disk_usage_kb, rootpath);
+  if (config->snapshot && DuSnapshotAdd(entry, config->snapshot)) {
+    return 1;
+  }
+
+  if (config->metrics) {
+    return DuMetricsAdd(entry, config->metrics);
+  }
+
+  if (config->max_depth >= 0 && entry->depth > config->max_depth) {
+    return 0;
+  }
+
+  PrintDiskUsage(config, entry->disk_usage, entry->path);
+  return 0;
+}
+
+/**
+ * @brief Root source reading the next NUL-terminated name of a
+ *        `--files0-from` list. The last name may lack its terminator.
+ *
+ * @param source List being read.
+ *
+ * @return Returns the next root, or NULL at the end of the list or on error,
+ *         recorded in the list.
+ */
+static const char* NextRoot(void* source) {
+  RootList* list = (RootList*)source;
+  errno = 0;
+  ssize_t len = getdelim(&list->root, &list->size, '\0', list->file);
+  if (len < 0) {
+    if (ferror(list->file)) {
+      list->error = errno ? errno : EIO;
     }
-    return disk_usage_kb;
+    return NULL;
   }
 
-  DIR* dirp = opendir(rootpath);
-  if (!dirp) {
-    fprintf(stderr, "Error: Failed to open directory '%s'.\n", rootpath);
-    *error = errno;
+  if (list->root[0] == '\0') {
+    list->error = EINVAL;
+    return NULL;
+  }
+  return list->root;
+}
+
+/**
+ * @brief Visitor that prints an entry of a `--watch` sweep, up to the
+ *        configured depth. Removed entries are printed with `-` for a size.
+ *
+ * @param entry Entry whose total changed.
+ * @param ctx   Command line configuration.
+ *
+ * @return Always returns 0 so the watch continues.
+ */
+static int PrintUpdate(const DuEntry* entry, void* ctx) {
+  Config* config = (Config*)ctx;
+  if (config->max_depth >= 0 && entry->depth > config->max_depth) {
     return 0;
   }
 
-  total += disk_usage_kb;
+  config->updates++;
+  if (entry->disk_usage < 0) {
+    fputs("-\t", stdout);
+    PrintPath(config, entry->path);
+  } else {
+    PrintDiskUsage(config, entry->disk_usage, entry->path);
+  }
+  return 0;
+}
+
+/**
+ * @brief Ends the output of a `--watch` sweep that printed anything with an
+ *        empty line, and flushes it.
+ *
+ * @param sweep Work done by the sweep.
+ * @param ctx   Command line configuration.
+ *
+ * @return Always returns 0 so the watch continues.
+ */
+static int EndSweep(const DuSweep* sweep, void* ctx) {
+  (void)sweep;
+  Config* config = (Config*)ctx;
+  if (config->updates > 0) {
+    putchar(config->null ? '\0' : '\n');
+    fflush(stdout);
+    config->updates = 0;
+  }
+  return 0;
+}
+
+/**
+ * @brief Visitor that prints a change reported by a snapshot comparison, with
+ *        an explicit sign.
+ *
+ * @param entry Changed entry; `disk_usage` holds the delta in kilobytes.
+ * @param ctx   Command line configuration.
+ *
+ * @return Always returns 0 so the report continues.
+ */
+static int PrintDelta(const DuEntry* entry, void* ctx) {
+  printf("%+ld\t", entry->disk_usage);
+  PrintPath((const Config*)ctx, entry->path);
+  return 0;
+}
 
-  struct dirent* direntp;
-  while ((direntp = readdir(dirp)) && !(*error)) {
-    const char* dirname = direntp->d_name;
+/**
+ * @brief Prints an estimate in kilobytes followed by its 95% confidence
+ *        half-width.
+ *
+ * @param estimate Estimated subtree.
+ * @param ctx      Command line configuration.
+ *
+ * @return Always returns 0 so the report continues.
+ */
+static int PrintEstimate(const DuEstimate* estimate, void* ctx) {
+  printf("%.0f\t\u00b1%.0f\t", estimate->disk_usage, estimate->half_width);
+  PrintPath((const Config*)ctx, estimate->path);
+  return 0;
+}
 
-    // Avoid infinite traversal through file system
-    if (strcmp(dirname, ".") == 0 || strcmp(dirname, "..") == 0) {
-      continue;
+/**
+ * @brief Prints a top-N report. Provisional reports mark the entries still
+ *        being scanned with `~` and end with an empty line; the final report
+ *        is printed like `--index --top`.
+ *
+ * @param ranked Largest entries, largest first.
+ * @param count  Number of entries.
+ * @param final  Whether the scan is complete.
+ * @param ctx    Command line configuration.
+ *
+ * @return Always returns 0 so the scan continues.
+ */
+static int PrintRanking(const DuRanked* ranked, size_t count, int final,
+                        void* ctx) {
+  const Config* config = (const Config*)ctx;
+  for (size_t i = 0; i < count; i++) {
+    if (!ranked[i].complete) {
+      putchar('~');
     }
+    PrintDiskUsage(config, ranked[i].disk_usage, ranked[i].path);
+  }
+
+  if (!final) {
+    putchar(config->null ? '\0' : '\n');
+    fflush(stdout);
+  }
+  return 0;
+}
+
+/**
+ * @brief Prints a progress line on stderr, from the reporter thread, so it
+ *        touches nothing the scan writes to.
+ *
+ * @param snapshot Progress of the scan.
+ * @param ctx      Command line configuration, unused.
+ */
+static void PrintProgress(const DuProgressSnapshot* snapshot, void* ctx) {
+  static const char* kUnits[] = {"KiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
+  (void)ctx;
 
-    char pathname[kPathMax];
-    if (snprintf(pathname, kPathMax, "%s/%s", rootpath, dirname) < 0) {
+  double size = (double)snapshot->kilobytes;
+  size_t unit = 0;
+  while (size >= 1024 && unit + 1 < sizeof(kUnits) / sizeof(kUnits[0])) {
+    size /= 1024;
+    unit++;
+  }
+
+  fprintf(stderr, "Progress: %llu entries, %.1f %s in %.0f s (%.0f entries/s)",
+          (unsigned long long)snapshot->entries, size, kUnits[unit],
+          snapshot->elapsed, snapshot->rate);
+  if (*snapshot->dir) {
+    fprintf(stderr, ", reading '%s'", snapshot->dir);
+  }
+  fputs(".\n", stderr);
+}
+
+/**
+ * @brief Error callback that reports scanner failures on stderr, and records
+ *        them in the error log if any. Skipped failures that are logged are
+ *        not repeated on stderr.
+ *
+ * Each record of the log is a line of the operation, the errno value and the
+ * shell-quoted path, separated by tabs.
+ *
+ * @param path   Path the failed operation was applied to.
+ * @param op     Operation that failed.
+ * @param errnum errno value describing the failure.
+ * @param ctx    Command line configuration.
+ */
+static void PrintError(const char* path, DuOp op, int errnum, void* ctx) {
+  Config* config = (Config*)ctx;
+  config->failures++;
+
+  if (config->errors) {
+    fprintf(config->errors, "%s\t%d\t", OpName(op), errnum);
+    DuQuoteShell(path, config->errors);
+    fputc('\n', config->errors);
+    if (config->keep_going && DuSkippable(op)) {
+      return;
+    }
+  }
+
+  switch (op) {
+    case kDuOpStat: {
+      fprintf(stderr, "Error: Failed to get stat for '%s'.\n", path);
+      break;
+    }
+    case kDuOpOpenDir: {
+      fprintf(stderr, "Error: Failed to open directory '%s'.\n", path);
+      break;
+    }
+    case kDuOpPath: {
       fprintf(stderr,
-              "Error: Failed to concatenate rootpath with directory entry.\n");
-      *error = errno;
+              "Error: Failed to concatenate '%s' with directory entry.\n",
+              path);
+      break;
+    }
+    case kDuOpInsert: {
+      fprintf(stderr,
+              "Error: Unable to insert inode of '%s'. Resizing failed.\n",
+              path);
+      break;
+    }
+    case kDuOpAlloc: {
+      fprintf(stderr, "Error: Failed to initialize scan state: %s\n",
+              strerror(errnum));
+      break;
+    }
+    case kDuOpSpill: {
+      fprintf(stderr, "Error: Failed to spill hard links of '%s': %s\n",
+              path, strerror(errnum));
       break;
     }
-
-    total += dfs(pathname, seen, error, include_files);
   }
-  closedir(dirp);
+}
 
-  if (!(*error)) {
-    PrintDiskUsage(total, rootpath);
+/**
+ * @brief Names an operation in the error log.
+ */
+static const char* OpName(DuOp op) {
+  switch (op) {
+    case kDuOpStat: {
+      return "stat";
+    }
+    case kDuOpOpenDir: {
+      return "opendir";
+    }
+    case kDuOpPath: {
+      return "path";
+    }
+    case kDuOpInsert: {
+      return "insert";
+    }
+    case kDuOpAlloc: {
+      return "alloc";
+    }
+    case kDuOpSpill: {
+      return "spill";
+    }
   }
-
-  return total;
+  return "unknown";
 }
 
 /**
- * @brief Initializes a dynamic array to store inode numbers.
+ * @brief Opens the `--guide` index, reporting failures on stderr.
  *
- * @param size      Initial size of the dynamic array.
- * @param type_size Data type of elements to be stored in the array.
+ * @param config Command line configuration.
+ * @param guide  Index to open.
  *
- * @return Returns a pointer to the initialized DynamicArray, or NULL if the
- *         initialization fails.
+ * @return Returns 0 on success, or -1 on error.
  */
-DynamicArray* InitDynamicArray(size_t size, size_t type_size) {
-  DynamicArray* da = malloc(sizeof(DynamicArray));
-  if (!da) {
-    perror("malloc failed on struct allocation");
-    return NULL;
+static int OpenGuide(const Config* config, DuIndex* guide) {
+  if (DuIndexOpen(guide, config->guide) < 0) {
+    fprintf(stderr, "Error: Failed to open index '%s': %s\n", config->guide,
+            strerror(errno));
+    return -1;
   }
+  return 0;
+}
 
-  da->size = size;
-  da->len = 0;
-  da->data = malloc(size * type_size);
-  if (!da->data) {
-    free(da);
-    return NULL;
+/**
+ * @brief Creates the `--error-log` file, if any.
+ *
+ * @param config Command line configuration.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int OpenErrorLog(Config* config) {
+  if (config->error_log && !(config->errors = fopen(config->error_log, "w"))) {
+    fprintf(stderr, "Error: Failed to create error log '%s': %s\n",
+            config->error_log, strerror(errno));
+    return -1;
   }
-  return da;
+  return 0;
 }
 
 /**
- * @brief Frees the memory allocated for a DynamicArray.
+ * @brief Closes the error log once a scan is over, and notes the entries it
+ *        skipped.
+ *
+ * @param config Command line configuration.
+ * @param status Exit status of the scan.
  *
- * @param da Pointer to the DynamicArray to be freed.
+ * @return Returns the exit status: kExitPartial instead of EXIT_SUCCESS if
+ *         entries were skipped, or EXIT_FAILURE if the log failed.
  */
-void FreeDynamicArray(DynamicArray* da) {
-  if (da) {
-    if (da->data) {
-      free(da->data);
+static int CloseErrorLog(Config* config, int status) {
+  // Every failure was skipped, so the totals are those of what was readable
+  if (status == EXIT_SUCCESS && config->failures > 0) {
+    fprintf(stderr, "Note: %zu entries could not be read and were skipped.\n",
+            config->failures);
+    status = kExitPartial;
+  }
+
+  if (config->errors) {
+    if (fclose(config->errors) != 0 && status != EXIT_FAILURE) {
+      fprintf(stderr, "Error: Failed to write error log '%s': %s\n",
+              config->error_log, strerror(errno));
+      status = EXIT_FAILURE;
     }
-    free(da);
+    config->errors = NULL;
   }
+  return status;
+}
+
+/**
+ * @brief Installs `RequestStop` for SIGINT and SIGTERM, without SA_RESTART so
+ *        that the signal also interrupts a wait.
+ */
+static void CatchStop(void) {
+  struct sigaction action = {.sa_handler = RequestStop};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 }
 
 /**
- * @brief Searches for an inode in a DynamicArray.
+ * @brief Signal handler asking a long-running mode to stop.
+ */
+static void RequestStop(int signum) {
+  (void)signum;
+  stop_requested = 1;
+}
+
+/**
+ * @brief Parses a non-negative decimal count.
  *
- * @param da  Pointer to the DynamicArray to search.
- * @param ino Inode number to search for.
+ * @param arg   String to parse.
+ * @param value Receives the parsed value.
  *
- * @return Returns a pointer to the inode if found, or NULL if not found or if
- *         the DynamicArray is NULL.
+ * @return Returns 0 on success, or -1 if `arg` is not a non-negative number.
  */
-ino_t* SearchInode(DynamicArray* da, ino_t ino) {
-  if (!da) {
-    return NULL;
+static int ParseCount(const char* arg, long* value) {
+  char* end;
+  errno = 0;
+  long result = strtol(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || result < 0) {
+    return -1;
   }
 
-  size_t i = 0;
-  ino_t* inodes = (ino_t*)da->data;
+  *value = result;
+  return 0;
+}
 
-  while (i < da->len) {
-    if (inodes[i] == ino) {
-      return &inodes[i];
-    }
-    i++;
+/**
+ * @brief Parses a rate strictly between 0 and 1, such as "0.001".
+ *
+ * @param arg   String to parse.
+ * @param value Receives the parsed value.
+ *
+ * @return Returns 0 on success, or -1 if `arg` is not a valid rate.
+ */
+static int ParseRate(const char* arg, double* value) {
+  char* end;
+  errno = 0;
+  double result = strtod(arg, &end);
+  if (errno || end == arg || *end != '\0' || !(result > 0 && result < 1)) {
+    return -1;
   }
-  return NULL;
+
+  *value = result;
+  return 0;
 }
 
 /**
- * @brief Inserts an inode into a DynamicArray, resizing the array if necessary.
+ * @brief Parses a signed size in bytes, with an optional K, M, G, T, P or E
+ *        suffix. The suffix alone or followed by "iB" means powers of 1024,
+ *        followed by "B" powers of 1000.
  *
- * @param da  Pointer to the DynamicArray where the inode should be inserted.
- * @param ino Inode number to insert.
+ * @param arg   String to parse, such as "-64", "512K" or "1GB".
+ * @param value Receives the size in bytes.
  *
- * @return Returns 0 on successful insertion, or -1 if the array could not be
- *         resized.
+ * @return Returns 0 on success, or -1 if `arg` is not a valid size.
  */
-int InsertInode(DynamicArray* da, ino_t ino) {
-  if (da->size == da->len) {
-    void* dummy = realloc(da->data, (da->size * 2) * sizeof(ino_t));
-    if (!dummy) {
-      // Cleanup is taken care of by caller
+static int ParseSize(const char* arg, long long* value) {
+  const char* kUnits = "KMGTPE";
+
+  char* end;
+  errno = 0;
+  long long result = strtoll(arg, &end, 10);
+  if (errno || end == arg) {
+    return -1;
+  }
+
+  if (*end != '\0') {
+    const char* unit = strchr(kUnits, *end);
+    if (!unit) {
+      return -1;
+    }
+
+    long long base = 1024;
+    if (strcmp(end + 1, "B") == 0) {
+      base = 1000;
+    } else if (end[1] != '\0' && strcmp(end + 1, "iB") != 0) {
       return -1;
     }
 
-    da->data = dummy;
-    da->size *= 2;
+    for (const char* u = kUnits; u <= unit; u++) {
+      if (result > LLONG_MAX / base || result < LLONG_MIN / base) {
+        return -1;
+      }
+      result *= base;
+    }
   }
-  ino_t* inodes = (ino_t*)da->data;
-  inodes[da->len] = ino;
-  da->len++;
 
+  *value = result;
   return 0;
 }
 
@@ -286,18 +1421,167 @@ int InsertInode(DynamicArray* da, ino_t ino) {
  * @param cmd The name of the command to display in the usage information.
  */
 static inline void PrintUsage(const char* cmd) {
-  fprintf(stderr, "Usage: %s [-a] [FILE]\n", cmd);
+  fprintf(stderr, "Usage: %s [OPTION]... [FILE]\n", cmd);
+  fprintf(stderr, "       %s --resume=FILE [OPTION]...\n", cmd);
+  fprintf(stderr, "       %s --files0-from=FILE [OPTION]...\n", cmd);
+  fprintf(stderr, "       %s --index=INDEX [-d N | --top=N] [FILE]\n", cmd);
+  fprintf(stderr, "       %s --diff [--top=N] OLD NEW\n", cmd);
+  fprintf(stderr,
+          "       %s --serve=SOCKET [--refresh=SECONDS] [OPTION]... [FILE]\n",
+          cmd);
+  fprintf(stderr, "       %s --ask=SOCKET REQUEST\n", cmd);
+  fprintf(stderr, "       %s --watch=SECONDS [OPTION]... [FILE]\n", cmd);
+  fprintf(stderr,
+          "       %s --estimate [--time-budget=SECONDS] "
+          "[--error-budget=PERCENT] [FILE]\n",
+          cmd);
   fprintf(stderr, "Options:\n");
   fprintf(stderr,
-          "    -a    write counts for all files, not just directories\n");
+          "    -a, --all             write counts for all files, not just "
+          "directories\n");
+  fprintf(stderr,
+          "    -0, --null            end each output line with NUL, not "
+          "newline\n");
+  fprintf(stderr,
+          "        --escape          quote file names that the shell would "
+          "not read verbatim\n");
+  fprintf(stderr,
+          "    -l, --count-links     count sizes many times if hard linked\n");
+  fprintf(stderr,
+          "    -L, --dereference     follow all symbolic links, counting "
+          "each entry once\n");
+  fprintf(stderr,
+          "    -H, --dereference-args\n"
+          "                          follow only symbolic links given on the "
+          "command line\n");
+  fprintf(stderr,
+          "    -P, --no-dereference  follow no symbolic links (default)\n");
+  fprintf(stderr,
+          "    -d, --max-depth=N     print totals only N or fewer levels "
+          "below FILE\n");
+  fprintf(stderr,
+          "    -t, --threshold=SIZE  exclude entries smaller than SIZE if "
+          "positive,\n"
+          "                          or larger than -SIZE if negative\n");
+  fprintf(stderr,
+          "        --max-ops-per-sec=N   stat at most N entries per second\n");
+  fprintf(stderr,
+          "        --max-dirs-per-sec=N  open at most N directories per "
+          "second\n");
+  fprintf(stderr,
+          "        --adaptive-throttle   lower those limits while stat "
+          "latency rises\n");
+  fprintf(stderr,
+          "        --link-memory=SIZE  spill hard-link keys beyond SIZE to "
+          "disk\n");
+  fprintf(stderr,
+          "        --approx-links=N  deduplicate hard links approximately, "
+          "sized for N i-nodes\n"
+          "                          at --link-fp-rate=RATE (default: "
+          "0.01)\n");
+  fprintf(stderr,
+          "        --threads=N       scan with N threads, in the order of a "
+          "serial scan\n");
+  fprintf(stderr,
+          "        --unordered       with --threads, print directories as "
+          "they complete\n");
+  fprintf(stderr,
+          "        --keep-going      skip unreadable entries, exiting with "
+          "status 2\n");
+  fprintf(stderr,
+          "        --error-log=FILE  record each failure in FILE\n");
+  fprintf(stderr,
+          "        --exceeds=SIZE    only tell whether FILE exceeds SIZE, "
+          "stopping as soon\n"
+          "                          as it does (exit status 0 if so, 3 if "
+          "not)\n");
+  fprintf(stderr,
+          "        --guide=INDEX     visit the largest entries in INDEX "
+          "first\n");
+  fprintf(stderr,
+          "        --serve=SOCKET    rescan FILE every --refresh seconds "
+          "(default: 3600),\n"
+          "                          answering SIZE, TOP, LIST and INFO "
+          "requests on SOCKET\n");
+  fprintf(stderr,
+          "        --ask=SOCKET      send REQUEST to a server and print its "
+          "answer\n");
+  fprintf(stderr,
+          "        --format=FORMAT   print 'du' lines (default) or "
+          "'prometheus' gauges of the\n"
+          "                          bytes and i-nodes of each directory, "
+          "within -d\n");
+  fprintf(stderr,
+          "        --output=FILE     with --format=prometheus, replace FILE "
+          "once the scan ends\n");
+  fprintf(stderr,
+          "        --files0-from=FILE  scan the NUL-terminated file names "
+          "listed in FILE,\n"
+          "                          or on standard input if FILE is -\n");
+  fprintf(stderr,
+          "        --watch=SECONDS   keep FILE in memory and sweep its "
+          "directories every SECONDS,\n"
+          "                          printing the entries that changed "
+          "('-' if removed)\n");
+  fprintf(stderr,
+          "        --progress        report entries, size, rate and current "
+          "directory on\n"
+          "                          standard error every second (SIGUSR1 "
+          "reports once)\n");
+  fprintf(stderr,
+          "        --save-index=INDEX  also save the scan as an index\n");
+  fprintf(stderr,
+          "        --index=INDEX     answer from a saved index instead of "
+          "scanning\n");
+  fprintf(stderr,
+          "        --save-snapshot=SNAPSHOT  also save the scan as a "
+          "snapshot\n");
+  fprintf(stderr,
+          "        --diff            print the changes between two "
+          "snapshots\n");
+  fprintf(stderr,
+          "        --top=N           print the N largest entries of FILE, "
+          "--index or --diff;\n"
+          "                          scanning FILE, list them every second "
+          "as they settle\n");
+  fprintf(stderr,
+          "        --estimate        estimate FILE and its subdirectories by "
+          "sampling,\n"
+          "                          until the budgets are met (default: 5%% "
+          "error)\n");
+  fprintf(stderr,
+          "        --checkpoint=FILE  save the scan's progress to FILE every "
+          "--checkpoint-interval\n"
+          "                          seconds (default: 60)\n");
+  fprintf(stderr,
+          "        --resume=FILE     continue the scan saved in FILE\n");
 }
 
 /**
  * @brief  Prints the disk usage of a file or directory in kilobytes.
  *
+ * @param config     Command line configuration, selecting the path format.
  * @param disk_usage Disk usage in kilobytes.
  * @param path       Path of the directory or file.
  */
-static inline void PrintDiskUsage(blkcnt_t disk_usage, const char* path) {
-  printf("%ld\t%s\n", disk_usage, path);
+static inline void PrintDiskUsage(const Config* config, blkcnt_t disk_usage,
+                                  const char* path) {
+  printf("%ld\t", disk_usage);
+  PrintPath(config, path);
+}
+
+/**
+ * @brief  Prints a path, shell-quoted with `--escape`, and ends the line with
+ *         a NUL byte with `--null` or a newline otherwise.
+ *
+ * @param config Command line configuration.
+ * @param path   Path to print.
+ */
+static inline void PrintPath(const Config* config, const char* path) {
+  if (config->escape) {
+    DuQuoteShell(path, stdout);
+  } else {
+    fputs(path, stdout);
+  }
+  putchar(config->null ? '\0' : '\n');
 }
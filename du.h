@@ -1,39 +1,223 @@
 #ifndef DU_H_
 #define DU_H_
 
-#include <dirent.h>     // opendir, readdir, closedir, dirent
 #include <errno.h>      // errno
-#include <stdio.h>      // fprintf, printf, snprintf
-#include <stdlib.h>     // EXIT_FAILURE, EXIT_SUCCESS
-#include <string.h>     // strerror, strcmp
-#include <sys/stat.h>   // lstat, stat, S_IFMT, S_IFDIR, S_IFREG
-#include <sys/types.h>  // ino_t
-#include <unistd.h>     // getopt, optind
-
-typedef struct DynamicArray {
-  size_t size;
-  size_t len;
-  void *data;
-} DynamicArray;
+#include <getopt.h>     // getopt_long, option
+#include <limits.h>     // PATH_MAX, INT_MAX, LLONG_MAX, LLONG_MIN
+#include <signal.h>     // sigaction, sig_atomic_t, SIGINT, SIGTERM
+#include <stdio.h>      // fprintf, fputs, getdelim, printf, putchar, remove
+#include <stdlib.h>     // EXIT_FAILURE, EXIT_SUCCESS, strtod, strtol, strtoll
+#include <string.h>     // strchr, strcmp, strerror
+#include <sys/types.h>  // blkcnt_t, ssize_t
+#include <time.h>       // clock_gettime, struct timespec
+#include <unistd.h>     // optind
+
+#include "estimate.h"
+#include "explore.h"
+#include "filter.h"
+#include "index.h"
+#include "libdu.h"
+#include "metrics.h"
+#include "progress.h"
+#include "quote.h"
+#include "server.h"
+#include "snapshot.h"
+#include "watch.h"
 
 extern int optind;
 
-const size_t kPathMax = 512;  // bytes
-const int kMaxArgs = 3;
+static const long kCheckpointInterval = 60;  // seconds
+static const double kLinkFpRate = 0.01;
+static const long kMaxThreads = 256;
+static const long kServeRefresh = 3600;  // seconds
+static const double kTopInterval = 1;  // seconds between provisional lists
+static const double kProgressInterval = 1;  // seconds between progress lines
+static const int kExitPartial = 2;  // the scan skipped unreadable entries
+static const int kExitWithin = 3;   // the tree does not exceed `--exceeds`
+
+/**
+ * @brief Command line configuration, also handed to the callbacks.
+ */
+typedef struct Config {
+  int include_files;
+  int count_links;            // count every link of a hard-linked file
+  DuFollow follow;            // symbolic links to follow, see DuOptions
+  int null;                   // end lines with NUL rather than newline
+  int escape;                 // quote paths for the shell
+  int max_depth;              // -1 for no limit
+  long long threshold;        // bytes, see DuOptions::threshold
+  long max_ops_per_sec;       // 0 for no limit
+  long max_dirs_per_sec;      // 0 for no limit
+  int adaptive_throttle;
+  const char *save_index;     // index file to write, or NULL
+  const char *index;          // index file to query instead of scanning
+  const char *save_snapshot;  // snapshot file to write, or NULL
+  int diff;                   // compare two snapshots instead of scanning
+  int estimate;               // estimate by sampling instead of scanning
+  long time_budget;           // seconds, for `estimate`
+  long error_budget;          // percent, for `estimate`
+  const char *checkpoint;     // checkpoint file to keep up to date, or NULL
+  long checkpoint_interval;   // seconds between checkpoints
+  const char *resume;         // checkpoint file to continue from, or NULL
+  long long link_memory;      // bytes, see DuOptions::link_memory
+  long approx_links;          // expected linked inodes, 0 for exact dedup
+  double link_fp_rate;        // false-positive rate for `approx_links`
+  long threads;               // scanning threads, 0 or 1 for a serial scan
+  int unordered;              // print threaded scans in completion order
+  int keep_going;             // skip unreadable entries rather than fail
+  const char *error_log;      // file to record failures in, or NULL
+  long long exceeds;          // bytes; only tell whether the tree exceeds
+                              // this, 0 to print the usage as usual
+  const char *guide;          // index of an earlier scan ordering siblings
+                              // largest first, or NULL
+  const char *serve;          // socket to answer queries on, or NULL
+  long refresh;               // seconds between scans when serving, -1 for
+                              // the default
+  const char *ask;            // socket of a server to query, or NULL
+  int prometheus;             // print gauges in the Prometheus text format
+  const char *output;         // file to replace with the gauges, or NULL
+  const char *files0_from;    // file of NUL-separated roots, "-" for stdin,
+                              // or NULL
+  long watch;                 // seconds between sweeps, 0 to scan once
+  int progress;               // report progress every kProgressInterval
+  FILE *errors;               // open `error_log`
+  size_t failures;            // failures reported so far
+  size_t top;                 // number of largest entries to report, or 0
+  DuTree *tree;               // collects the scan for `save_index`
+  DuSnapshot *snapshot;       // streams the scan to `save_snapshot`
+  DuMetrics *metrics;         // streams the gauges with `prometheus`
+  size_t updates;             // entries printed by the current `watch` sweep
+} Config;
+
+/**
+ * @brief A `--files0-from` list being read, one root at a time.
+ */
+typedef struct RootList {
+  FILE *file;
+  char *root;   // last root read
+  size_t size;  // bytes allocated for `root`
+  int error;    // errno if the list could not be read, EINVAL if it holds
+                // an empty name, 0 otherwise
+} RootList;
+
+// Values of the options that only have a long form
+enum {
+  kOptSaveIndex = 256,
+  kOptIndex,
+  kOptTop,
+  kOptSaveSnapshot,
+  kOptDiff,
+  kOptMaxOps,
+  kOptMaxDirs,
+  kOptAdaptive,
+  kOptEstimate,
+  kOptTimeBudget,
+  kOptErrorBudget,
+  kOptCheckpoint,
+  kOptCheckpointInterval,
+  kOptResume,
+  kOptLinkMemory,
+  kOptApproxLinks,
+  kOptLinkFpRate,
+  kOptThreads,
+  kOptEscape,
+  kOptUnordered,
+  kOptKeepGoing,
+  kOptErrorLog,
+  kOptExceeds,
+  kOptGuide,
+  kOptServe,
+  kOptRefresh,
+  kOptAsk,
+  kOptFormat,
+  kOptOutput,
+  kOptFiles0From,
+  kOptWatch,
+  kOptProgress,
+};
+
+static const struct option kLongOptions[] = {
+    {"all", no_argument, NULL, 'a'},
+    {"null", no_argument, NULL, '0'},
+    {"count-links", no_argument, NULL, 'l'},
+    {"dereference", no_argument, NULL, 'L'},
+    {"dereference-args", no_argument, NULL, 'H'},
+    {"no-dereference", no_argument, NULL, 'P'},
+    {"escape", no_argument, NULL, kOptEscape},
+    {"max-depth", required_argument, NULL, 'd'},
+    {"threshold", required_argument, NULL, 't'},
+    {"save-index", required_argument, NULL, kOptSaveIndex},
+    {"index", required_argument, NULL, kOptIndex},
+    {"top", required_argument, NULL, kOptTop},
+    {"save-snapshot", required_argument, NULL, kOptSaveSnapshot},
+    {"diff", no_argument, NULL, kOptDiff},
+    {"max-ops-per-sec", required_argument, NULL, kOptMaxOps},
+    {"max-dirs-per-sec", required_argument, NULL, kOptMaxDirs},
+    {"adaptive-throttle", no_argument, NULL, kOptAdaptive},
+    {"estimate", no_argument, NULL, kOptEstimate},
+    {"time-budget", required_argument, NULL, kOptTimeBudget},
+    {"error-budget", required_argument, NULL, kOptErrorBudget},
+    {"checkpoint", required_argument, NULL, kOptCheckpoint},
+    {"checkpoint-interval", required_argument, NULL, kOptCheckpointInterval},
+    {"resume", required_argument, NULL, kOptResume},
+    {"link-memory", required_argument, NULL, kOptLinkMemory},
+    {"approx-links", required_argument, NULL, kOptApproxLinks},
+    {"link-fp-rate", required_argument, NULL, kOptLinkFpRate},
+    {"threads", required_argument, NULL, kOptThreads},
+    {"unordered", no_argument, NULL, kOptUnordered},
+    {"keep-going", no_argument, NULL, kOptKeepGoing},
+    {"error-log", required_argument, NULL, kOptErrorLog},
+    {"exceeds", required_argument, NULL, kOptExceeds},
+    {"guide", required_argument, NULL, kOptGuide},
+    {"serve", required_argument, NULL, kOptServe},
+    {"refresh", required_argument, NULL, kOptRefresh},
+    {"ask", required_argument, NULL, kOptAsk},
+    {"format", required_argument, NULL, kOptFormat},
+    {"output", required_argument, NULL, kOptOutput},
+    {"files0-from", required_argument, NULL, kOptFiles0From},
+    {"watch", required_argument, NULL, kOptWatch},
+    {"progress", no_argument, NULL, kOptProgress},
+    {NULL, 0, NULL, 0},
+};
 
 // Program-Specific Functions
-int du(const char *rootpath, int include_files);
-blkcnt_t dfs(const char *rootpath, DynamicArray *seen, int *error,
-             int include_files);
+static int Scan(Config *config, const char *rootpath);
+static int ScanCheckpointed(Config *config, const DuOptions *opts,
+                            const char *rootpath);
+static int ScanRoots(Config *config, const DuOptions *opts);
+static int Query(Config *config, const char *path);
+static int Diff(Config *config, const char *old_path, const char *new_path);
+static int Estimate(Config *config, const char *rootpath);
+static int Explore(Config *config, const char *rootpath);
+static int Serve(Config *config, const char *rootpath);
+static int Ask(const Config *config, const char *request);
+static int Watch(Config *config, const char *rootpath);
 
-// DynamicArray-Specific Functions
-DynamicArray *InitDynamicArray(size_t size, size_t type_size);
-void FreeDynamicArray(DynamicArray *da);
-ino_t *SearchInode(DynamicArray *da, ino_t ino);
-int InsertInode(DynamicArray *da, ino_t ino);
+// Callbacks
+static int PrintEntry(const DuEntry *entry, void *ctx);
+static const char *NextRoot(void *source);
+static int PrintUpdate(const DuEntry *entry, void *ctx);
+static int EndSweep(const DuSweep *sweep, void *ctx);
+static void PrintError(const char *path, DuOp op, int errnum, void *ctx);
+static int PrintDelta(const DuEntry *entry, void *ctx);
+static int PrintEstimate(const DuEstimate *estimate, void *ctx);
+static int PrintRanking(const DuRanked *ranked, size_t count, int final,
+                        void *ctx);
+static void PrintProgress(const DuProgressSnapshot *snapshot, void *ctx);
 
 // Utility Functions
+static void CatchStop(void);
+static void RequestStop(int signum);
+static int ParseCount(const char *arg, long *value);
+static int ParseSize(const char *arg, long long *value);
+static int ParseRate(const char *arg, double *value);
 static inline void PrintUsage(const char *cmd);
-static inline void PrintDiskUsage(blkcnt_t disk_usage, const char *path);
+static inline void PrintDiskUsage(const Config *config, blkcnt_t disk_usage,
+                                  const char *path);
+static inline void PrintPath(const Config *config, const char *path);
+static const char *OpName(DuOp op);
+static int OpenGuide(const Config *config, DuIndex *guide);
+static int OpenErrorLog(Config *config);
+static int CloseErrorLog(Config *config, int status);
 
-#endif  // DU_H_
\ No newline at end of file
+#endif  // DU_H_
@@ -0,0 +1,541 @@
+/**
+ * @file   estimate.c
+ *
+ * @brief  Approximate disk usage by random sampling. The subtrees below the
+ *         root are sampled separately (stratified sampling) with Knuth-style
+ *         random probes: each probe walks from the top of a subtree down a
+ *         random chain of subdirectories, weighting the files found at every
+ *         level by the inverse of the probability of reaching it, which is an
+ *         unbiased estimate of the subtree size. Probes are spent
+ *         where they reduce the variance most until the error or time budget
+ *         is met.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "estimate.h"
+
+#include <dirent.h>     // opendir, readdir, closedir, dirent
+#include <errno.h>      // errno, ENOMEM
+#include <math.h>       // INFINITY, sqrt
+#include <stdint.h>     // uint64_t
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free
+#include <string.h>     // strcmp, strdup, strlen
+#include <time.h>       // clock_gettime
+
+static const double kZ95 = 1.96;         // normal quantile of a 95% interval
+static const double kDefaultError = 0.05;
+static const size_t kMinProbes = 10;      // per stratum, to estimate variance
+static const size_t kPathMax = 4096;     // bytes
+
+/**
+ * @brief A subdirectory a probe may descend into. Probes pick subdirectories
+ *        with probability proportional to their link count, a cheap proxy for
+ *        the number of directories below them, which keeps rare large
+ *        subtrees from dominating the variance.
+ */
+typedef struct Subdir {
+  char* name;
+  double cumulative;      // sum of the weights up to and including this one
+} Subdir;
+
+/**
+ * @brief What a probe needs to know about a directory, cached so the upper
+ *        levels that every probe crosses are only read once.
+ */
+typedef struct DirSummary {
+  char* path;
+  blkcnt_t disk_usage;    // kilobytes, the directory and its non-directories
+  Subdir* subdirs;
+  size_t subdir_count;
+  int unreadable;         // reading it failed, and was reported once
+  struct DirSummary* next;
+} DirSummary;
+
+/**
+ * @brief Running mean and variance of the probes of one subtree. Its top is
+ *        only read once it is first probed, so a root with many
+ *        subdirectories does not overrun the time budget before probing.
+ */
+typedef struct Stratum {
+  const char* name;       // of the top, below the root
+  DirSummary* top;        // NULL until first probed
+  int unreadable;         // the top could not be read
+  size_t probes;
+  double mean;
+  double m2;              // sum of squared deviations (Welford)
+} Stratum;
+
+typedef struct Estimator {
+  const DuEstimateOptions* opts;
+  DirSummary** buckets;   // hash table of cached directories
+  size_t bucket_count;
+  size_t summary_count;
+  uint64_t rng;           // xorshift64 state
+  int error;              // errno of the first failure, 0 if none
+} Estimator;
+
+static DirSummary* Summarize(Estimator* est, const char* path);
+static void Cache(Estimator* est, DirSummary* summary);
+static int Unsettled(const Stratum* stratum);
+static void AddProbe(Stratum* stratum, double sample);
+static double Probe(Estimator* est, DirSummary* top);
+static int Grow(Estimator* est);
+static uint64_t Hash(const char* path);
+static uint64_t Random(Estimator* est);
+static double Variance(const Stratum* stratum);
+static double Elapsed(const struct timespec* start);
+static void FreeSummaries(Estimator* est);
+static void Fail(Estimator* est, const char* path, DuOp op, int errnum);
+
+/**
+ * @brief Estimates the disk usage of `rootpath` and of each subdirectory
+ *        directly below it.
+ *
+ * The files directly in the root are counted exactly. Probing stops once the
+ * 95% confidence half-width of the root estimate falls below `error_budget`
+ * times the estimate, or once `time_budget` has elapsed, whichever comes
+ * first; with neither set, a 5% error budget is used. Every subdirectory
+ * first gets kMinProbes probes in turn, or one if it has no subdirectories
+ * and so is exact, but the time budget cuts that short too: subdirectories
+ * not probed yet are then estimated as the mean of those probed, and those
+ * with too few probes to tell their variance get an infinite half-width.
+ * Hard links are not deduplicated.
+ *
+ * @param rootpath The path to the directory or file to estimate.
+ * @param opts     Budgets and callbacks.
+ *
+ * @return Returns 0 on success, 1 if the callback stopped the report, or -1 if
+ *         the root could not be read.
+ */
+int DuEstimateRun(const char* rootpath, const DuEstimateOptions* opts) {
+  Estimator est = {.opts = opts, .rng = opts->seed};
+  if (est.rng == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    est.rng = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ 1;
+  }
+
+  double error_budget = opts->error_budget;
+  if (error_budget <= 0 && opts->time_budget <= 0) {
+    error_budget = kDefaultError;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (Grow(&est) < 0) {
+    Fail(&est, rootpath, kDuOpAlloc, ENOMEM);
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (lstat(rootpath, &statbuf) < 0) {
+    Fail(&est, rootpath, kDuOpStat, errno);
+    FreeSummaries(&est);
+    return -1;
+  }
+
+  if (!S_ISDIR(statbuf.st_mode)) {
+    FreeSummaries(&est);
+    DuEstimate exact = {rootpath, 0, (double)(statbuf.st_blocks / 2), 0, 0};
+    return (opts->report && opts->report(&exact, opts->ctx)) ? 1 : 0;
+  }
+
+  DirSummary* root = Summarize(&est, rootpath);
+  if (!root) {
+    FreeSummaries(&est);
+    return -1;
+  }
+
+  Stratum* strata = calloc(root->subdir_count + 1, sizeof(Stratum));
+  if (!strata) {
+    FreeSummaries(&est);
+    Fail(&est, rootpath, kDuOpAlloc, ENOMEM);
+    return -1;
+  }
+
+  size_t count = root->subdir_count;
+  for (size_t i = 0; i < count; i++) {
+    strata[i].name = root->subdirs[i].name;
+  }
+
+  // Give every stratum its first probes in turn, so that a time budget
+  // running out leaves them evenly probed
+  int late = 0;
+  for (size_t round = 0; round < kMinProbes && !late; round++) {
+    for (size_t i = 0; i < count && !late; i++) {
+      Stratum* s = &strata[i];
+      if (s->unreadable || !Unsettled(s)) {
+        continue;
+      }
+
+      if (!s->top) {
+        char path[kPathMax];
+        snprintf(path, kPathMax, "%s/%s", rootpath, s->name);
+        if (!(s->top = Summarize(&est, path))) {
+          s->unreadable = 1;
+          continue;
+        }
+      }
+      AddProbe(s, Probe(&est, s->top));
+      late = opts->time_budget > 0 && Elapsed(&start) >= opts->time_budget;
+    }
+  }
+
+  // Then spend each probe on the stratum whose variance it reduces most
+  while (!late) {
+    double total = (double)root->disk_usage;
+    double variance = 0;
+    Stratum* next = NULL;
+    double best_gain = 0;
+    for (size_t i = 0; i < count; i++) {
+      Stratum* s = &strata[i];
+      if (s->unreadable) {
+        continue;
+      }
+
+      double var = Variance(s);
+      total += s->mean;
+      variance += var / (double)s->probes;
+      double gain = var / ((double)s->probes * (double)(s->probes + 1));
+      if (gain > best_gain) {
+        best_gain = gain;
+        next = s;
+      }
+    }
+
+    double half_width = kZ95 * sqrt(variance);
+    int precise = error_budget > 0 && half_width <= error_budget * total;
+    if (!next || precise) {
+      break;
+    }
+
+    AddProbe(next, Probe(&est, next->top));
+    late = opts->time_budget > 0 && Elapsed(&start) >= opts->time_budget;
+  }
+
+  // Strata the time budget left unprobed are taken to be average ones
+  double probed_mean = 0;
+  size_t probed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (strata[i].probes > 0) {
+      probed_mean += (strata[i].mean - probed_mean) / (double)++probed;
+    }
+  }
+
+  int status = 0;
+  double total = (double)root->disk_usage;
+  double variance = 0;
+  size_t probes = 0;
+  for (size_t i = 0; i < count && status == 0; i++) {
+    Stratum* s = &strata[i];
+    if (s->unreadable) {
+      continue;
+    }
+
+    double mean = s->probes > 0 ? s->mean : probed_mean;
+    double var = Unsettled(s) && s->probes < 2
+                     ? INFINITY
+                     : Variance(s) / (double)s->probes;
+    total += mean;
+    variance += var;
+    probes += s->probes;
+
+    char path[kPathMax];
+    snprintf(path, kPathMax, "%s/%s", rootpath, s->name);
+    DuEstimate estimate = {path, 1, mean, kZ95 * sqrt(var), s->probes};
+    if (opts->report && opts->report(&estimate, opts->ctx)) {
+      status = 1;
+    }
+  }
+
+  if (status == 0) {
+    DuEstimate estimate = {rootpath, 0, total, kZ95 * sqrt(variance), probes};
+    if (opts->report && opts->report(&estimate, opts->ctx)) {
+      status = 1;
+    }
+  }
+
+  free(strata);
+  FreeSummaries(&est);
+  return status;
+}
+
+/**
+ * @brief Reads a directory, or returns its cached summary. A directory that
+ *        cannot be read is cached as such, so it is reported only once
+ *        however many probes reach it.
+ *
+ * @param est  Estimator holding the cache.
+ * @param path Path of the directory.
+ *
+ * @return Returns the summary, or NULL if the directory could not be read.
+ */
+static DirSummary* Summarize(Estimator* est, const char* path) {
+  uint64_t hash = Hash(path) & (est->bucket_count - 1);
+  for (DirSummary* s = est->buckets[hash]; s; s = s->next) {
+    if (strcmp(s->path, path) == 0) {
+      return s->unreadable ? NULL : s;
+    }
+  }
+
+  DirSummary* summary = calloc(1, sizeof(DirSummary));
+  DynamicArray* subdirs = InitDynamicArray(8, sizeof(Subdir));
+  if (!summary || !subdirs || !(summary->path = strdup(path))) {
+    free(summary);
+    FreeDynamicArray(subdirs);
+    Fail(est, path, kDuOpAlloc, ENOMEM);
+    return NULL;
+  }
+
+  struct stat statbuf;
+  DIR* dirp = NULL;
+  if (lstat(path, &statbuf) < 0) {
+    Fail(est, path, kDuOpStat, errno);
+  } else if (!(dirp = opendir(path))) {
+    Fail(est, path, kDuOpOpenDir, errno);
+  }
+  if (!dirp) {
+    FreeDynamicArray(subdirs);
+    summary->unreadable = 1;
+    Cache(est, summary);
+    return NULL;
+  }
+  summary->disk_usage = statbuf.st_blocks / 2;
+
+  double cumulative = 0;
+  struct dirent* direntp;
+  while ((direntp = readdir(dirp))) {
+    const char* name = direntp->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    char child[kPathMax];
+    snprintf(child, kPathMax, "%s/%s", path, name);
+    struct stat childbuf;
+    if (lstat(child, &childbuf) < 0) {
+      Fail(est, child, kDuOpStat, errno);
+      continue;
+    }
+
+    if (!S_ISDIR(childbuf.st_mode)) {
+      summary->disk_usage += childbuf.st_blocks / 2;
+      continue;
+    }
+
+    char* copy = strdup(name);
+    if (!copy || ReserveDynamicArray(subdirs, 1, sizeof(Subdir)) < 0) {
+      free(copy);
+      Fail(est, path, kDuOpAlloc, ENOMEM);
+      break;
+    }
+
+    // A directory links to itself and to each of its subdirectories
+    double links = (double)childbuf.st_nlink;
+    cumulative += (links > 2) ? links - 1 : 1;
+    ((Subdir*)subdirs->data)[subdirs->len++] = (Subdir){copy, cumulative};
+  }
+  closedir(dirp);
+
+  // Hand the name array over to the summary
+  summary->subdirs = (Subdir*)subdirs->data;
+  summary->subdir_count = subdirs->len;
+  free(subdirs);
+
+  Cache(est, summary);
+  return summary;
+}
+
+/**
+ * @brief Adds a summary to the cache.
+ */
+static void Cache(Estimator* est, DirSummary* summary) {
+  // A failed resize only makes the chains longer
+  if (est->summary_count >= est->bucket_count) {
+    Grow(est);
+  }
+  uint64_t hash = Hash(summary->path) & (est->bucket_count - 1);
+  summary->next = est->buckets[hash];
+  est->buckets[hash] = summary;
+  est->summary_count++;
+}
+
+/**
+ * @brief Tells whether a stratum still needs its first probes: kMinProbes to
+ *        estimate its variance, or a single one if its top has no
+ *        subdirectories, every probe of it then giving the same exact size.
+ */
+static int Unsettled(const Stratum* stratum) {
+  if (stratum->top && stratum->top->subdir_count == 0) {
+    return stratum->probes == 0;
+  }
+  return stratum->probes < kMinProbes;
+}
+
+/**
+ * @brief Adds a probe to the running mean and variance of a stratum.
+ */
+static void AddProbe(Stratum* stratum, double sample) {
+  stratum->probes++;
+  double delta = sample - stratum->mean;
+  stratum->mean += delta / (double)stratum->probes;
+  stratum->m2 += delta * (sample - stratum->mean);
+}
+
+/**
+ * @brief Walks one random chain of subdirectories from `top`.
+ *
+ * @param est Estimator.
+ * @param top Summary of the subtree's top directory.
+ *
+ * @return Returns an unbiased estimate of the subtree size in kilobytes.
+ */
+static double Probe(Estimator* est, DirSummary* top) {
+  double estimate = 0;
+  double weight = 1;
+  DirSummary* dir = top;
+
+  while (dir) {
+    estimate += weight * (double)dir->disk_usage;
+    if (dir->subdir_count == 0) {
+      break;
+    }
+
+    // Pick subdirectory i with probability p_i and weight it by 1 / p_i
+    const Subdir* subdirs = dir->subdirs;
+    double total = subdirs[dir->subdir_count - 1].cumulative;
+    double target = (double)(Random(est) >> 11) / 9007199254740992.0 * total;
+    size_t lo = 0;
+    size_t hi = dir->subdir_count - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (subdirs[mid].cumulative > target) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    double previous = lo ? subdirs[lo - 1].cumulative : 0;
+    double picked = subdirs[lo].cumulative - previous;
+    weight *= total / picked;
+
+    char path[kPathMax];
+    if (snprintf(path, kPathMax, "%s/%s", dir->path, subdirs[lo].name) >=
+        (int)kPathMax) {
+      break;
+    }
+    dir = Summarize(est, path);
+  }
+  return estimate;
+}
+
+/**
+ * @brief Doubles the summary hash table.
+ *
+ * @return Returns 0 on success, or -1 if allocation failed.
+ */
+static int Grow(Estimator* est) {
+  size_t count = est->bucket_count ? est->bucket_count * 2 : 256;
+  DirSummary** buckets = calloc(count, sizeof(DirSummary*));
+  if (!buckets) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < est->bucket_count; i++) {
+    DirSummary* s = est->buckets[i];
+    while (s) {
+      DirSummary* next = s->next;
+      uint64_t hash = Hash(s->path) & (count - 1);
+      s->next = buckets[hash];
+      buckets[hash] = s;
+      s = next;
+    }
+  }
+
+  free(est->buckets);
+  est->buckets = buckets;
+  est->bucket_count = count;
+  return 0;
+}
+
+/**
+ * @brief FNV-1a hash of a path.
+ */
+static uint64_t Hash(const char* path) {
+  uint64_t hash = 14695981039346656037u;
+  for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+    hash = (hash ^ *p) * 1099511628211u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Draws the next value of the estimator's xorshift64 generator.
+ */
+static uint64_t Random(Estimator* est) {
+  uint64_t x = est->rng;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  est->rng = x;
+  return x;
+}
+
+/**
+ * @brief Returns the sample variance of a stratum's probes.
+ */
+static double Variance(const Stratum* stratum) {
+  if (stratum->probes < 2) {
+    return 0;
+  }
+  return stratum->m2 / (double)(stratum->probes - 1);
+}
+
+/**
+ * @brief Returns the seconds elapsed since `start` on the monotonic clock.
+ */
+static double Elapsed(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Frees every cached directory summary.
+ */
+static void FreeSummaries(Estimator* est) {
+  for (size_t i = 0; i < est->bucket_count; i++) {
+    DirSummary* s = est->buckets[i];
+    while (s) {
+      DirSummary* next = s->next;
+      for (size_t j = 0; j < s->subdir_count; j++) {
+        free(s->subdirs[j].name);
+      }
+      free(s->subdirs);
+      free(s->path);
+      free(s);
+      s = next;
+    }
+  }
+  free(est->buckets);
+  est->buckets = NULL;
+  est->bucket_count = 0;
+}
+
+/**
+ * @brief Records the first failure of an estimate and forwards every failure
+ *        to the error callback. Unreadable directories count as empty.
+ */
+static void Fail(Estimator* est, const char* path, DuOp op, int errnum) {
+  if (!est->error) {
+    est->error = errnum;
+  }
+  if (est->opts->on_error) {
+    est->opts->on_error(path, op, errnum, est->opts->ctx);
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef ESTIMATE_H_
+#define ESTIMATE_H_
+
+#include <stddef.h>     // size_t
+
+#include "libdu.h"
+
+/**
+ * @brief Estimated disk usage of a subtree.
+ */
+typedef struct DuEstimate {
+  const char *path;
+  int depth;            // 0 for the root, 1 for its subdirectories
+  double disk_usage;    // kilobytes
+  double half_width;    // kilobytes, of the 95% confidence interval,
+                        // INFINITY if too few probes to tell
+  size_t probes;        // random probes behind the estimate
+} DuEstimate;
+
+/**
+ * @brief Estimate callback. Returning non-zero stops the report.
+ */
+typedef int (*DuEstimateFn)(const DuEstimate *estimate, void *ctx);
+
+typedef struct DuEstimateOptions {
+  double time_budget;   // seconds, 0 for none
+  double error_budget;  // relative 95% half-width to reach, 0 for none
+  unsigned long seed;   // 0 to seed from the clock
+  DuEstimateFn report;  // receives the subdirectories, then the root
+  DuErrorFn on_error;   // may be NULL
+  void *ctx;            // passed to both callbacks
+} DuEstimateOptions;
+
+// Estimate Functions
+int DuEstimateRun(const char *rootpath, const DuEstimateOptions *opts);
+
+#endif  // ESTIMATE_H_
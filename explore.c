@@ -0,0 +1,535 @@
+/**
+ * @file   explore.c
+ *
+ * @brief  Largest-first scan. Directories wait in a priority queue keyed by
+ *         their size in an earlier scan, so the ones expected to be largest
+ *         are read first. Only unfinished directories are kept; each one
+ *         that finishes is offered to a bounded heap of the largest entries
+ *         and freed. Provisional top-N reports merge that heap with the
+ *         running totals of the unfinished directories.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "explore.h"
+
+#include <dirent.h>     // opendir, readdir, closedir, dirent
+#include <errno.h>      // errno, EIO, ENAMETOOLONG, ENOMEM
+#include <stdint.h>     // int64_t, uint64_t
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free, malloc, qsort
+#include <string.h>     // strcmp, strdup
+#include <time.h>       // clock_gettime
+
+static const size_t kPathMax = 4096;  // bytes
+
+/**
+ * @brief A directory that has not been fully scanned yet.
+ */
+typedef struct Dir {
+  char* path;
+  struct Dir* parent;
+  blkcnt_t disk_usage;  // kilobytes counted in the subtree so far
+  blkcnt_t expected;    // kilobytes in the guide, 0 if it lacks the directory
+  int64_t guide_node;   // -1 if the guide lacks the directory
+  int depth;
+  size_t pending;       // 1 until read, plus the unfinished subdirectories
+  size_t slot;          // position in Explorer::live
+} Dir;
+
+/**
+ * @brief A fully scanned entry, kept while it is among the largest.
+ */
+typedef struct Finished {
+  char* path;
+  int depth;
+  blkcnt_t disk_usage;
+} Finished;
+
+typedef struct Explorer {
+  const DuExploreOptions* opts;
+  DynamicArray* queue;     // of Dir*, max-heap of the directories to read
+  DynamicArray* live;      // of Dir*, every unfinished directory
+  DynamicArray* finished;  // of Finished, min-heap of the largest entries
+  DynamicArray* seen;      // of DuInode
+  struct timespec last;    // time of the last report
+  uint64_t digest;         // of the last report, to skip unchanged ones
+  int error;               // errno of the first failure, 0 if none
+} Explorer;
+
+static void ReadDir(Explorer* ex, Dir* dir);
+static Dir* NewDir(Explorer* ex, const char* path, Dir* parent,
+                   const struct stat* statbuf, int64_t guide_node);
+static void Finish(Explorer* ex, Dir* dir);
+static int Repeated(Explorer* ex, const char* path,
+                    const struct stat* statbuf);
+static void Offer(Explorer* ex, const char* path, int depth,
+                  blkcnt_t disk_usage);
+static int Report(Explorer* ex, int final);
+static int CompareRanked(const void* a, const void* b);
+static uint64_t Digest(const DuRanked* ranked, size_t count);
+static int Due(const Explorer* ex);
+static int Before(const Dir* a, const Dir* b);
+static int Push(Explorer* ex, Dir* dir);
+static Dir* Pop(Explorer* ex);
+static void FreeExplorer(Explorer* ex);
+static void Fail(Explorer* ex, const char* path, DuOp op, int errnum);
+
+/**
+ * @brief Scans `rootpath` largest directory first, reporting its `top`
+ *        largest entries every `interval` seconds while they change, and
+ *        once more when the scan is complete.
+ *
+ * Without a guide, or below directories the guide lacks, the deepest
+ * directories are read first, so subtrees are finished early and few
+ * directories are held at once.
+ *
+ * @param rootpath The path to the directory or file to scan.
+ * @param opts     Options and callbacks.
+ *
+ * @return Returns 0 on success, 1 if the callback stopped the scan, or -1 on
+ *         error.
+ */
+int DuExploreRun(const char* rootpath, const DuExploreOptions* opts) {
+  const size_t kInitSize = 64;
+
+  Explorer ex = {.opts = opts};
+  clock_gettime(CLOCK_MONOTONIC, &ex.last);
+
+  ex.queue = InitDynamicArray(kInitSize, sizeof(Dir*));
+  ex.live = InitDynamicArray(kInitSize, sizeof(Dir*));
+  ex.finished = InitDynamicArray(opts->top ? opts->top : 1, sizeof(Finished));
+  ex.seen = InitDynamicArray(kInitSize, sizeof(DuInode));
+  if (!ex.queue || !ex.live || !ex.finished || !ex.seen) {
+    Fail(&ex, rootpath, kDuOpAlloc, ENOMEM);
+    FreeExplorer(&ex);
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (lstat(rootpath, &statbuf) < 0) {
+    Fail(&ex, rootpath, kDuOpStat, errno);
+    FreeExplorer(&ex);
+    return -1;
+  }
+
+  // Nothing lies below a file, and the root itself is never ranked
+  if (S_ISDIR(statbuf.st_mode)) {
+    int64_t node = opts->guide ? DuIndexLookup(opts->guide, rootpath) : -1;
+    if (!NewDir(&ex, rootpath, NULL, &statbuf, node)) {
+      Fail(&ex, rootpath, kDuOpAlloc, ENOMEM);
+    }
+  }
+
+  int status = 0;
+  while (!ex.error && status == 0 && ex.queue->len > 0) {
+    ReadDir(&ex, Pop(&ex));
+    if (opts->interval > 0 && Due(&ex)) {
+      status = Report(&ex, 0);
+    }
+  }
+
+  if (!ex.error && status == 0) {
+    status = Report(&ex, 1);
+  }
+  if (ex.error) {
+    status = -1;
+  }
+
+  FreeExplorer(&ex);
+  return status;
+}
+
+/**
+ * @brief Reads a directory: queues its subdirectories, counts its files and
+ *        adds what it found to the totals of the directory and of its
+ *        ancestors.
+ *
+ * @param ex  Explorer.
+ * @param dir Directory to read, possibly freed once it has been read.
+ */
+static void ReadDir(Explorer* ex, Dir* dir) {
+  const DuExploreOptions* opts = ex->opts;
+
+  DIR* dirp = opendir(dir->path);
+  if (!dirp) {
+    // Its own size was counted when it was found
+    Fail(ex, dir->path, kDuOpOpenDir, errno);
+    Finish(ex, dir);
+    return;
+  }
+
+  blkcnt_t found = 0;
+  struct dirent* direntp;
+  while (!ex->error && (direntp = readdir(dirp))) {
+    const char* name = direntp->d_name;
+
+    // Avoid infinite traversal through file system
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    char path[kPathMax];
+    int len = snprintf(path, kPathMax, "%s/%s", dir->path, name);
+    if (len < 0 || (size_t)len >= kPathMax) {
+      Fail(ex, dir->path, kDuOpPath, len < 0 ? errno : ENAMETOOLONG);
+      continue;
+    }
+
+    struct stat statbuf;
+    if (lstat(path, &statbuf) < 0) {
+      Fail(ex, path, kDuOpStat, errno);
+      continue;
+    }
+
+    if (S_ISDIR(statbuf.st_mode)) {
+      int64_t node = dir->guide_node < 0
+                         ? -1
+                         : DuIndexChild(opts->guide,
+                                        (uint32_t)dir->guide_node, name);
+      Dir* child = NewDir(ex, path, dir, &statbuf, node);
+      if (!child) {
+        Fail(ex, path, kDuOpAlloc, ENOMEM);
+        break;
+      }
+      found += child->disk_usage;
+      dir->pending++;
+    } else if (!Repeated(ex, path, &statbuf)) {
+      blkcnt_t disk_usage_kb = statbuf.st_blocks / 2;
+      found += disk_usage_kb;
+      if (opts->include_files) {
+        Offer(ex, path, dir->depth + 1, disk_usage_kb);
+      }
+    }
+  }
+  closedir(dirp);
+
+  for (Dir* d = dir; d; d = d->parent) {
+    d->disk_usage += found;
+  }
+  Finish(ex, dir);
+}
+
+/**
+ * @brief Creates an unfinished directory, counting its own size, and queues
+ *        it to be read.
+ *
+ * @return Returns the directory, or NULL if allocation fails.
+ */
+static Dir* NewDir(Explorer* ex, const char* path, Dir* parent,
+                   const struct stat* statbuf, int64_t guide_node) {
+  Dir* dir = calloc(1, sizeof(Dir));
+  if (!dir || !(dir->path = strdup(path))) {
+    free(dir);
+    return NULL;
+  }
+
+  dir->parent = parent;
+  dir->disk_usage = statbuf->st_blocks / 2;
+  dir->guide_node = guide_node;
+  if (guide_node >= 0) {
+    dir->expected = (blkcnt_t)ex->opts->guide->nodes[guide_node].disk_usage;
+  }
+  dir->depth = parent ? parent->depth + 1 : 0;
+  dir->pending = 1;
+  dir->slot = ex->live->len;
+
+  if (ReserveDynamicArray(ex->live, 1, sizeof(Dir*)) < 0 || Push(ex, dir) < 0) {
+    free(dir->path);
+    free(dir);
+    return NULL;
+  }
+  ((Dir**)ex->live->data)[ex->live->len++] = dir;
+  return dir;
+}
+
+/**
+ * @brief Marks one piece of a directory done: the directory itself once
+ *        read, or one of its subdirectories. Directories with nothing left
+ *        are ranked and freed, and finish a piece of their parent in turn.
+ */
+static void Finish(Explorer* ex, Dir* dir) {
+  while (dir && --dir->pending == 0) {
+    Dir* parent = dir->parent;
+    if (parent) {
+      Offer(ex, dir->path, dir->depth, dir->disk_usage);
+    }
+
+    Dir** live = (Dir**)ex->live->data;
+    Dir* moved = live[--ex->live->len];
+    live[dir->slot] = moved;
+    moved->slot = dir->slot;
+
+    free(dir->path);
+    free(dir);
+    dir = parent;
+  }
+}
+
+/**
+ * @brief Tells whether a file is a hard link to an i-node already counted,
+ *        recording it otherwise.
+ */
+static int Repeated(Explorer* ex, const char* path,
+                    const struct stat* statbuf) {
+  if (!S_ISREG(statbuf->st_mode) || statbuf->st_nlink <= 1 ||
+      ex->opts->count_links) {
+    return 0;
+  }
+
+  DuInode* seen = SearchInode(ex->seen, statbuf->st_dev, statbuf->st_ino);
+  if (seen) {
+    // No link can follow the last one, so the inode need not be kept
+    if (--seen->remaining == 0) {
+      EvictInode(ex->seen, seen);
+    }
+    return 1;
+  }
+
+  if (InsertInode(ex->seen, statbuf->st_dev, statbuf->st_ino,
+                  statbuf->st_nlink - 1) < 0) {
+    Fail(ex, path, kDuOpInsert, errno);
+  }
+  return 0;
+}
+
+/**
+ * @brief Offers a fully scanned entry to the heap of the largest ones,
+ *        replacing the smallest of them once the heap is full.
+ */
+static void Offer(Explorer* ex, const char* path, int depth,
+                  blkcnt_t disk_usage) {
+  size_t top = ex->opts->top;
+  Finished* heap = (Finished*)ex->finished->data;
+  size_t len = ex->finished->len;
+  if (top == 0 || (len == top && disk_usage <= heap[0].disk_usage)) {
+    return;
+  }
+
+  Finished entry = {strdup(path), depth, disk_usage};
+  if (!entry.path) {
+    Fail(ex, path, kDuOpAlloc, ENOMEM);
+    return;
+  }
+
+  size_t i;
+  if (len < top) {
+    for (i = ex->finished->len++; i > 0; i = (i - 1) / 2) {
+      if (heap[(i - 1) / 2].disk_usage <= disk_usage) {
+        break;
+      }
+      heap[i] = heap[(i - 1) / 2];
+    }
+  } else {
+    free(heap[0].path);
+    for (i = 0;;) {
+      size_t child = 2 * i + 1;
+      if (child >= len) {
+        break;
+      }
+      if (child + 1 < len &&
+          heap[child + 1].disk_usage < heap[child].disk_usage) {
+        child++;
+      }
+      if (heap[child].disk_usage >= disk_usage) {
+        break;
+      }
+      heap[i] = heap[child];
+      i = child;
+    }
+  }
+  heap[i] = entry;
+}
+
+/**
+ * @brief Ranks the finished entries and the unfinished directories and
+ *        hands the largest to the report callback. Provisional reports equal
+ *        to the previous one are skipped.
+ *
+ * @return Returns 1 if the callback stopped the scan, 0 otherwise.
+ */
+static int Report(Explorer* ex, int final) {
+  const DuExploreOptions* opts = ex->opts;
+  clock_gettime(CLOCK_MONOTONIC, &ex->last);
+
+  size_t len = ex->finished->len + ex->live->len;
+  DuRanked* ranked = malloc((len ? len : 1) * sizeof(DuRanked));
+  if (!ranked) {
+    Fail(ex, "", kDuOpAlloc, ENOMEM);
+    return 0;
+  }
+
+  size_t count = 0;
+  Finished* finished = (Finished*)ex->finished->data;
+  for (size_t i = 0; i < ex->finished->len; i++) {
+    ranked[count++] = (DuRanked){finished[i].path, finished[i].depth,
+                                 finished[i].disk_usage, 1};
+  }
+
+  // An unfinished directory is expected to reach its size in the guide
+  Dir** live = (Dir**)ex->live->data;
+  for (size_t i = 0; i < ex->live->len; i++) {
+    Dir* dir = live[i];
+    if (dir->depth > 0) {
+      blkcnt_t disk_usage =
+          dir->disk_usage > dir->expected ? dir->disk_usage : dir->expected;
+      ranked[count++] = (DuRanked){dir->path, dir->depth, disk_usage, 0};
+    }
+  }
+
+  qsort(ranked, count, sizeof(DuRanked), CompareRanked);
+  if (count > opts->top) {
+    count = opts->top;
+  }
+
+  int status = 0;
+  uint64_t digest = Digest(ranked, count);
+  if (final || digest != ex->digest) {
+    ex->digest = digest;
+    if (opts->report && opts->report(ranked, count, final, opts->ctx)) {
+      status = 1;
+    }
+  }
+
+  free(ranked);
+  return status;
+}
+
+/**
+ * @brief Orders ranked entries largest first, then by path.
+ */
+static int CompareRanked(const void* a, const void* b) {
+  const DuRanked* x = (const DuRanked*)a;
+  const DuRanked* y = (const DuRanked*)b;
+  if (x->disk_usage != y->disk_usage) {
+    return x->disk_usage > y->disk_usage ? -1 : 1;
+  }
+  return strcmp(x->path, y->path);
+}
+
+/**
+ * @brief Hashes a report (FNV-1a), to tell whether it changed.
+ */
+static uint64_t Digest(const DuRanked* ranked, size_t count) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < count; i++) {
+    for (const char* p = ranked[i].path; *p; p++) {
+      hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ (uint64_t)ranked[i].disk_usage) * 0x100000001b3ULL;
+    hash = (hash ^ (uint64_t)ranked[i].complete) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief Tells whether a provisional report is due.
+ */
+static int Due(const Explorer* ex) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (double)(now.tv_sec - ex->last.tv_sec) +
+                   (double)(now.tv_nsec - ex->last.tv_nsec) / 1e9;
+  return elapsed >= ex->opts->interval;
+}
+
+/**
+ * @brief Orders the queue: largest expected size first, then deepest first.
+ */
+static int Before(const Dir* a, const Dir* b) {
+  if (a->expected != b->expected) {
+    return a->expected > b->expected;
+  }
+  return a->depth > b->depth;
+}
+
+/**
+ * @brief Queues a directory to be read.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int Push(Explorer* ex, Dir* dir) {
+  if (ReserveDynamicArray(ex->queue, 1, sizeof(Dir*)) < 0) {
+    return -1;
+  }
+
+  Dir** heap = (Dir**)ex->queue->data;
+  size_t i = ex->queue->len++;
+  for (; i > 0 && Before(dir, heap[(i - 1) / 2]); i = (i - 1) / 2) {
+    heap[i] = heap[(i - 1) / 2];
+  }
+  heap[i] = dir;
+  return 0;
+}
+
+/**
+ * @brief Takes the next directory to read off a non-empty queue.
+ */
+static Dir* Pop(Explorer* ex) {
+  Dir** heap = (Dir**)ex->queue->data;
+  Dir* top = heap[0];
+  size_t len = --ex->queue->len;
+  if (len == 0) {
+    return top;
+  }
+
+  Dir* last = heap[len];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= len) {
+      break;
+    }
+    if (child + 1 < len && Before(heap[child + 1], heap[child])) {
+      child++;
+    }
+    if (!Before(heap[child], last)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/**
+ * @brief Frees the directories still unfinished and the explorer's arrays.
+ */
+static void FreeExplorer(Explorer* ex) {
+  if (ex->live) {
+    Dir** live = (Dir**)ex->live->data;
+    for (size_t i = 0; i < ex->live->len; i++) {
+      free(live[i]->path);
+      free(live[i]);
+    }
+  }
+  if (ex->finished) {
+    Finished* finished = (Finished*)ex->finished->data;
+    for (size_t i = 0; i < ex->finished->len; i++) {
+      free(finished[i].path);
+    }
+  }
+
+  FreeDynamicArray(ex->queue);
+  FreeDynamicArray(ex->live);
+  FreeDynamicArray(ex->finished);
+  FreeDynamicArray(ex->seen);
+}
+
+/**
+ * @brief Reports a failure, which ends the scan unless it only loses the
+ *        entry and `keep_going` is set.
+ */
+static void Fail(Explorer* ex, const char* path, DuOp op, int errnum) {
+  if (!errnum) {
+    errnum = EIO;
+  }
+  if (!(ex->opts->keep_going && DuSkippable(op)) && !ex->error) {
+    ex->error = errnum;
+  }
+  if (ex->opts->on_error) {
+    ex->opts->on_error(path, op, errnum, ex->opts->ctx);
+  }
+}
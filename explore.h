@@ -0,0 +1,50 @@
+#ifndef EXPLORE_H_
+#define EXPLORE_H_
+
+#include <stddef.h>     // size_t
+
+#include "index.h"
+#include "libdu.h"
+
+/**
+ * Largest-first exploration. Directories are read in decreasing order of
+ * their size in an earlier scan, rather than depth-first, and the largest
+ * entries found so far are reported every so often while the scan runs, so
+ * the big subtrees of a tree are known long before it has been fully read.
+ */
+
+/**
+ * @brief An entry of a top-N report.
+ */
+typedef struct DuRanked {
+  const char *path;
+  int depth;            // relative to the root, which is never reported
+  blkcnt_t disk_usage;  // kilobytes; until `complete`, the larger of what
+                        // was counted so far and the size in the guide
+  int complete;         // the subtree has been fully scanned
+} DuRanked;
+
+/**
+ * @brief Report callback, receiving up to `DuExploreOptions::top` entries
+ *        largest first. Only the last report is `final`, and all its entries
+ *        are complete. Returning non-zero stops the scan.
+ */
+typedef int (*DuRankFn)(const DuRanked *ranked, size_t count, int final,
+                        void *ctx);
+
+typedef struct DuExploreOptions {
+  size_t top;            // entries to report
+  double interval;       // seconds between provisional reports, 0 for none
+  int include_files;     // rank files, not just directories
+  int keep_going;        // skip entries that cannot be read, see DuOptions
+  int count_links;       // count every link of a file, see DuOptions
+  const DuIndex *guide;  // earlier scan sizing the directories, may be NULL
+  DuRankFn report;
+  DuErrorFn on_error;    // may be NULL
+  void *ctx;             // passed to both callbacks
+} DuExploreOptions;
+
+// Explore Functions
+int DuExploreRun(const char *rootpath, const DuExploreOptions *opts);
+
+#endif  // EXPLORE_H_
@@ -0,0 +1,192 @@
+/**
+ * @file   filter.c
+ *
+ * @brief  Blocked Bloom filter of (dev, ino) keys for approximate hard-link
+ *         deduplication in constant memory.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "filter.h"
+
+#include <math.h>       // ceil, log, pow
+#include <stdint.h>     // uint64_t
+#include <stdlib.h>     // aligned_alloc, calloc, free
+#include <string.h>     // memset
+
+#include "inodeset.h"
+
+enum {
+  kBlockWords = 8,          // 64-bit words per block, one cache line
+  kBlockBits = kBlockWords * 64,
+  kMaxHashes = 8,  // more only fill a 512-bit block faster
+  kBitIndex = 9,   // hash bits per key bit, log2(kBlockBits)
+  kBitsPerWord = 64 / kBitIndex,
+};
+
+struct DuFilter {
+  uint64_t* blocks;    // block_count * kBlockWords words
+  size_t block_count;
+  int hashes;          // bits set per key
+  size_t loads[kBlockBits + 1];  // blocks by bits set
+  double fp_of[kBlockBits + 1];  // false-positive probability by bits set
+  double error;        // kilobytes, expected underestimate so far
+};
+
+
+/**
+ * @brief Creates a filter for `capacity` distinct inodes at `fp_rate`.
+ *
+ * Uses the textbook sizing of m = -n ln(p) / ln(2)^2 bits and
+ * k = (m / n) ln(2) hashes, rounded up to whole blocks, with k capped at
+ * `kMaxHashes`. Blocks fill unevenly, so the rate reached is higher than
+ * `fp_rate`; `DuFilterFalsePositiveRate` reports the actual one.
+ *
+ * @param capacity Expected number of distinct hard-linked inodes.
+ * @param fp_rate  False-positive rate to reach at that capacity, in (0, 1).
+ *
+ * @return Returns the filter, or NULL if the arguments are invalid or
+ *         allocation fails.
+ */
+DuFilter* DuFilterCreate(size_t capacity, double fp_rate) {
+  if (capacity == 0 || fp_rate <= 0 || fp_rate >= 1) {
+    return NULL;
+  }
+
+  double bits = -(double)capacity * log(fp_rate) / (log(2) * log(2));
+  size_t block_count = (size_t)ceil(bits / kBlockBits);
+  int hashes = (int)(bits / (double)capacity * log(2) + 0.5);
+  if (hashes < 1) {
+    hashes = 1;
+  } else if (hashes > kMaxHashes) {
+    hashes = kMaxHashes;
+  }
+
+  DuFilter* filter = calloc(1, sizeof(DuFilter));
+  if (!filter) {
+    return NULL;
+  }
+
+  size_t bytes = block_count * kBlockWords * sizeof(uint64_t);
+  filter->blocks = aligned_alloc(kBlockWords * sizeof(uint64_t), bytes);
+  if (!filter->blocks) {
+    free(filter);
+    return NULL;
+  }
+  memset(filter->blocks, 0, bytes);
+
+  filter->block_count = block_count;
+  filter->hashes = hashes;
+  filter->loads[0] = block_count;
+  for (int bits_set = 0; bits_set <= kBlockBits; bits_set++) {
+    filter->fp_of[bits_set] =
+        pow((double)bits_set / kBlockBits, filter->hashes);
+  }
+  return filter;
+}
+
+/**
+ * @brief Tells whether an inode may have been seen, and adds it if not.
+ *
+ * One hash picks the block, and each of the key's bits within it takes nine
+ * bits of two more, so that the key's bits are independent. The bits are
+ * tested and set without branching on each of them, and the bits already
+ * set in the block give the probability that the answer is a false positive.
+ *
+ * @param filter     Filter.
+ * @param dev        Device of the inode.
+ * @param ino        Inode number.
+ * @param disk_usage Disk usage of the inode in kilobytes, weighted into the
+ *                   error bound.
+ *
+ * @return Returns 1 if the inode was probably seen before, 0 if it was
+ *         certainly not and has now been added.
+ */
+int DuFilterTestAndSet(DuFilter* filter, dev_t dev, ino_t ino,
+                       blkcnt_t disk_usage) {
+  uint64_t hash = DuInodeMix((uint64_t)ino ^ DuInodeMix((uint64_t)dev));
+  uint64_t* block =
+      filter->blocks + (hash % filter->block_count) * kBlockWords;
+
+  uint64_t mask[kBlockWords] = {0};
+  uint64_t bits_hash[2] = {DuInodeMix(hash), DuInodeMix(~hash)};
+  for (int i = 0; i < filter->hashes; i++) {
+    uint32_t bit = (uint32_t)(bits_hash[i / kBitsPerWord] >>
+                              (i % kBitsPerWord * kBitIndex)) %
+                   kBlockBits;
+    mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+
+  int before = 0;
+  int added = 0;
+  uint64_t missing = 0;
+  for (int w = 0; w < kBlockWords; w++) {
+    uint64_t fresh = mask[w] & ~block[w];
+    before += __builtin_popcountll(block[w]);
+    added += __builtin_popcountll(fresh);
+    missing |= fresh;
+    block[w] |= mask[w];
+  }
+
+  // Had this inode been new, it would have been skipped with the
+  // probability that a new key's bits all fall on those set in its block
+  filter->error += filter->fp_of[before] * (double)disk_usage;
+
+  if (added) {
+    filter->loads[before]--;
+    filter->loads[before + added]++;
+  }
+  return missing == 0;
+}
+
+/**
+ * @brief Returns the memory used by the bit array of a filter.
+ */
+size_t DuFilterBytes(const DuFilter* filter) {
+  return filter->block_count * kBlockWords * sizeof(uint64_t);
+}
+
+/**
+ * @brief Returns the current false-positive probability: the mean over the
+ *        blocks, any of which a new inode may hash to, of the probability
+ *        that its bits all fall on those set in that block.
+ *
+ * @param filter Filter.
+ *
+ * @return Returns the probability that a new inode is reported as seen.
+ */
+double DuFilterFalsePositiveRate(const DuFilter* filter) {
+  double sum = 0;
+  for (int bits_set = 0; bits_set <= kBlockBits; bits_set++) {
+    sum += (double)filter->loads[bits_set] * filter->fp_of[bits_set];
+  }
+  return sum / (double)filter->block_count;
+}
+
+/**
+ * @brief Returns an upper bound on the expected underestimate of the total.
+ *
+ * Every lookup adds its size times the false-positive probability of the
+ * block it probed, at the time. Only lookups of new inodes can be false
+ * positives, so the sum bounds the expected disk usage wrongly skipped.
+ *
+ * @param filter Filter.
+ *
+ * @return Returns the bound in kilobytes.
+ */
+double DuFilterErrorBound(const DuFilter* filter) {
+  return filter->error;
+}
+
+/**
+ * @brief Frees a filter.
+ *
+ * @param filter Filter to free, may be NULL.
+ */
+void DuFilterFree(DuFilter* filter) {
+  if (filter) {
+    free(filter->blocks);
+    free(filter);
+  }
+}
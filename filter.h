@@ -0,0 +1,29 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stddef.h>     // size_t
+#include <sys/types.h>  // blkcnt_t, dev_t, ino_t
+
+/**
+ * Approximate set of hard-linked inodes: a blocked Bloom filter sized up
+ * front for an expected number of inodes and a false-positive rate. Every
+ * lookup touches a single 64-byte block, so memory is fixed and lookups cost
+ * one cache miss at most, however many links the tree holds.
+ *
+ * A false positive makes the scan skip an inode it has not counted yet, so
+ * totals can only be underestimated. The filter keeps a bound on the
+ * expected size of that underestimate as it goes, from the bits set in each
+ * block it probes.
+ */
+typedef struct DuFilter DuFilter;
+
+// Filter Functions
+DuFilter *DuFilterCreate(size_t capacity, double fp_rate);
+int DuFilterTestAndSet(DuFilter *filter, dev_t dev, ino_t ino,
+                       blkcnt_t disk_usage);
+size_t DuFilterBytes(const DuFilter *filter);
+double DuFilterFalsePositiveRate(const DuFilter *filter);
+double DuFilterErrorBound(const DuFilter *filter);
+void DuFilterFree(DuFilter *filter);
+
+#endif  // FILTER_H_
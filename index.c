@@ -0,0 +1,901 @@
+/**
+ * @file   index.c
+ *
+ * @brief  Scan index support. A `DuTree` collects the entries visited by a
+ *         scan and writes them in the pointer-free format described in
+ *         `index.h`; a `DuIndex` maps such a file and answers subtree size,
+ *         listing and top-N queries without touching the filesystem.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "index.h"
+
+#include <errno.h>      // errno, ENOMEM, EINVAL, EIO
+#include <fcntl.h>      // open, O_RDONLY
+#include <stdio.h>      // FILE, fwrite
+#include <stdlib.h>     // malloc, free, qsort
+#include <string.h>     // memcmp, memcpy, strcmp, strdup, strlen, strrchr
+#include <sys/mman.h>   // mmap, munmap
+#include <unistd.h>     // close
+
+static const size_t kIndexPathMax = 4096;  // bytes
+static const size_t kVarintMax = 5;        // bytes for a uint32_t
+
+typedef struct DuTreeNode {
+  char* name;
+  blkcnt_t disk_usage;
+  int depth;
+  uint32_t kids;       // offset of the children in DuTree::kids
+  uint32_t kid_count;
+} DuTreeNode;
+
+struct DuTree {
+  DynamicArray* nodes;    // of DuTreeNode, in visit order
+  DynamicArray* kids;     // of uint32_t, children of finished directories
+  DynamicArray* pending;  // of uint32_t, nodes waiting for their parent
+  int failed;
+};
+
+typedef struct NamedNode {
+  const char* name;
+  uint32_t id;
+} NamedNode;
+
+typedef struct WalkFrame {
+  uint32_t node;
+  uint32_t next;    // next child to descend into
+  size_t path_len;
+} WalkFrame;
+
+static int Serialize(DuTree* tree, DynamicArray* out);
+static int CompareNamed(const void* a, const void* b);
+static size_t PutVarint(unsigned char* p, uint32_t v);
+static const unsigned char* GetVarint(const unsigned char* p,
+                                      const unsigned char* end, uint32_t* v);
+static int CheckNodes(const DuIndex* index);
+static void Heapify(uint32_t* heap, size_t len, const DuIndexNode* nodes);
+static void SiftDown(uint32_t* heap, size_t len, size_t i,
+                     const DuIndexNode* nodes);
+
+/**
+ * @brief Creates an empty tree.
+ *
+ * @return Returns the new tree, or NULL if allocation fails.
+ */
+DuTree* DuTreeCreate(void) {
+  const size_t kInitSize = 64;
+
+  DuTree* tree = calloc(1, sizeof(DuTree));
+  if (!tree) {
+    return NULL;
+  }
+
+  tree->nodes = InitDynamicArray(kInitSize, sizeof(DuTreeNode));
+  tree->kids = InitDynamicArray(kInitSize, sizeof(uint32_t));
+  tree->pending = InitDynamicArray(kInitSize, sizeof(uint32_t));
+  if (!tree->nodes || !tree->kids || !tree->pending) {
+    DuTreeFree(tree);
+    return NULL;
+  }
+  return tree;
+}
+
+/**
+ * @brief Visitor that adds an entry to a tree.
+ *
+ * Entries arrive in post-order, so when a directory is visited its children
+ * are exactly the pending nodes one level deeper, at the top of the pending
+ * stack.
+ *
+ * @param entry Entry accounted by the scanner.
+ * @param tree  Tree to add to.
+ *
+ * @return Returns 0, or 1 to stop the scan if allocation failed.
+ */
+int DuTreeAdd(const DuEntry* entry, void* tree) {
+  DuTree* t = (DuTree*)tree;
+
+  const char* name = entry->path;
+  if (entry->depth > 0) {
+    const char* slash = strrchr(entry->path, '/');
+    if (slash) {
+      name = slash + 1;
+    }
+  }
+
+  uint32_t* pending = (uint32_t*)t->pending->data;
+  DuTreeNode* nodes = (DuTreeNode*)t->nodes->data;
+  size_t kid_count = 0;
+  while (kid_count < t->pending->len &&
+         nodes[pending[t->pending->len - kid_count - 1]].depth ==
+             entry->depth + 1) {
+    kid_count++;
+  }
+
+  if (ReserveDynamicArray(t->nodes, 1, sizeof(DuTreeNode)) < 0 ||
+      ReserveDynamicArray(t->kids, kid_count, sizeof(uint32_t)) < 0 ||
+      ReserveDynamicArray(t->pending, 1, sizeof(uint32_t)) < 0) {
+    t->failed = ENOMEM;
+    return 1;
+  }
+
+  DuTreeNode node = {
+      .name = strdup(name),
+      .disk_usage = entry->disk_usage,
+      .depth = entry->depth,
+      .kids = (uint32_t)t->kids->len,
+      .kid_count = (uint32_t)kid_count,
+  };
+  if (!node.name) {
+    t->failed = ENOMEM;
+    return 1;
+  }
+
+  pending = (uint32_t*)t->pending->data;
+  t->pending->len -= kid_count;
+  memcpy((uint32_t*)t->kids->data + t->kids->len, pending + t->pending->len,
+         kid_count * sizeof(uint32_t));
+  t->kids->len += kid_count;
+
+  pending[t->pending->len++] = (uint32_t)t->nodes->len;
+  ((DuTreeNode*)t->nodes->data)[t->nodes->len++] = node;
+  return 0;
+}
+
+/**
+ * @brief Encodes a tree as an index held in memory, ready for
+ *        `DuIndexView`.
+ *
+ * @param tree Tree holding a complete scan.
+ *
+ * @return Returns the bytes of the index, `len` of them, to release with
+ *         `FreeDynamicArray`, or NULL on error with errno set.
+ */
+DynamicArray* DuTreeSerialize(DuTree* tree) {
+  DynamicArray* out = InitDynamicArray(4096, 1);
+  if (!out) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (Serialize(tree, out) < 0) {
+    FreeDynamicArray(out);
+    return NULL;
+  }
+  return out;
+}
+
+/**
+ * @brief Writes a tree to an index file. The file is replaced only once the
+ *        new one is complete and synced, so a reader, or a crash, never sees
+ *        a truncated index, and one mapped from the old file stays intact.
+ *
+ * @param tree Tree holding a complete scan.
+ * @param path Path of the index file to create.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuTreeSave(DuTree* tree, const char* path) {
+  DynamicArray* out = DuTreeSerialize(tree);
+  if (!out) {
+    return -1;
+  }
+
+  FILE* file = DuReplaceOpen(path);
+  if (!file) {
+    FreeDynamicArray(out);
+    return -1;
+  }
+
+  int written = fwrite(out->data, 1, out->len, file) == out->len;
+  int saved_errno = errno;
+  int status = DuReplaceClose(file, path, written);
+  if (!written) {
+    errno = saved_errno ? saved_errno : EIO;
+    status = -1;
+  }
+
+  FreeDynamicArray(out);
+  return status;
+}
+
+/**
+ * @brief Frees a tree.
+ *
+ * @param tree Tree to free, may be NULL.
+ */
+void DuTreeFree(DuTree* tree) {
+  if (!tree) {
+    return;
+  }
+
+  if (tree->nodes) {
+    DuTreeNode* nodes = (DuTreeNode*)tree->nodes->data;
+    for (size_t i = 0; i < tree->nodes->len; i++) {
+      free(nodes[i].name);
+    }
+  }
+  FreeDynamicArray(tree->nodes);
+  FreeDynamicArray(tree->kids);
+  FreeDynamicArray(tree->pending);
+  free(tree);
+}
+
+/**
+ * @brief Maps an index file into memory.
+ *
+ * @param index Index to initialize.
+ * @param path  Path of the index file.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuIndexOpen(DuIndex* index, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)statbuf.st_size;
+  if (size < sizeof(DuIndexHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  if (DuIndexView(index, map, size) < 0) {
+    munmap(map, size);
+    return -1;
+  }
+
+  index->map = map;
+  return 0;
+}
+
+/**
+ * @brief Wraps an index already held in memory. The memory is borrowed and
+ *        must outlive the index.
+ *
+ * @param index Index to initialize.
+ * @param data  Start of the index bytes, aligned for `DuIndexNode`.
+ * @param size  Number of bytes.
+ *
+ * The header and every node are checked, so that queries can follow the
+ * links between nodes without bounds checks of their own.
+ *
+ * @return Returns 0 on success, or -1 with errno set to EINVAL if the bytes
+ *         are not a valid index.
+ */
+int DuIndexView(DuIndex* index, const void* data, size_t size) {
+  const DuIndexHeader* header = (const DuIndexHeader*)data;
+
+  if (size < sizeof(DuIndexHeader) ||
+      memcmp(header->magic, DU_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != kDuIndexVersion || header->node_count == 0 ||
+      header->node_count >= UINT32_MAX ||
+      header->names_offset < sizeof(DuIndexHeader) +
+                                 header->node_count * sizeof(DuIndexNode) ||
+      header->names_offset > size ||
+      header->names_size > size - header->names_offset) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  index->map = NULL;
+  index->size = size;
+  index->header = header;
+  index->nodes = (const DuIndexNode*)(header + 1);
+  index->names = (const unsigned char*)data + header->names_offset;
+  if (CheckNodes(index) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Checks that the nodes of an index form the breadth-first tree
+ *        described in `index.h`: the children of each node, taken in order,
+ *        are the next nodes not yet claimed, each lies after its parent and
+ *        names it as its parent, and every name offset lies within the names.
+ *
+ * Every node but the root is thus the child of exactly one earlier node, so
+ * walks down the child ranges and up the parents stay in bounds and end.
+ *
+ * @param index Index whose header has been checked.
+ *
+ * @return Returns 0 if the nodes are consistent, or -1 otherwise.
+ */
+static int CheckNodes(const DuIndex* index) {
+  const DuIndexNode* nodes = index->nodes;
+  uint64_t count = index->header->node_count;
+
+  if (nodes[0].parent != 0) {
+    return -1;
+  }
+
+  uint64_t next = 1;  // first node not yet claimed as a child
+  for (uint64_t i = 0; i < count; i++) {
+    const DuIndexNode* n = &nodes[i];
+    if (n->name >= index->header->names_size) {
+      return -1;
+    }
+    if (n->child_count == 0) {
+      continue;
+    }
+
+    if (n->first_child != next || n->first_child <= i ||
+        n->child_count > count - next) {
+      return -1;
+    }
+    for (uint32_t c = 0; c < n->child_count; c++) {
+      if (nodes[n->first_child + c].parent != i) {
+        return -1;
+      }
+    }
+    next += n->child_count;
+  }
+  return next == count ? 0 : -1;
+}
+
+/**
+ * @brief Unmaps an index opened with `DuIndexOpen`.
+ *
+ * @param index Index to close.
+ */
+void DuIndexClose(DuIndex* index) {
+  if (index->map) {
+    munmap(index->map, index->size);
+    index->map = NULL;
+  }
+}
+
+/**
+ * @brief Finds the node of a path. The path must be the scanned root path or
+ *        lie below it.
+ *
+ * @param index Index to search.
+ * @param path  Path to look up.
+ *
+ * @return Returns the node index, or -1 if the path is not in the index.
+ */
+int64_t DuIndexLookup(const DuIndex* index, const char* path) {
+  char root[kIndexPathMax];
+  size_t root_len = DuIndexName(index, 0, root, sizeof(root));
+  if (root_len == 0) {
+    return -1;
+  }
+
+  while (root_len > 1 && root[root_len - 1] == '/') {
+    root_len--;
+  }
+  if (strncmp(path, root, root_len) != 0) {
+    return -1;
+  }
+
+  const char* rest = path + root_len;
+  if (*rest != '\0' && *rest != '/' && root[root_len - 1] != '/') {
+    return -1;
+  }
+
+  int64_t node = 0;
+  while (*rest != '\0') {
+    while (*rest == '/') {
+      rest++;
+    }
+
+    size_t len = strcspn(rest, "/");
+    if (len == 0) {
+      break;
+    }
+    if (len >= kIndexPathMax) {
+      return -1;
+    }
+
+    char name[kIndexPathMax];
+    memcpy(name, rest, len);
+    name[len] = '\0';
+    rest += len;
+
+    if (strcmp(name, ".") == 0) {
+      continue;
+    }
+
+    node = DuIndexChild(index, (uint32_t)node, name);
+    if (node < 0) {
+      return -1;
+    }
+  }
+  return node;
+}
+
+/**
+ * @brief Finds a child of a node by name.
+ *
+ * Binary searches the restart points, whose names are stored in full, then
+ * scans the block the name would fall in.
+ *
+ * @param index Index to search.
+ * @param node  Parent node.
+ * @param name  Name of the child.
+ *
+ * @return Returns the child's node index, or -1 if there is none.
+ */
+int64_t DuIndexChild(const DuIndex* index, uint32_t node,
+                     const char* name) {
+  const DuIndexNode* n = &index->nodes[node];
+  if (n->child_count == 0) {
+    return -1;
+  }
+
+  char buf[kIndexPathMax];
+  uint32_t blocks = (n->child_count + kDuIndexRestart - 1) / kDuIndexRestart;
+  uint32_t lo = 0;
+  uint32_t hi = blocks;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (DuIndexName(index, n->first_child + mid * kDuIndexRestart, buf,
+                    sizeof(buf)) == 0) {
+      return -1;
+    }
+    if (strcmp(buf, name) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  uint32_t start = lo * kDuIndexRestart;
+  uint32_t stop = start + kDuIndexRestart;
+  if (stop > n->child_count) {
+    stop = n->child_count;
+  }
+  for (uint32_t i = start; i < stop; i++) {
+    if (DuIndexName(index, n->first_child + i, buf, sizeof(buf)) == 0) {
+      return -1;
+    }
+    int cmp = strcmp(buf, name);
+    if (cmp == 0) {
+      return n->first_child + i;
+    }
+    if (cmp > 0) {
+      break;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Decodes the name of a node.
+ *
+ * @param index   Index holding the node.
+ * @param node    Node index.
+ * @param buf     Buffer receiving the NUL-terminated name.
+ * @param bufsize Size of `buf`.
+ *
+ * @return Returns the length of the name, or 0 if it does not fit in `buf` or
+ *         the index is corrupt.
+ */
+size_t DuIndexName(const DuIndex* index, uint32_t node, char* buf,
+                   size_t bufsize) {
+  const DuIndexNode* nodes = index->nodes;
+  const unsigned char* end = index->names + index->header->names_size;
+  if (node >= index->header->node_count) {
+    return 0;
+  }
+
+  uint32_t start = node;
+  if (node != 0) {
+    uint32_t first = nodes[nodes[node].parent].first_child;
+    start = node - (node - first) % kDuIndexRestart;
+  }
+
+  size_t len = 0;
+  for (uint32_t i = start; i <= node; i++) {
+    const unsigned char* p = index->names + nodes[i].name;
+    uint32_t shared;
+    uint32_t suffix;
+    if (nodes[i].name >= index->header->names_size ||
+        !(p = GetVarint(p, end, &shared)) ||
+        !(p = GetVarint(p, end, &suffix)) || shared > len ||
+        suffix > (size_t)(end - p) || shared + suffix >= bufsize) {
+      return 0;
+    }
+
+    memcpy(buf + shared, p, suffix);
+    len = shared + suffix;
+  }
+
+  buf[len] = '\0';
+  return len;
+}
+
+/**
+ * @brief Lists a subtree in post-order, the order `du` prints it in, with
+ *        siblings sorted by name.
+ *
+ * @param index     Index to read.
+ * @param node      Node at the top of the subtree.
+ * @param path      Path to report for `node`; descendants are reported
+ *                  below it.
+ * @param max_depth Deepest level to list relative to `node`, or -1 for all.
+ * @param visit     Visitor receiving each entry, with a NULL `statbuf`.
+ * @param ctx       Passed to `visit`.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the listing, or -1 on
+ *         error.
+ */
+int DuIndexWalk(const DuIndex* index, uint32_t node, const char* path,
+                int max_depth, DuVisitFn visit, void* ctx) {
+  char pathname[kIndexPathMax];
+  size_t path_len = strlen(path);
+  if (path_len >= sizeof(pathname)) {
+    return -1;
+  }
+  memcpy(pathname, path, path_len + 1);
+
+  DynamicArray* stack = InitDynamicArray(64, sizeof(WalkFrame));
+  if (!stack) {
+    return -1;
+  }
+
+  int status = 0;
+  ((WalkFrame*)stack->data)[stack->len++] = (WalkFrame){node, 0, path_len};
+
+  while (stack->len > 0 && status == 0) {
+    WalkFrame* top = &((WalkFrame*)stack->data)[stack->len - 1];
+    const DuIndexNode* n = &index->nodes[top->node];
+    int depth = (int)stack->len - 1;
+
+    if ((max_depth < 0 || depth < max_depth) && top->next < n->child_count) {
+      uint32_t child = n->first_child + top->next++;
+      size_t len = top->path_len;
+      char name[kIndexPathMax];
+      size_t name_len = DuIndexName(index, child, name, sizeof(name));
+      if (name_len == 0 || len + name_len + 1 >= sizeof(pathname) ||
+          ReserveDynamicArray(stack, 1, sizeof(WalkFrame)) < 0) {
+        status = -1;
+        break;
+      }
+
+      pathname[len++] = '/';
+      memcpy(pathname + len, name, name_len + 1);
+      ((WalkFrame*)stack->data)[stack->len++] =
+          (WalkFrame){child, 0, len + name_len};
+      continue;
+    }
+
+    pathname[top->path_len] = '\0';
+    DuEntry entry = {
+        .path = pathname,
+        .depth = depth,
+        .statbuf = NULL,
+        .disk_usage = (blkcnt_t)n->disk_usage,
+    };
+    if (visit(&entry, ctx)) {
+      status = 1;
+    }
+    stack->len--;
+  }
+
+  FreeDynamicArray(stack);
+  return status;
+}
+
+/**
+ * @brief Reports the largest entries below a node, largest first.
+ *
+ * @param index Index to read.
+ * @param node  Node at the top of the subtree; it is not reported itself.
+ * @param path  Path to report for `node`.
+ * @param count Maximum number of entries to report.
+ * @param visit Visitor receiving each entry, with a NULL `statbuf` and its
+ *              depth relative to `node`.
+ * @param ctx   Passed to `visit`.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the listing, or -1 on
+ *         error.
+ */
+int DuIndexTop(const DuIndex* index, uint32_t node, const char* path,
+               size_t count, DuVisitFn visit, void* ctx) {
+  const DuIndexNode* nodes = index->nodes;
+  if (count == 0) {
+    return 0;
+  }
+  if (count > index->header->node_count) {
+    count = (size_t)index->header->node_count;  // more than there can be
+  }
+
+  uint32_t* heap = malloc(count * sizeof(uint32_t));
+  DynamicArray* stack = InitDynamicArray(64, sizeof(uint32_t));
+  if (!heap || !stack) {
+    free(heap);
+    FreeDynamicArray(stack);
+    return -1;
+  }
+
+  // Keep the `count` largest descendants in a min-heap
+  size_t len = 0;
+  int status = 0;
+  ((uint32_t*)stack->data)[stack->len++] = node;
+  while (stack->len > 0) {
+    const DuIndexNode* n = &nodes[((uint32_t*)stack->data)[--stack->len]];
+    if (ReserveDynamicArray(stack, n->child_count, sizeof(uint32_t)) < 0) {
+      status = -1;
+      break;
+    }
+
+    for (uint32_t i = 0; i < n->child_count; i++) {
+      uint32_t child = n->first_child + i;
+      ((uint32_t*)stack->data)[stack->len++] = child;
+
+      if (len < count) {
+        heap[len++] = child;
+        if (len == count) {
+          Heapify(heap, len, nodes);
+        }
+      } else if (nodes[child].disk_usage > nodes[heap[0]].disk_usage) {
+        heap[0] = child;
+        SiftDown(heap, len, 0, nodes);
+      }
+    }
+  }
+  FreeDynamicArray(stack);
+  if (len < count) {
+    Heapify(heap, len, nodes);
+  }
+
+  // Popping the min-heap from the back yields the entries largest first
+  size_t path_len = strlen(path);
+  size_t n_results = len;
+  for (size_t i = n_results; i-- > 1;) {
+    uint32_t tmp = heap[0];
+    heap[0] = heap[i];
+    heap[i] = tmp;
+    SiftDown(heap, i, 0, nodes);
+  }
+
+  for (size_t i = 0; i < n_results && status == 0; i++) {
+    // Build the path backwards from the entry up to `node`
+    char pathname[kIndexPathMax];
+    size_t pos = sizeof(pathname) - 1;
+    pathname[pos] = '\0';
+    int depth = 0;
+    for (uint32_t cur = heap[i]; cur != node; cur = nodes[cur].parent) {
+      char name[kIndexPathMax];
+      size_t name_len = DuIndexName(index, cur, name, sizeof(name));
+      if (name_len == 0 || name_len + 1 + path_len >= pos) {
+        status = -1;
+        break;
+      }
+      pos -= name_len;
+      memcpy(pathname + pos, name, name_len);
+      pathname[--pos] = '/';
+      depth++;
+    }
+    if (status != 0) {
+      break;
+    }
+    pos -= path_len;
+    memcpy(pathname + pos, path, path_len);
+
+    DuEntry entry = {
+        .path = pathname + pos,
+        .depth = depth,
+        .statbuf = NULL,
+        .disk_usage = (blkcnt_t)nodes[heap[i]].disk_usage,
+    };
+    if (visit(&entry, ctx)) {
+      status = 1;
+    }
+  }
+
+  free(heap);
+  return status;
+}
+
+/**
+ * @brief Encodes a tree in the index format.
+ *
+ * Nodes are renumbered breadth-first from the root so that the children of
+ * every node end up contiguous, sorted by name.
+ *
+ * @param tree Tree holding a complete scan.
+ * @param out  Byte array receiving the index.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int Serialize(DuTree* tree, DynamicArray* out) {
+  if (tree->failed) {
+    errno = tree->failed;
+    return -1;
+  }
+  if (tree->pending->len != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t count = tree->nodes->len;
+  const DuTreeNode* nodes = (const DuTreeNode*)tree->nodes->data;
+  const uint32_t* kids = (const uint32_t*)tree->kids->data;
+
+  uint32_t* order = malloc(count * sizeof(uint32_t));
+  NamedNode* named = malloc(count * sizeof(NamedNode));
+  DuIndexNode* index_nodes = calloc(count, sizeof(DuIndexNode));
+  DynamicArray* names = InitDynamicArray(4096, 1);
+  if (!order || !named || !index_nodes || !names) {
+    free(order);
+    free(named);
+    free(index_nodes);
+    FreeDynamicArray(names);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  order[0] = ((uint32_t*)tree->pending->data)[0];
+  size_t tail = 1;
+  for (size_t head = 0; head < tail; head++) {
+    const DuTreeNode* n = &nodes[order[head]];
+    for (uint32_t i = 0; i < n->kid_count; i++) {
+      named[i].name = nodes[kids[n->kids + i]].name;
+      named[i].id = kids[n->kids + i];
+    }
+    qsort(named, n->kid_count, sizeof(NamedNode), CompareNamed);
+
+    index_nodes[head].first_child = (uint32_t)tail;
+    index_nodes[head].child_count = n->kid_count;
+    for (uint32_t i = 0; i < n->kid_count; i++) {
+      index_nodes[tail].parent = (uint32_t)head;
+      order[tail++] = named[i].id;
+    }
+  }
+
+  int status = 0;
+  const char* prev = "";
+  for (size_t i = 0; i < count; i++) {
+    const DuTreeNode* n = &nodes[order[i]];
+    DuIndexNode* in = &index_nodes[i];
+    in->disk_usage = (uint64_t)n->disk_usage;
+
+    size_t shared = 0;
+    if (i > 0 && (i - index_nodes[in->parent].first_child) % kDuIndexRestart) {
+      while (prev[shared] && prev[shared] == n->name[shared]) {
+        shared++;
+      }
+    }
+    size_t suffix = strlen(n->name + shared);
+
+    if (ReserveDynamicArray(names, 2 * kVarintMax + suffix, 1) < 0) {
+      errno = ENOMEM;
+      status = -1;
+      break;
+    }
+    unsigned char* p = (unsigned char*)names->data + names->len;
+    in->name = (uint32_t)names->len;
+    p += PutVarint(p, (uint32_t)shared);
+    p += PutVarint(p, (uint32_t)suffix);
+    memcpy(p, n->name + shared, suffix);
+    names->len = (size_t)(p + suffix - (unsigned char*)names->data);
+    prev = n->name;
+  }
+
+  if (status == 0) {
+    DuIndexHeader header = {
+        .version = kDuIndexVersion,
+        .node_count = count,
+        .names_offset = sizeof(DuIndexHeader) + count * sizeof(DuIndexNode),
+        .names_size = names->len,
+    };
+    memcpy(header.magic, DU_INDEX_MAGIC, sizeof(header.magic));
+
+    size_t size = header.names_offset + names->len;
+    if (ReserveDynamicArray(out, size, 1) < 0) {
+      errno = ENOMEM;
+      status = -1;
+    } else {
+      unsigned char* p = (unsigned char*)out->data + out->len;
+      memcpy(p, &header, sizeof(header));
+      memcpy(p + sizeof(header), index_nodes, count * sizeof(DuIndexNode));
+      memcpy(p + header.names_offset, names->data, names->len);
+      out->len += size;
+    }
+  }
+
+  free(order);
+  free(named);
+  free(index_nodes);
+  FreeDynamicArray(names);
+  return status;
+}
+
+/**
+ * @brief Orders named nodes by name.
+ */
+static int CompareNamed(const void* a, const void* b) {
+  return strcmp(((const NamedNode*)a)->name, ((const NamedNode*)b)->name);
+}
+
+/**
+ * @brief Writes `v` as a little-endian base-128 varint.
+ *
+ * @return Returns the number of bytes written.
+ */
+static size_t PutVarint(unsigned char* p, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+/**
+ * @brief Reads a varint written by `PutVarint`.
+ *
+ * @return Returns a pointer past the varint, or NULL if it runs past `end`.
+ */
+static const unsigned char* GetVarint(const unsigned char* p,
+                                      const unsigned char* end, uint32_t* v) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 35 && p < end; shift += 7) {
+    unsigned char byte = *p++;
+    result |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *v = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Arranges `heap` into a min-heap ordered by disk usage.
+ */
+static void Heapify(uint32_t* heap, size_t len, const DuIndexNode* nodes) {
+  for (size_t i = len / 2; i-- > 0;) {
+    SiftDown(heap, len, i, nodes);
+  }
+}
+
+/**
+ * @brief Restores the min-heap property below `i`, ordering nodes by disk
+ *        usage.
+ */
+static void SiftDown(uint32_t* heap, size_t len, size_t i,
+                     const DuIndexNode* nodes) {
+  for (;;) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < len &&
+        nodes[heap[left]].disk_usage < nodes[heap[smallest]].disk_usage) {
+      smallest = left;
+    }
+    if (right < len &&
+        nodes[heap[right]].disk_usage < nodes[heap[smallest]].disk_usage) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+
+    uint32_t tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
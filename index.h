@@ -0,0 +1,81 @@
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+
+#include "libdu.h"
+
+/**
+ * On-disk scan index. The file is pointer-free so it can be used straight from
+ * `mmap`:
+ *
+ *   DuIndexHeader | DuIndexNode[node_count] | names[names_size]
+ *
+ * Nodes are stored breadth-first, so the children of a node are contiguous and
+ * sorted by name. Node 0 is the root and its name is the scanned path. Names
+ * are front-coded against the previous sibling (varint shared prefix length,
+ * varint suffix length, suffix bytes), with a full name every
+ * `kDuIndexRestart` siblings so lookups can binary search the restart points.
+ * Integers use the byte order of the host that wrote the file.
+ */
+#define DU_INDEX_MAGIC "DUIX"
+
+static const uint32_t kDuIndexVersion = 1;
+static const uint32_t kDuIndexRestart = 16;  // siblings per restart point
+
+typedef struct DuIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t node_count;
+  uint64_t names_offset;  // bytes from the start of the file
+  uint64_t names_size;    // bytes
+} DuIndexHeader;
+
+typedef struct DuIndexNode {
+  uint64_t disk_usage;   // kilobytes, subtree total for directories
+  uint32_t parent;       // the root is its own parent
+  uint32_t first_child;
+  uint32_t child_count;
+  uint32_t name;         // offset of the encoded name in the names blob
+} DuIndexNode;
+
+/**
+ * @brief A read-only view of an index, either mapped from a file or borrowed
+ *        from memory.
+ */
+typedef struct DuIndex {
+  void *map;    // NULL when the memory is not owned by the index
+  size_t size;
+  const DuIndexHeader *header;
+  const DuIndexNode *nodes;
+  const unsigned char *names;
+} DuIndex;
+
+/**
+ * @brief In-memory tree assembled from visited entries, used to write an
+ *        index. Opaque.
+ */
+typedef struct DuTree DuTree;
+
+// Tree Functions
+DuTree *DuTreeCreate(void);
+int DuTreeAdd(const DuEntry *entry, void *tree);
+DynamicArray *DuTreeSerialize(DuTree *tree);
+int DuTreeSave(DuTree *tree, const char *path);
+void DuTreeFree(DuTree *tree);
+
+// Index Functions
+int DuIndexOpen(DuIndex *index, const char *path);
+int DuIndexView(DuIndex *index, const void *data, size_t size);
+void DuIndexClose(DuIndex *index);
+int64_t DuIndexLookup(const DuIndex *index, const char *path);
+int64_t DuIndexChild(const DuIndex *index, uint32_t node, const char *name);
+size_t DuIndexName(const DuIndex *index, uint32_t node, char *buf,
+                   size_t bufsize);
+int DuIndexWalk(const DuIndex *index, uint32_t node, const char *path,
+                int max_depth, DuVisitFn visit, void *ctx);
+int DuIndexTop(const DuIndex *index, uint32_t node, const char *path,
+               size_t count, DuVisitFn visit, void *ctx);
+
+#endif  // INDEX_H_
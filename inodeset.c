@@ -0,0 +1,490 @@
+/**
+ * @file   inodeset.c
+ *
+ * @brief  Lock-free concurrent set of (dev, ino) keys with per-stripe
+ *         incremental resizing, for multi-threaded scans. Keys are packed
+ *         into the slots themselves.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "inodeset.h"
+
+#include <stdint.h>     // uint64_t, uintptr_t
+#include <stdlib.h>     // aligned_alloc, calloc, free, malloc
+#include <string.h>     // memset
+
+enum {
+  kStripeBits = 6,
+  kStripes = 1 << kStripeBits,
+  kStripeInitSlots = 64,  // power of two
+  kMigrateChunk = 64,     // slots migrated by each operation that helps
+  kInoBits = 56,          // of an inode number packed into a slot
+  kDevices = 128,         // devices whose keys can be packed, 2^(63 - 56)
+};
+
+enum {
+  kPresent = 0,   // as returned by `DuInodeSetInsert`
+  kInserted = 1,
+  kAbsent = 2,
+};
+
+// Slot words: a packed key has the top bit set, with the index of its
+// device in `devices` above its inode number. Any other word but the empty
+// slot and the seals points to a key that did not fit, allocated on its own.
+static const uint64_t kPacked = 1ULL << 63;
+static const uint64_t kEmpty = 0;
+static const uint64_t kEmptied = 1;  // sealed while empty, so that no key
+                                     // probed past it can be further on
+static const uint64_t kMoved = 2;    // sealed once copied to the next table
+
+/**
+ * @brief A key too large to pack, written before it is published in a slot
+ *        and never changed after, so a key read from a slot is complete.
+ */
+typedef struct Key {
+  dev_t dev;
+  ino_t ino;
+} Key;
+
+/**
+ * @brief An open-addressing table of keys. Once it is half full a table
+ *        twice as large is linked as `next`, and every operation that meets
+ *        the link migrates a chunk of slots before going on in `next`.
+ */
+typedef struct Table Table;
+struct Table {
+  Table* next;        // table being migrated to, NULL until this one fills
+  size_t capacity;    // power of two
+  size_t count;       // slots holding keys, copies included
+  size_t claimed;     // slots handed out to migrate, by chunks
+  size_t migrated;    // slots sealed
+  uint64_t slots[];   // kEmpty, a key, or one of the seals
+};
+
+/**
+ * @brief A stripe of the set, on its own cache line.
+ */
+typedef struct __attribute__((aligned(64))) Stripe {
+  Table* table;  // newest table fully migrated to, or the first
+  Table* first;  // first table, from which every later one is linked
+} Stripe;
+
+struct DuInodeSet {
+  Stripe stripes[kStripes];
+  uint64_t devices[kDevices];  // device + 1 of each index, 0 past the last
+};
+
+static uint64_t Pack(DuInodeSet* set, dev_t dev, ino_t ino, int add);
+static int Probe(Table* table, uint64_t hash, uint64_t packed, dev_t dev,
+                 ino_t ino, uint64_t* insert);
+static Table* Current(Stripe* stripe);
+static int Resize(Table* table);
+static int HelpMigrate(Table* table);
+static int MigratePath(Table* table, uint64_t hash);
+static int MigrateSlot(Table* table, size_t index, uint64_t* seal);
+static Table* NewTable(size_t capacity);
+static uint64_t Hash(dev_t dev, ino_t ino);
+static int IsKey(uint64_t word);
+
+/**
+ * @brief Creates an empty set.
+ *
+ * @return Returns the set, or NULL if allocation fails.
+ */
+DuInodeSet* DuInodeSetCreate(void) {
+  DuInodeSet* set = aligned_alloc(sizeof(Stripe), sizeof(DuInodeSet));
+  if (!set) {
+    return NULL;
+  }
+  memset(set, 0, sizeof(DuInodeSet));
+
+  for (int i = 0; i < kStripes; i++) {
+    Stripe* stripe = &set->stripes[i];
+    stripe->first = NewTable(kStripeInitSlots);
+    if (!stripe->first) {
+      DuInodeSetFree(set);
+      return NULL;
+    }
+    stripe->table = stripe->first;
+  }
+  return set;
+}
+
+/**
+ * @brief Searches for an inode in the set.
+ *
+ * @param set Set to search.
+ * @param dev Device of the inode.
+ * @param ino Inode number to search for.
+ *
+ * @return Returns 1 if the inode is in the set, 0 if not, or if a migration
+ *         it had to help with could not allocate.
+ */
+int DuInodeSetSearch(DuInodeSet* set, dev_t dev, ino_t ino) {
+  uint64_t packed = Pack(set, dev, ino, 0);
+  uint64_t hash = packed ? DuInodeMix(packed) : Hash(dev, ino);
+  Stripe* stripe = &set->stripes[hash >> (64 - kStripeBits)];
+  return Probe(Current(stripe), hash, packed, dev, ino, NULL) == kPresent;
+}
+
+/**
+ * @brief Inserts an inode into the set unless it is already there. When
+ *        several threads insert the same inode at once, exactly one of them
+ *        is told it inserted it.
+ *
+ * @param set Set to insert into.
+ * @param dev Device of the inode.
+ * @param ino Inode number to insert.
+ *
+ * @return Returns 1 if the inode was inserted, 0 if it was already in the
+ *         set, or -1 if the set could not grow.
+ */
+int DuInodeSetInsert(DuInodeSet* set, dev_t dev, ino_t ino) {
+  uint64_t packed = Pack(set, dev, ino, 1);
+  uint64_t hash = packed ? DuInodeMix(packed) : Hash(dev, ino);
+  Stripe* stripe = &set->stripes[hash >> (64 - kStripeBits)];
+
+  uint64_t insert = packed;
+  int status = Probe(Current(stripe), hash, packed, dev, ino, &insert);
+  if (status != kInserted && !packed) {
+    free((Key*)(uintptr_t)insert);
+  }
+  return status;
+}
+
+/**
+ * @brief Frees a set, with every table it has grown through. No other thread
+ *        may be using it.
+ *
+ * Every key is held unsealed in exactly one slot: a copy seals the slot it
+ * was copied from.
+ *
+ * @param set Set to free, may be NULL.
+ */
+void DuInodeSetFree(DuInodeSet* set) {
+  if (!set) {
+    return;
+  }
+
+  for (int i = 0; i < kStripes; i++) {
+    Table* table = set->stripes[i].first;
+    while (table) {
+      for (size_t j = 0; j < table->capacity; j++) {
+        uint64_t word = table->slots[j];
+        if (IsKey(word) && !(word & kPacked)) {
+          free((Key*)(uintptr_t)word);
+        }
+      }
+      Table* next = table->next;
+      free(table);
+      table = next;
+    }
+  }
+  free(set);
+}
+
+/**
+ * @brief Finalizer of SplitMix64, spreading every input bit over the output.
+ *        Shared with the hard-link filter, which hashes keys the same way.
+ */
+uint64_t DuInodeMix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * @brief Packs a key into one slot word, its device replaced by an index in
+ *        the set's device table. Devices are appended to the table with a
+ *        compare-and-swap, so every thread packs a key the same way.
+ *
+ * @param set Set holding the device table.
+ * @param dev Device of the inode.
+ * @param ino Inode number.
+ * @param add Whether to add the device to the table if missing.
+ *
+ * @return Returns the packed key, or 0 if the key is to be kept out of line:
+ *         its inode number is too large, or its device is not in the full
+ *         table, or not in it at all when not adding.
+ */
+static uint64_t Pack(DuInodeSet* set, dev_t dev, ino_t ino, int add) {
+  uint64_t tag = (uint64_t)dev + 1;
+  if ((uint64_t)ino >> kInoBits || tag == 0) {
+    return 0;
+  }
+
+  for (uint64_t i = 0; i < kDevices; i++) {
+    uint64_t* device = &set->devices[i];
+    uint64_t found = __atomic_load_n(device, __ATOMIC_ACQUIRE);
+    if (found == 0 && !add) {
+      return 0;
+    }
+    // On failure `found` holds the device another thread added here
+    if (found == 0 &&
+        __atomic_compare_exchange_n(device, &found, tag, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      found = tag;
+    }
+    if (found == tag) {
+      return kPacked | i << kInoBits | (uint64_t)ino;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Looks a key up, and inserts it if `insert` is given, in a table or,
+ *        once it is being migrated, the tables that follow it.
+ *
+ * Slots are probed linearly and never emptied, so a key lies before the
+ * first empty slot of its path. A thread that finds the key absent claims
+ * that slot with a compare-and-swap of the key, so other threads see either
+ * no key there or a complete one and never wait. Packed keys are compared
+ * in the slot itself; only keys too large to pack are followed.
+ *
+ * @param table  Table to start from.
+ * @param hash   Hash of the key.
+ * @param packed The key packed, or 0 if it is kept out of line.
+ * @param dev    Device of the inode.
+ * @param ino    Inode number.
+ * @param insert NULL to search only. Otherwise the slot word to insert, or 0
+ *               for an out-of-line key to be allocated when needed; the
+ *               caller frees it unless it was inserted.
+ *
+ * @return Returns kPresent, kInserted, kAbsent when searching, or -1 if a
+ *         table or key could not be allocated.
+ */
+static int Probe(Table* table, uint64_t hash, uint64_t packed, dev_t dev,
+                 ino_t ino, uint64_t* insert) {
+  for (;;) {
+    Table* next = __atomic_load_n(&table->next, __ATOMIC_ACQUIRE);
+    if (next) {
+      // The key may still be here; past its path it can only be in `next`
+      if (HelpMigrate(table) < 0 || MigratePath(table, hash) < 0) {
+        return -1;
+      }
+      table = next;
+      continue;
+    }
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = 0, index = hash & mask; i <= mask;
+         i++, index = (index + 1) & mask) {
+      uint64_t* slot = &table->slots[index];
+      uint64_t word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+      if (word == kEmpty) {
+        if (!insert) {
+          return kAbsent;
+        }
+        if (__atomic_load_n(&table->count, __ATOMIC_RELAXED) >=
+            table->capacity / 2) {
+          break;
+        }
+        if (!*insert) {
+          Key* key = malloc(sizeof(Key));
+          if (!key) {
+            return -1;
+          }
+          *key = (Key){dev, ino};
+          *insert = (uint64_t)(uintptr_t)key;
+        }
+        if (__atomic_compare_exchange_n(slot, &word, *insert, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          __atomic_fetch_add(&table->count, 1, __ATOMIC_RELAXED);
+          return kInserted;
+        }
+        // Lost the slot; `word` now holds the winner or a seal
+      }
+      if (!IsKey(word)) {
+        break;
+      }
+      if (packed ? word == packed
+                 : !(word & kPacked) && ((Key*)(uintptr_t)word)->dev == dev &&
+                       ((Key*)(uintptr_t)word)->ino == ino) {
+        return kPresent;
+      }
+    }
+
+    // Full, or sealed by a migration that is under way
+    if (Resize(table) < 0) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * @brief Returns the newest table of a stripe whose predecessors are all
+ *        migrated, moving the stripe on to it.
+ */
+static Table* Current(Stripe* stripe) {
+  Table* table = __atomic_load_n(&stripe->table, __ATOMIC_ACQUIRE);
+  Table* next;
+  while ((next = __atomic_load_n(&table->next, __ATOMIC_ACQUIRE)) &&
+         __atomic_load_n(&table->migrated, __ATOMIC_ACQUIRE) ==
+             table->capacity) {
+    // On failure `table` is reloaded with the table another thread set
+    if (__atomic_compare_exchange_n(&stripe->table, &table, next, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      table = next;
+    }
+  }
+  return table;
+}
+
+/**
+ * @brief Links a table twice as large after a full one, unless another
+ *        thread already has.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int Resize(Table* table) {
+  if (__atomic_load_n(&table->next, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+
+  Table* next = NewTable(2 * table->capacity);
+  if (!next) {
+    return -1;
+  }
+  Table* expected = NULL;
+  if (!__atomic_compare_exchange_n(&table->next, &expected, next, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(next);
+  }
+  return 0;
+}
+
+/**
+ * @brief Migrates the next chunk of a table's slots not yet handed out, so
+ *        that resizing is spread over the operations that meet it.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int HelpMigrate(Table* table) {
+  size_t start =
+      __atomic_fetch_add(&table->claimed, kMigrateChunk, __ATOMIC_RELAXED);
+  if (start >= table->capacity) {
+    return 0;
+  }
+
+  size_t end = start + kMigrateChunk;
+  if (end > table->capacity) {
+    end = table->capacity;
+  }
+  for (size_t index = start; index < end; index++) {
+    uint64_t seal;
+    if (MigrateSlot(table, index, &seal) < 0) {
+      return -1;
+    }
+  }
+  __atomic_add_fetch(&table->migrated, end - start, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * @brief Migrates the slots on a key's path, up to the first one that was
+ *        empty. The key, if it was in the table, is then in the next one,
+ *        and can no longer be inserted here.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int MigratePath(Table* table, uint64_t hash) {
+  size_t mask = table->capacity - 1;
+  for (size_t i = 0, index = hash & mask; i <= mask;
+       i++, index = (index + 1) & mask) {
+    uint64_t seal;
+    if (MigrateSlot(table, index, &seal) < 0) {
+      return -1;
+    }
+    if (seal == kEmptied) {
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Seals a slot of a table being migrated: an empty one as kEmptied,
+ *        and one holding a key as kMoved once the key is in the next table.
+ *        Several threads may migrate the same slot at once.
+ *
+ * @param table Table with a next table.
+ * @param index Slot to migrate.
+ * @param seal  Receives the seal the slot ends with.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int MigrateSlot(Table* table, size_t index, uint64_t* seal) {
+  uint64_t* slot = &table->slots[index];
+  uint64_t word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    if (word == kEmptied || word == kMoved) {
+      *seal = word;
+      return 0;
+    }
+
+    if (word == kEmpty) {
+      if (__atomic_compare_exchange_n(slot, &word, kEmptied, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        *seal = kEmptied;
+        return 0;
+      }
+      continue;
+    }
+
+    // Copied as the same word, so racing copies find it already there
+    uint64_t copy = word;
+    Table* next = __atomic_load_n(&table->next, __ATOMIC_ACQUIRE);
+    int status;
+    if (word & kPacked) {
+      status = Probe(next, DuInodeMix(word), word, 0, 0, &copy);
+    } else {
+      const Key* key = (const Key*)(uintptr_t)word;
+      status = Probe(next, Hash(key->dev, key->ino), 0, key->dev, key->ino,
+                     &copy);
+    }
+    if (status < 0) {
+      return -1;
+    }
+    __atomic_compare_exchange_n(slot, &word, kMoved, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_ACQUIRE);
+    *seal = kMoved;
+    return 0;
+  }
+}
+
+/**
+ * @brief Creates an empty table.
+ *
+ * @return Returns the table, or NULL if allocation fails.
+ */
+static Table* NewTable(size_t capacity) {
+  Table* table = calloc(1, sizeof(Table) + capacity * sizeof(uint64_t));
+  if (table) {
+    table->capacity = capacity;
+  }
+  return table;
+}
+
+/**
+ * @brief Hashes a key kept out of line; packed keys are hashed as packed.
+ *        The top bits pick the stripe and the low bits the first slot
+ *        probed.
+ */
+static uint64_t Hash(dev_t dev, ino_t ino) {
+  return DuInodeMix((uint64_t)ino ^ DuInodeMix((uint64_t)dev));
+}
+
+/**
+ * @brief Tells whether a slot word holds a key rather than being empty or
+ *        sealed.
+ */
+static int IsKey(uint64_t word) {
+  return word != kEmpty && word != kEmptied && word != kMoved;
+}
@@ -0,0 +1,34 @@
+#ifndef INODESET_H_
+#define INODESET_H_
+
+#include <stdint.h>     // uint64_t
+#include <sys/types.h>  // dev_t, ino_t
+
+/**
+ * Set of (dev, ino) keys that any number of threads can search and insert
+ * into at once, without locks. Keys are spread over independent stripes,
+ * each an open-addressing table of 64-bit slots. A key is packed into its
+ * slot as the inode number and the index of its device in a small table of
+ * the devices met, so a probe compares slots without following pointers, and
+ * an insert publishes its key with one compare-and-swap: no thread ever
+ * waits on another. A stripe that fills up links a table twice as large,
+ * and the operations that meet it each move a chunk of slots over, sealing
+ * the slots they empty, so resizing is spread over them instead of stopping
+ * the stripe.
+ *
+ * Keys whose inode number needs more than 56 bits, or whose device comes
+ * after the first 128, are allocated on their own and their slot points to
+ * them. The tables a stripe outgrows are only freed with the set, which at
+ * most doubles its slots. Unlike the
+ * `DynamicArray` of `DuInode`, keys are never evicted.
+ */
+typedef struct DuInodeSet DuInodeSet;
+
+// Inode Set Functions
+DuInodeSet *DuInodeSetCreate(void);
+int DuInodeSetSearch(DuInodeSet *set, dev_t dev, ino_t ino);
+int DuInodeSetInsert(DuInodeSet *set, dev_t dev, ino_t ino);
+void DuInodeSetFree(DuInodeSet *set);
+uint64_t DuInodeMix(uint64_t x);
+
+#endif  // INODESET_H_
@@ -0,0 +1,1731 @@
+/**
+ * @file   libdu.c
+ *
+ * @brief  Reentrant disk usage scanner. All scan state lives in a `DuState`
+ *         owned by the caller, and results are reported through the visitor
+ *         and error callbacks in `DuOptions` instead of being printed.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "libdu.h"
+
+#include <dirent.h>     // opendir, readdir, closedir, dirent
+#include <errno.h>      // errno, ENOMEM, EINVAL, EIO, ENAMETOOLONG
+#include <stdint.h>     // uint32_t, uint64_t, int64_t
+#include <stdio.h>      // snprintf, fopen, fread, fwrite, rename, remove
+#include <stdlib.h>     // malloc, realloc, free
+#include <string.h>     // strcmp, strdup, strlen, memcmp, memcpy, memset
+#include <time.h>       // clock_gettime
+#include <unistd.h>     // fsync
+
+#include "filter.h"
+#include "index.h"
+#include "inodeset.h"
+#include "links.h"
+#include "parallel.h"
+#include "progress.h"
+
+static const size_t kPathMax = 512;  // bytes
+
+/**
+ * Checkpoint format, in the byte order of the host that wrote it:
+ *
+ *   "DUCP" | uint32_t version | uint32_t started | int64_t total |
+ *   string rootpath | uint64_t seen count | DuInode seen... |
+ *   uint64_t frame count | frame...
+ *
+ * where a string is a uint32_t length followed by its bytes, and a frame is
+ * its path, its struct stat, its int64_t partial total and the name of the
+ * last entry it entered (empty if none), outermost directory first.
+ */
+#define DU_CHECKPOINT_MAGIC "DUCP"
+
+static const uint32_t kCheckpointVersion = 2;
+
+/**
+ * @brief An open directory on the iterator stack.
+ */
+typedef struct DuFrame {
+  DIR* dirp;            // NULL in sorted scans
+  DynamicArray* names;  // sorted entry names, in sorted scans only
+  size_t next;          // index of the next name to enter
+  char* path;
+  struct stat statbuf;
+  blkcnt_t total;  // kilobytes accounted so far, including the directory
+} DuFrame;
+
+struct DuIter {
+  DuOptions opts;
+  DuState state;
+  char* rootpath;
+  DynamicArray* stack;  // of DuFrame, innermost directory last
+  blkcnt_t total;
+  int started;
+};
+
+/**
+ * @brief A directory entry name with its node and size in a guide index.
+ */
+typedef struct GuidedName {
+  char* name;
+  int64_t node;         // -1 if the guide does not have the entry
+  uint64_t disk_usage;  // kilobytes, 0 if the guide does not have the entry
+} GuidedName;
+
+/**
+ * @brief Read cursor over a checkpoint loaded in memory.
+ */
+typedef struct DuReader {
+  const char* pos;
+  const char* end;
+} DuReader;
+
+static int StatEntry(DuState* state, const char* path, int depth,
+                     struct stat* statbuf);
+static int InitFollow(DuState* state);
+static void FreeFollow(DuState* state);
+static int Revisited(DuState* state, const char* path,
+                     const struct stat* statbuf);
+static DIR* OpenDirectory(DuState* state, const char* path);
+static blkcnt_t AccountFile(DuState* state, const char* path, int depth,
+                            const struct stat* statbuf);
+static blkcnt_t SortedChildren(DIR* dirp, const char* rootpath, int depth,
+                               int64_t node, DuState* state);
+static DynamicArray* ReadNames(DuState* state, DIR* dirp,
+                               const char* rootpath);
+static int CompareNames(const void* a, const void* b);
+static int64_t* GuideOrder(const DuIndex* guide, int64_t node,
+                           DynamicArray* names);
+static int CompareGuided(const void* a, const void* b);
+static void IterStep(DuIter* it);
+static void IterEnter(DuIter* it, const char* path);
+static void IterLeave(DuIter* it);
+static void IterAdd(DuIter* it, blkcnt_t disk_usage);
+static int IterDone(const DuIter* it);
+static void FreeFrame(DuFrame* frame);
+static int PushResumedFrame(DuIter* it, DuReader* reader);
+static int AppendBytes(DynamicArray* out, const void* data, size_t size);
+static int AppendString(DynamicArray* out, const char* str);
+static int ReadBytes(DuReader* reader, void* data, size_t size);
+static char* ReadString(DuReader* reader);
+static int WriteAtomically(const char* path, const DynamicArray* data);
+static DynamicArray* ReadFile(const char* path);
+static int DeadlinePassed(const struct timespec* deadline);
+static void ReportError(DuState* state, const char* path, DuOp op, int errnum);
+static void Account(DuState* state, blkcnt_t disk_usage);
+static blkcnt_t AccountUnreadable(DuState* state, const char* path, int depth,
+                                  const struct stat* statbuf);
+static void Visit(DuState* state, const char* path, int depth,
+                  const struct stat* statbuf, blkcnt_t disk_usage);
+static void Deliver(DuState* state, const char* path, int depth,
+                    const struct stat* statbuf, blkcnt_t disk_usage);
+static int ReplayEntry(const DuEntry* entry, void* state);
+
+/**
+ * @brief Fills `opts` with the default options: directories only, no
+ *        callbacks.
+ *
+ * @param opts Options to initialize.
+ */
+void DuDefaultOptions(DuOptions* opts) {
+  memset(opts, 0, sizeof(*opts));
+}
+
+/**
+ * @brief Calculates the disk usage of the given directory or file.
+ *
+ * Initializes a dynamic array to track seen inodes to avoid counting hard
+ * links multiple times. It performs a depth-first search (DFS) to recursively
+ * calculate the disk usage of the directory and its contents, handing every
+ * accounted entry to the visitor in `opts`.
+ *
+ * @param rootpath The path to the directory or file whose disk usage is to be
+ *                 calculated.
+ * @param opts     Scan options and callbacks.
+ * @param total    If not NULL, receives the total disk usage in kilobytes.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the scan or its
+ *         total passed `opts->exceeds`, or -1 on error.
+ */
+int du(const char* rootpath, const DuOptions* opts, blkcnt_t* total) {
+  const size_t kInitSize = 8;
+  DuState state = {.opts = opts};
+  DuThrottleInit(&state.throttle, opts->max_ops_per_sec,
+                 opts->max_dirs_per_sec, opts->adaptive_throttle);
+
+  // Following every link needs one set of entries in walk order
+  if (opts->threads > 1 && opts->follow != kDuFollowAll) {
+    blkcnt_t disk_usage = DuParallelScan(rootpath, &state, ReplayEntry);
+    if (total) {
+      *total = disk_usage;
+    }
+    if (state.error) {
+      return -1;
+    }
+    return state.stopped ? 1 : 0;
+  }
+
+  if (opts->follow == kDuFollowAll) {
+    if (InitFollow(&state) < 0) {
+      ReportError(&state, rootpath, kDuOpAlloc, ENOMEM);
+      return -1;
+    }
+  } else if (!opts->count_links &&
+             !(state.seen = InitDynamicArray(kInitSize, sizeof(DuInode)))) {
+    ReportError(&state, rootpath, kDuOpAlloc, ENOMEM);
+    return -1;
+  }
+
+  // Visits are logged rather than delivered, since totals that include
+  // repeated links are only corrected once all links have been seen
+  if (opts->link_memory && !opts->count_links && !state.visited &&
+      !(state.links = DuLinksCreate(opts->link_memory, opts->visit != NULL))) {
+    ReportError(&state, rootpath, kDuOpSpill, errno);
+    FreeDynamicArray(state.seen);
+    return -1;
+  }
+
+  state.guide_node = opts->guide ? DuIndexLookup(opts->guide, rootpath) : -1;
+  blkcnt_t disk_usage = dfs(rootpath, 0, &state);
+  FreeDynamicArray(state.seen);
+  FreeFollow(&state);
+
+  if (state.links) {
+    DuLinks* links = state.links;
+    blkcnt_t duplicates;
+    state.links = NULL;
+    if (!state.error) {
+      if (DuLinksResolve(links, ReplayEntry, &state, &duplicates) < 0) {
+        ReportError(&state, rootpath, kDuOpSpill, errno);
+      } else {
+        disk_usage -= duplicates;
+      }
+    }
+    DuLinksFree(links);
+  }
+
+  if (total) {
+    *total = disk_usage;
+  }
+
+  if (state.error) {
+    return -1;
+  }
+
+  return state.stopped ? 1 : 0;
+}
+
+/**
+ * @brief Calculates the disk usage of every path handed out by a root source,
+ *        in turn, as if each was given to `du`.
+ *
+ * The roots share one scan state, so a hard-linked file is only counted
+ * under the first root that reaches it, and the roots are pulled one at a
+ * time, so a source may stream any number of them. Given more than one
+ * root, every entry reached is remembered, directories included, as when
+ * following every link, so a root lying inside an earlier one, or reached
+ * again, is not counted twice; `count_links` counts it again. Each root is
+ * visited at depth 0. Only serial scans that keep hard links in memory are
+ * supported; `threads`, `link_memory` and `exceeds` are ignored.
+ *
+ * @param next_root Callback returning the next root, or NULL at the end.
+ * @param source    Passed to `next_root`.
+ * @param opts      Scan options and callbacks.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the scan, or -1 on
+ *         error.
+ */
+int DuScanRoots(DuRootFn next_root, void* source, const DuOptions* opts) {
+  const size_t kInitSize = 8;
+  DuOptions serial = *opts;
+  serial.threads = 0;
+  serial.link_memory = 0;
+  serial.exceeds = 0;
+
+  DuState state = {.opts = &serial};
+  DuThrottleInit(&state.throttle, opts->max_ops_per_sec,
+                 opts->max_dirs_per_sec, opts->adaptive_throttle);
+
+  // Look one root ahead: a second root may lie inside the first, so every
+  // entry reached has to be remembered, not just the linked files
+  char* first = NULL;
+  const char* rootpath = next_root(source);
+  const char* pending = NULL;
+  if (rootpath) {
+    if (!(first = strdup(rootpath))) {
+      ReportError(&state, "", kDuOpAlloc, ENOMEM);
+      return -1;
+    }
+    rootpath = first;
+    pending = next_root(source);
+  }
+
+  int failed = 0;
+  if (opts->follow == kDuFollowAll || (pending && !opts->count_links)) {
+    failed = InitFollow(&state) < 0;
+  } else if (!opts->count_links) {
+    state.seen = InitDynamicArray(kInitSize, sizeof(DuInode));
+    failed = !state.seen;
+  }
+  if (failed) {
+    ReportError(&state, "", kDuOpAlloc, ENOMEM);
+    free(first);
+    return -1;
+  }
+
+  while (!state.error && !state.stopped && rootpath) {
+    state.guide_node = opts->guide ? DuIndexLookup(opts->guide, rootpath) : -1;
+    dfs(rootpath, 0, &state);
+    rootpath = pending ? pending : next_root(source);
+    pending = NULL;
+  }
+  free(first);
+  FreeDynamicArray(state.seen);
+  FreeFollow(&state);
+
+  if (state.error) {
+    return -1;
+  }
+  return state.stopped ? 1 : 0;
+}
+
+/**
+ * @brief Performs a depth-first search to calculate disk usage.
+ *
+ * Recursively calculates the disk usage of a directory and its contents or
+ * a single file. This function is designed to be called by 'du' and records
+ * the first error encountered in `state->error`.
+ *
+ * @param rootpath The directory or file path to calculate usage for.
+ * @param depth    Depth of `rootpath` relative to the scan root.
+ * @param state    Scan state holding the options, the seen inodes and the
+ *                 error status.
+ *
+ * @return Returns the total disk usage in kilobytes of the specified path and
+ *         its contents, or 0 if an error is encountered.
+ */
+blkcnt_t dfs(const char* rootpath, int depth, DuState* state) {
+  struct stat statbuf;
+  blkcnt_t total = 0;
+  int64_t node = state->guide_node;
+
+  if (StatEntry(state, rootpath, depth, &statbuf) < 0) {
+    ReportError(state, rootpath, kDuOpStat, errno);
+    return 0;
+  }
+
+  if (Revisited(state, rootpath, &statbuf)) {
+    return 0;
+  }
+
+  if (!S_ISDIR(statbuf.st_mode)) {
+    return AccountFile(state, rootpath, depth, &statbuf);
+  }
+
+  blkcnt_t disk_usage_kb = statbuf.st_blocks / 2;
+
+  DIR* dirp = OpenDirectory(state, rootpath);
+  if (!dirp) {
+    ReportError(state, rootpath, kDuOpOpenDir, errno);
+    return AccountUnreadable(state, rootpath, depth, &statbuf);
+  }
+
+  total += disk_usage_kb;
+  Account(state, disk_usage_kb);
+
+  if (state->ancestors && InsertInode(state->ancestors, statbuf.st_dev,
+                                      statbuf.st_ino, 0) < 0) {
+    ReportError(state, rootpath, kDuOpInsert, errno);
+    closedir(dirp);
+    return total;
+  }
+
+  if (state->opts->sorted || state->opts->guide) {
+    total += SortedChildren(dirp, rootpath, depth, node, state);
+  } else {
+    struct dirent* direntp;
+    while (!state->error && !state->stopped && (direntp = readdir(dirp))) {
+      const char* dirname = direntp->d_name;
+
+      // Avoid infinite traversal through file system
+      if (strcmp(dirname, ".") == 0 || strcmp(dirname, "..") == 0) {
+        continue;
+      }
+
+      char pathname[kPathMax];
+      if (snprintf(pathname, kPathMax, "%s/%s", rootpath, dirname) < 0) {
+        ReportError(state, rootpath, kDuOpPath, errno);
+        continue;
+      }
+
+      total += dfs(pathname, depth + 1, state);
+    }
+    closedir(dirp);
+  }
+
+  if (state->ancestors) {
+    state->ancestors->len--;
+  }
+  if (!state->error) {
+    Visit(state, rootpath, depth, &statbuf, total);
+  }
+
+  return total;
+}
+
+/**
+ * @brief Accounts the entries of a directory in name order, or largest first
+ *        as sized in `opts->guide`.
+ *
+ * The names are read and sorted up front and the directory is closed before
+ * descending, so only one directory's names are held per level of the walk.
+ *
+ * @param dirp     Open directory stream, closed by this function.
+ * @param rootpath Path of the directory.
+ * @param depth    Depth of the directory relative to the scan root.
+ * @param node     Node of the directory in `opts->guide`, or -1.
+ * @param state    Scan state.
+ *
+ * @return Returns the disk usage in kilobytes of the directory's entries.
+ */
+static blkcnt_t SortedChildren(DIR* dirp, const char* rootpath, int depth,
+                               int64_t node, DuState* state) {
+  blkcnt_t total = 0;
+
+  DynamicArray* names = ReadNames(state, dirp, rootpath);
+  if (!names) {
+    return 0;
+  }
+
+  int64_t* nodes = NULL;
+  if (state->opts->guide &&
+      !(nodes = GuideOrder(state->opts->guide, node, names))) {
+    DuFreeNames(names);
+    ReportError(state, rootpath, kDuOpAlloc, ENOMEM);
+    return 0;
+  }
+
+  char** sorted = (char**)names->data;
+  for (size_t i = 0; i < names->len && !state->error && !state->stopped;
+       i++) {
+    char pathname[kPathMax];
+    if (snprintf(pathname, kPathMax, "%s/%s", rootpath, sorted[i]) < 0) {
+      ReportError(state, rootpath, kDuOpPath, errno);
+    } else {
+      state->guide_node = nodes ? nodes[i] : -1;
+      total += dfs(pathname, depth + 1, state);
+    }
+  }
+
+  free(nodes);
+  DuFreeNames(names);
+  return total;
+}
+
+/**
+ * @brief Reads the entry names of a directory, sorted byte-wise.
+ *
+ * @param state    Scan state.
+ * @param dirp     Open directory stream, closed by this function.
+ * @param rootpath Path of the directory.
+ *
+ * @return Returns an array of `char*` to release with `DuFreeNames`, or NULL
+ *         after reporting an allocation failure.
+ */
+static DynamicArray* ReadNames(DuState* state, DIR* dirp,
+                               const char* rootpath) {
+  DynamicArray* names = DuReadNames(dirp, 1);
+  if (!names) {
+    ReportError(state, rootpath, kDuOpAlloc, ENOMEM);
+  }
+  return names;
+}
+
+/**
+ * @brief Reads the entry names of a directory, but "." and "..", and closes
+ *        it.
+ *
+ * @param dirp   Open directory stream, closed by this function.
+ * @param sorted Whether to sort the names byte-wise.
+ *
+ * @return Returns an array of `char*` to release with `DuFreeNames`, or NULL
+ *         if allocation fails.
+ */
+DynamicArray* DuReadNames(DIR* dirp, int sorted) {
+  const size_t kInitSize = 16;
+
+  DynamicArray* names = InitDynamicArray(kInitSize, sizeof(char*));
+  struct dirent* direntp;
+  while (names && (direntp = readdir(dirp))) {
+    const char* dirname = direntp->d_name;
+
+    // Avoid infinite traversal through file system
+    if (strcmp(dirname, ".") == 0 || strcmp(dirname, "..") == 0) {
+      continue;
+    }
+
+    char* copy = strdup(dirname);
+    if (!copy || AppendDynamicArray(names, &copy, sizeof(char*)) < 0) {
+      free(copy);
+      DuFreeNames(names);
+      names = NULL;
+    }
+  }
+  closedir(dirp);
+
+  if (names && sorted) {
+    qsort(names->data, names->len, sizeof(char*), CompareNames);
+  }
+  return names;
+}
+
+/**
+ * @brief Frees an array of names returned by `DuReadNames`.
+ *
+ * @param names Names to free, may be NULL.
+ */
+void DuFreeNames(DynamicArray* names) {
+  if (!names) {
+    return;
+  }
+
+  char** data = (char**)names->data;
+  for (size_t i = 0; i < names->len; i++) {
+    free(data[i]);
+  }
+  FreeDynamicArray(names);
+}
+
+/**
+ * @brief Orders directory entry names byte-wise, as `strcmp` does.
+ */
+static int CompareNames(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * @brief Reorders the names of a directory largest first, as sized by an
+ *        earlier scan. Names the guide does not know, such as entries
+ *        created since, come last in name order.
+ *
+ * @param guide Index of the earlier scan.
+ * @param node  Node of the directory in `guide`, or -1 if it is not there.
+ * @param names Names read by `DuReadNames`, reordered in place.
+ *
+ * @return Returns the node in `guide` of each name, in the new order, to
+ *         release with `free`, or NULL if allocation fails.
+ */
+static int64_t* GuideOrder(const DuIndex* guide, int64_t node,
+                           DynamicArray* names) {
+  size_t count = names->len ? names->len : 1;
+  GuidedName* guided = malloc(count * sizeof(GuidedName));
+  int64_t* nodes = malloc(count * sizeof(int64_t));
+  if (!guided || !nodes) {
+    free(guided);
+    free(nodes);
+    return NULL;
+  }
+
+  char** data = (char**)names->data;
+  for (size_t i = 0; i < names->len; i++) {
+    guided[i].name = data[i];
+    guided[i].node =
+        node < 0 ? -1 : DuIndexChild(guide, (uint32_t)node, data[i]);
+    guided[i].disk_usage =
+        guided[i].node < 0 ? 0 : guide->nodes[guided[i].node].disk_usage;
+  }
+  qsort(guided, names->len, sizeof(GuidedName), CompareGuided);
+
+  for (size_t i = 0; i < names->len; i++) {
+    data[i] = guided[i].name;
+    nodes[i] = guided[i].node;
+  }
+  free(guided);
+  return nodes;
+}
+
+/**
+ * @brief Orders guided names by decreasing prior size, then by name.
+ */
+static int CompareGuided(const void* a, const void* b) {
+  const GuidedName* x = (const GuidedName*)a;
+  const GuidedName* y = (const GuidedName*)b;
+  if (x->disk_usage != y->disk_usage) {
+    return x->disk_usage > y->disk_usage ? -1 : 1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+/**
+ * @brief Starts a resumable scan of `rootpath`.
+ *
+ * No filesystem work is done until the first call to `DuNext`. The options are
+ * copied, but the callbacks' `ctx` must outlive the handle.
+ *
+ * @param rootpath The path to the directory or file to scan.
+ * @param opts     Scan options and callbacks.
+ *
+ * @return Returns a new handle, or NULL if allocation fails.
+ */
+DuIter* DuOpen(const char* rootpath, const DuOptions* opts) {
+  const size_t kInitSize = 8;
+
+  DuIter* it = calloc(1, sizeof(DuIter));
+  if (!it) {
+    return NULL;
+  }
+
+  it->opts = *opts;
+  it->state.opts = &it->opts;
+  DuThrottleInit(&it->state.throttle, opts->max_ops_per_sec,
+                 opts->max_dirs_per_sec, opts->adaptive_throttle);
+  it->rootpath = strdup(rootpath);
+  int following = opts->follow == kDuFollowAll;
+  if (!following) {
+    it->state.seen = InitDynamicArray(kInitSize, sizeof(DuInode));
+  }
+  it->stack = InitDynamicArray(kInitSize, sizeof(DuFrame));
+  if (!it->rootpath || !it->stack ||
+      (following ? InitFollow(&it->state) < 0 : !it->state.seen)) {
+    DuClose(it);
+    return NULL;
+  }
+  return it;
+}
+
+/**
+ * @brief Advances a scan by a bounded amount of work.
+ *
+ * Each step reads one directory entry, or finishes one directory, and hands
+ * accounted entries to the visitor exactly as `du` would. The call returns
+ * once `max_entries` steps have been made or `deadline` has passed, whichever
+ * comes first, and can be called again to resume where it left off.
+ *
+ * @param it          Scan handle.
+ * @param max_entries Maximum number of steps, or 0 for no limit.
+ * @param deadline    Absolute CLOCK_MONOTONIC time after which to return, or
+ *                    NULL for no deadline.
+ *
+ * @return Returns 1 if work remains, 0 if the scan is complete or the visitor
+ *         stopped it, or -1 on error.
+ */
+int DuNext(DuIter* it, size_t max_entries, const struct timespec* deadline) {
+  size_t steps = 0;
+
+  while (!IterDone(it)) {
+    IterStep(it);
+
+    if (it->state.error) {
+      // Unwind without visiting, like `dfs` does once an error is recorded
+      while (it->stack->len > 0) {
+        FreeFrame(&((DuFrame*)it->stack->data)[--it->stack->len]);
+      }
+      return -1;
+    }
+
+    steps++;
+    if ((max_entries && steps >= max_entries) || DeadlinePassed(deadline)) {
+      break;
+    }
+  }
+
+  return IterDone(it) ? 0 : 1;
+}
+
+/**
+ * @brief Returns the disk usage accounted so far by a scan. Once `DuNext`
+ *        returned 0 this is the total of the whole tree.
+ *
+ * @param it Scan handle.
+ *
+ * @return Returns the disk usage in kilobytes.
+ */
+blkcnt_t DuIterTotal(const DuIter* it) {
+  blkcnt_t total = it->total;
+  const DuFrame* frames = (const DuFrame*)it->stack->data;
+  for (size_t i = 0; i < it->stack->len; i++) {
+    total += frames[i].total;
+  }
+  return total;
+}
+
+/**
+ * @brief Releases a scan handle, closing any directory it still holds open.
+ *
+ * @param it Scan handle, may be NULL.
+ */
+void DuClose(DuIter* it) {
+  if (!it) {
+    return;
+  }
+
+  if (it->stack) {
+    DuFrame* frames = (DuFrame*)it->stack->data;
+    for (size_t i = 0; i < it->stack->len; i++) {
+      FreeFrame(&frames[i]);
+    }
+  }
+  FreeDynamicArray(it->stack);
+  FreeDynamicArray(it->state.seen);
+  FreeFollow(&it->state);
+  free(it->rootpath);
+  free(it);
+}
+
+/**
+ * @brief Persists the frontier of a sorted scan, so that `DuIterLoad` can
+ *        continue it later with the same final totals.
+ *
+ * The checkpoint holds the open directories with their partial totals and
+ * position, the hard-linked inodes already counted and the total accounted
+ * so far. Positions are recorded as the last entry name entered, which stays
+ * meaningful across reboots where directory stream offsets do not. The file
+ * is replaced atomically, so a crash while saving leaves the previous
+ * checkpoint intact.
+ *
+ * @param it   Scan handle opened with `DuOptions::sorted` set, no
+ *             `link_filter` and not following every link, since neither
+ *             set of inodes is saved.
+ * @param path Path of the checkpoint file.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuIterSave(const DuIter* it, const char* path) {
+  if (!it->opts.sorted || it->opts.link_filter ||
+      it->opts.follow == kDuFollowAll || it->state.error) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  DynamicArray* out = InitDynamicArray(4096, 1);
+  if (!out) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  uint32_t version = kCheckpointVersion;
+  uint32_t started = (uint32_t)it->started;
+  int64_t total = (int64_t)it->total;
+  const DynamicArray* seen = it->state.seen;
+  uint64_t seen_count = seen->len;
+  uint64_t frame_count = it->stack->len;
+
+  int status = 0;
+  status |= AppendBytes(out, DU_CHECKPOINT_MAGIC, 4);
+  status |= AppendBytes(out, &version, sizeof(version));
+  status |= AppendBytes(out, &started, sizeof(started));
+  status |= AppendBytes(out, &total, sizeof(total));
+  status |= AppendString(out, it->rootpath);
+  status |= AppendBytes(out, &seen_count, sizeof(seen_count));
+  status |= AppendBytes(out, seen->data, seen->len * sizeof(DuInode));
+  status |= AppendBytes(out, &frame_count, sizeof(frame_count));
+
+  const DuFrame* frames = (const DuFrame*)it->stack->data;
+  for (size_t i = 0; i < it->stack->len; i++) {
+    const DuFrame* frame = &frames[i];
+    int64_t frame_total = (int64_t)frame->total;
+
+    // The entry at `next - 1` is either fully accounted or the directory in
+    // the frame above, which is saved with its own position
+    const char* last =
+        frame->next ? ((char**)frame->names->data)[frame->next - 1] : "";
+
+    status |= AppendString(out, frame->path);
+    status |= AppendBytes(out, &frame->statbuf, sizeof(frame->statbuf));
+    status |= AppendBytes(out, &frame_total, sizeof(frame_total));
+    status |= AppendString(out, last);
+  }
+
+  if (status < 0) {
+    FreeDynamicArray(out);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  status = WriteAtomically(path, out);
+  FreeDynamicArray(out);
+  return status;
+}
+
+/**
+ * @brief Continues a scan from a checkpoint written by `DuIterSave`.
+ *
+ * The directories on the saved stack are read again and entered past their
+ * saved position. Entries visited after the checkpoint was taken are visited
+ * again, but each is accounted once in the totals. The options need not match
+ * the original scan's, except that the scan is always sorted and cannot
+ * follow every link.
+ *
+ * @param path Path of the checkpoint file.
+ * @param opts Scan options and callbacks.
+ *
+ * @return Returns a new handle, or NULL on error with errno set.
+ */
+DuIter* DuIterLoad(const char* path, const DuOptions* opts) {
+  if (opts->follow == kDuFollowAll) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  DynamicArray* data = ReadFile(path);
+  if (!data) {
+    return NULL;
+  }
+
+  DuReader reader = {data->data, (const char*)data->data + data->len};
+  DuIter* it = NULL;
+  char* rootpath = NULL;
+  char magic[4];
+  uint32_t version;
+  uint32_t started;
+  int64_t total;
+  uint64_t seen_count;
+  uint64_t frame_count;
+
+  if (ReadBytes(&reader, magic, sizeof(magic)) < 0 ||
+      memcmp(magic, DU_CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+      ReadBytes(&reader, &version, sizeof(version)) < 0 ||
+      version != kCheckpointVersion ||
+      ReadBytes(&reader, &started, sizeof(started)) < 0 ||
+      ReadBytes(&reader, &total, sizeof(total)) < 0 ||
+      !(rootpath = ReadString(&reader)) ||
+      ReadBytes(&reader, &seen_count, sizeof(seen_count)) < 0 ||
+      seen_count > (uint64_t)(reader.end - reader.pos) / sizeof(DuInode)) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  DuOptions sorted = *opts;
+  sorted.sorted = 1;
+  it = DuOpen(rootpath, &sorted);
+  if (!it) {
+    errno = ENOMEM;
+    goto fail;
+  }
+  it->started = (int)started;
+  it->total = (blkcnt_t)total;
+
+  DynamicArray* seen = it->state.seen;
+  if (ReserveDynamicArray(seen, (size_t)seen_count, sizeof(DuInode)) < 0) {
+    errno = ENOMEM;
+    goto fail;
+  }
+  ReadBytes(&reader, seen->data, (size_t)seen_count * sizeof(DuInode));
+  seen->len = (size_t)seen_count;
+
+  if (ReadBytes(&reader, &frame_count, sizeof(frame_count)) < 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+  for (uint64_t i = 0; i < frame_count; i++) {
+    if (PushResumedFrame(it, &reader) < 0) {
+      goto fail;
+    }
+  }
+
+  free(rootpath);
+  FreeDynamicArray(data);
+  return it;
+
+fail:;
+  int saved_errno = errno;
+  DuClose(it);
+  free(rootpath);
+  FreeDynamicArray(data);
+  errno = saved_errno;
+  return NULL;
+}
+
+/**
+ * @brief Reads a saved frame and pushes it, with its directory read again and
+ *        positioned past the last entry it had entered.
+ *
+ * @param it     Scan handle.
+ * @param reader Cursor positioned at the frame.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int PushResumedFrame(DuIter* it, DuReader* reader) {
+  DuFrame frame = {0};
+  int64_t total;
+  char* last = NULL;
+
+  if (!(frame.path = ReadString(reader)) ||
+      ReadBytes(reader, &frame.statbuf, sizeof(frame.statbuf)) < 0 ||
+      ReadBytes(reader, &total, sizeof(total)) < 0 ||
+      !(last = ReadString(reader))) {
+    free(frame.path);
+    errno = EINVAL;
+    return -1;
+  }
+  frame.total = (blkcnt_t)total;
+
+  DIR* dirp = NULL;
+  if (ReserveDynamicArray(it->stack, 1, sizeof(DuFrame)) < 0 ||
+      !(dirp = OpenDirectory(&it->state, frame.path)) ||
+      !(frame.names = ReadNames(&it->state, dirp, frame.path))) {
+    int saved_errno = dirp ? ENOMEM : errno;
+    free(frame.path);
+    free(last);
+    errno = saved_errno;
+    return -1;
+  }
+
+  char** names = (char**)frame.names->data;
+  if (*last) {
+    while (frame.next < frame.names->len &&
+           strcmp(names[frame.next], last) <= 0) {
+      frame.next++;
+    }
+  }
+  free(last);
+
+  ((DuFrame*)it->stack->data)[it->stack->len++] = frame;
+  return 0;
+}
+
+/**
+ * @brief Performs one unit of iterator work: reads the next entry of the
+ *        innermost open directory, or finishes it when it is exhausted.
+ *
+ * @param it Scan handle.
+ */
+static void IterStep(DuIter* it) {
+  if (!it->started) {
+    it->started = 1;
+    IterEnter(it, it->rootpath);
+    return;
+  }
+
+  DuFrame* top = &((DuFrame*)it->stack->data)[it->stack->len - 1];
+  const char* dirname;
+  if (top->names) {
+    if (top->next == top->names->len) {
+      IterLeave(it);
+      return;
+    }
+    dirname = ((char**)top->names->data)[top->next++];
+  } else {
+    struct dirent* direntp = readdir(top->dirp);
+    if (!direntp) {
+      IterLeave(it);
+      return;
+    }
+    dirname = direntp->d_name;
+
+    // Avoid infinite traversal through file system
+    if (strcmp(dirname, ".") == 0 || strcmp(dirname, "..") == 0) {
+      return;
+    }
+  }
+
+  char pathname[kPathMax];
+  if (snprintf(pathname, kPathMax, "%s/%s", top->path, dirname) < 0) {
+    ReportError(&it->state, top->path, kDuOpPath, errno);
+    return;
+  }
+
+  IterEnter(it, pathname);
+}
+
+/**
+ * @brief Accounts a path. Files are accounted immediately; directories are
+ *        opened and pushed onto the stack.
+ *
+ * @param it   Scan handle.
+ * @param path Path of the entry.
+ */
+static void IterEnter(DuIter* it, const char* path) {
+  int depth = (int)it->stack->len;
+  struct stat statbuf;
+
+  if (StatEntry(&it->state, path, depth, &statbuf) < 0) {
+    ReportError(&it->state, path, kDuOpStat, errno);
+    return;
+  }
+
+  if (Revisited(&it->state, path, &statbuf)) {
+    return;
+  }
+
+  if (!S_ISDIR(statbuf.st_mode)) {
+    IterAdd(it, AccountFile(&it->state, path, depth, &statbuf));
+    return;
+  }
+
+  DynamicArray* stack = it->stack;
+  if (ReserveDynamicArray(stack, 1, sizeof(DuFrame)) < 0) {
+    ReportError(&it->state, path, kDuOpAlloc, ENOMEM);
+    return;
+  }
+
+  DIR* dirp = OpenDirectory(&it->state, path);
+  if (!dirp) {
+    ReportError(&it->state, path, kDuOpOpenDir, errno);
+    IterAdd(it, AccountUnreadable(&it->state, path, depth, &statbuf));
+    return;
+  }
+
+  DynamicArray* names = NULL;
+  if (it->opts.sorted) {
+    names = ReadNames(&it->state, dirp, path);
+    if (!names) {
+      return;
+    }
+    dirp = NULL;
+  }
+
+  char* copy = strdup(path);
+  if (!copy) {
+    if (dirp) {
+      closedir(dirp);
+    }
+    DuFreeNames(names);
+    ReportError(&it->state, path, kDuOpAlloc, ENOMEM);
+    return;
+  }
+
+  DuFrame* frame = &((DuFrame*)stack->data)[stack->len++];
+  frame->dirp = dirp;
+  frame->names = names;
+  frame->next = 0;
+  frame->path = copy;
+  frame->statbuf = statbuf;
+  frame->total = statbuf.st_blocks / 2;
+  if (it->opts.progress) {
+    DuProgressAdd(it->opts.progress, 1, (uint64_t)frame->total);
+  }
+
+  DynamicArray* ancestors = it->state.ancestors;
+  if (ancestors &&
+      InsertInode(ancestors, statbuf.st_dev, statbuf.st_ino, 0) < 0) {
+    ReportError(&it->state, path, kDuOpInsert, errno);
+  }
+}
+
+/**
+ * @brief Finishes the innermost directory: visits it with its subtree total
+ *        and adds that total to its parent.
+ *
+ * @param it Scan handle.
+ */
+static void IterLeave(DuIter* it) {
+  DuFrame frame = ((DuFrame*)it->stack->data)[--it->stack->len];
+  if (it->state.ancestors) {
+    it->state.ancestors->len--;
+  }
+
+  Visit(&it->state, frame.path, (int)it->stack->len, &frame.statbuf,
+        frame.total);
+  FreeFrame(&frame);
+
+  IterAdd(it, frame.total);
+}
+
+/**
+ * @brief Adds accounted disk usage to the innermost open directory, or to the
+ *        scan total once the root has been finished.
+ *
+ * @param it         Scan handle.
+ * @param disk_usage Disk usage in kilobytes.
+ */
+static void IterAdd(DuIter* it, blkcnt_t disk_usage) {
+  if (it->stack->len > 0) {
+    ((DuFrame*)it->stack->data)[it->stack->len - 1].total += disk_usage;
+  } else {
+    it->total += disk_usage;
+  }
+}
+
+/**
+ * @brief Tells whether a scan has nothing left to do.
+ *
+ * @param it Scan handle.
+ *
+ * @return Returns 1 if the scan is complete, stopped or failed, 0 otherwise.
+ */
+static int IterDone(const DuIter* it) {
+  return (it->started && it->stack->len == 0) || it->state.stopped ||
+         it->state.error;
+}
+
+/**
+ * @brief Releases what a stack frame holds.
+ *
+ * @param frame Frame to release.
+ */
+static void FreeFrame(DuFrame* frame) {
+  if (frame->dirp) {
+    closedir(frame->dirp);
+  }
+  DuFreeNames(frame->names);
+  free(frame->path);
+}
+
+/**
+ * @brief Tells whether an absolute CLOCK_MONOTONIC deadline has passed.
+ *
+ * @param deadline Deadline, or NULL for none.
+ *
+ * @return Returns 1 if the deadline has passed, 0 otherwise.
+ */
+static int DeadlinePassed(const struct timespec* deadline) {
+  if (!deadline) {
+    return 0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline->tv_sec ||
+         (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/**
+ * @brief Appends raw bytes to a buffer.
+ *
+ * @return Returns 0 on success, or -1 if the buffer could not grow.
+ */
+static int AppendBytes(DynamicArray* out, const void* data, size_t size) {
+  if (ReserveDynamicArray(out, size, 1) < 0) {
+    return -1;
+  }
+  memcpy((char*)out->data + out->len, data, size);
+  out->len += size;
+  return 0;
+}
+
+/**
+ * @brief Appends a length-prefixed string to a buffer.
+ *
+ * @return Returns 0 on success, or -1 if the buffer could not grow.
+ */
+static int AppendString(DynamicArray* out, const char* str) {
+  uint32_t len = (uint32_t)strlen(str);
+  return AppendBytes(out, &len, sizeof(len)) | AppendBytes(out, str, len);
+}
+
+/**
+ * @brief Consumes `size` bytes from a reader into `data`.
+ *
+ * @return Returns 0 on success, or -1 if the input is too short.
+ */
+static int ReadBytes(DuReader* reader, void* data, size_t size) {
+  if ((size_t)(reader->end - reader->pos) < size) {
+    return -1;
+  }
+  memcpy(data, reader->pos, size);
+  reader->pos += size;
+  return 0;
+}
+
+/**
+ * @brief Consumes a length-prefixed string from a reader.
+ *
+ * @return Returns a newly allocated string, or NULL if the input is too short
+ *         or allocation fails.
+ */
+static char* ReadString(DuReader* reader) {
+  uint32_t len;
+  if (ReadBytes(reader, &len, sizeof(len)) < 0 ||
+      (size_t)(reader->end - reader->pos) < len) {
+    return NULL;
+  }
+
+  char* str = malloc((size_t)len + 1);
+  if (str) {
+    ReadBytes(reader, str, len);
+    str[len] = '\0';
+  }
+  return str;
+}
+
+/**
+ * @brief Replaces a file with new contents, so that readers and crashes only
+ *        ever see the old or the new file in full.
+ *
+ * @param path Path of the file to replace.
+ * @param data Contents to write.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int WriteAtomically(const char* path, const DynamicArray* data) {
+  FILE* file = DuReplaceOpen(path);
+  if (!file) {
+    return -1;
+  }
+
+  if (fwrite(data->data, 1, data->len, file) != data->len) {
+    int saved_errno = errno;
+    DuReplaceClose(file, path, 0);
+    errno = saved_errno;
+    return -1;
+  }
+  return DuReplaceClose(file, path, 1);
+}
+
+/**
+ * @brief Opens the temporary file that will replace `path`, next to it.
+ *        Whatever is written to it only takes the place of `path` once
+ *        `DuReplaceClose` has synced it and renamed it over `path`, so
+ *        readers and crashes only ever see the old or the new file in full.
+ *
+ * @param path Path of the file to replace.
+ *
+ * @return Returns the stream to write the new contents to, or NULL on error
+ *         with errno set.
+ */
+FILE* DuReplaceOpen(const char* path) {
+  char tmp[kPathMax];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  return fopen(tmp, "wb");
+}
+
+/**
+ * @brief Closes a stream opened by `DuReplaceOpen`, and either syncs it and
+ *        renames it over `path`, or removes it.
+ *
+ * @param file    Stream returned by `DuReplaceOpen(path)`.
+ * @param path    Path of the file to replace.
+ * @param publish Whether to replace `path`, rather than discard the stream.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set, in which case
+ *         `path` is left as it was.
+ */
+int DuReplaceClose(FILE* file, const char* path, int publish) {
+  char tmp[kPathMax];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  int status = 0;
+  if (publish && (fflush(file) != 0 || fsync(fileno(file)) != 0)) {
+    status = -1;
+  }
+  if (fclose(file) != 0) {
+    status = -1;
+  }
+
+  if (!publish || status < 0 || rename(tmp, path) < 0) {
+    int saved_errno = errno;
+    remove(tmp);
+    errno = saved_errno;
+    return publish ? -1 : status;
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads a whole file into memory.
+ *
+ * @param path Path of the file.
+ *
+ * @return Returns the contents, or NULL on error with errno set.
+ */
+static DynamicArray* ReadFile(const char* path) {
+  const size_t kChunk = 4096;
+
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+
+  DynamicArray* data = InitDynamicArray(kChunk, 1);
+  if (!data) {
+    fclose(file);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t read;
+  do {
+    if (ReserveDynamicArray(data, kChunk, 1) < 0) {
+      fclose(file);
+      FreeDynamicArray(data);
+      errno = ENOMEM;
+      return NULL;
+    }
+    read = fread((char*)data->data + data->len, 1, kChunk, file);
+    data->len += read;
+  } while (read == kChunk);
+
+  if (ferror(file)) {
+    fclose(file);
+    FreeDynamicArray(data);
+    errno = EIO;
+    return NULL;
+  }
+
+  fclose(file);
+  return data;
+}
+
+/**
+ * @brief Gets the stat information of an entry, honouring the throttle. A
+ *        symbolic link is followed if `opts->follow` says so at this depth.
+ *
+ * @param state   Scan state.
+ * @param path    Path of the entry.
+ * @param depth   Depth of the entry relative to the scan root.
+ * @param statbuf Receives the stat information.
+ *
+ * @return Returns 0 on success, or -1 with errno set.
+ */
+static int StatEntry(DuState* state, const char* path, int depth,
+                     struct stat* statbuf) {
+  DuFollow follow = state->opts->follow;
+  return DuThrottleStat(
+      &state->throttle, path,
+      follow == kDuFollowAll || (follow == kDuFollowRoots && depth == 0),
+      statbuf);
+}
+
+/**
+ * @brief Allocates what a scan following every link needs to break cycles:
+ *        the set of every entry reached, or only the directories being read
+ *        with `count_links`, where an entry may be counted many times as long
+ *        as it is not its own ancestor.
+ *
+ * The set holds (dev, ino) keys alone, in a hash table, so a walk over any
+ * number of directories neither stores their paths nor searches linearly.
+ *
+ * @param state Scan state.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int InitFollow(DuState* state) {
+  const size_t kInitSize = 16;
+
+  if (state->opts->count_links) {
+    state->ancestors = InitDynamicArray(kInitSize, sizeof(DuInode));
+    return state->ancestors ? 0 : -1;
+  }
+  state->visited = DuInodeSetCreate();
+  return state->visited ? 0 : -1;
+}
+
+/**
+ * @brief Frees what `InitFollow` allocated, if anything.
+ *
+ * @param state Scan state.
+ */
+static void FreeFollow(DuState* state) {
+  FreeDynamicArray(state->ancestors);
+  DuInodeSetFree(state->visited);
+  state->ancestors = NULL;
+  state->visited = NULL;
+}
+
+/**
+ * @brief Tells whether an entry reached while following every link must be
+ *        skipped: one reached before, through another link or as an ancestor
+ *        of itself, or with `count_links` a directory being read above it.
+ *
+ * @param state   Scan state.
+ * @param path    Path of the entry.
+ * @param statbuf Stat information of the entry.
+ *
+ * @return Returns 1 if the entry must be skipped, having been reached before
+ *         or failed to be recorded, 0 otherwise.
+ */
+static int Revisited(DuState* state, const char* path,
+                     const struct stat* statbuf) {
+  if (state->ancestors) {
+    return S_ISDIR(statbuf->st_mode) &&
+           SearchInode(state->ancestors, statbuf->st_dev, statbuf->st_ino);
+  }
+  if (!state->visited) {
+    return 0;
+  }
+
+  int inserted =
+      DuInodeSetInsert(state->visited, statbuf->st_dev, statbuf->st_ino);
+  if (inserted < 0) {
+    ReportError(state, path, kDuOpInsert, ENOMEM);
+  }
+  return inserted != 1;
+}
+
+/**
+ * @brief Opens a directory for reading, honouring the throttle, and notes
+ *        it as the one being read for progress reports.
+ *
+ * @param state Scan state.
+ * @param path  Path of the directory.
+ *
+ * @return Returns the directory stream, or NULL with errno set.
+ */
+static DIR* OpenDirectory(DuState* state, const char* path) {
+  if (state->opts->progress) {
+    DuProgressEnter(state->opts->progress, path);
+  }
+  DuThrottleDir(&state->throttle);
+  return opendir(path);
+}
+
+/**
+ * @brief Accounts a non-directory entry, skipping hard links whose inode has
+ *        already been counted, and visits it if files are included.
+ *
+ * @param state   Scan state.
+ * @param path    Path of the entry.
+ * @param depth   Depth of the entry relative to the scan root.
+ * @param statbuf Stat information of the entry.
+ *
+ * @return Returns the disk usage in kilobytes to add to the parent, or 0 if
+ *         the entry was already counted or an error occurred.
+ */
+static blkcnt_t AccountFile(DuState* state, const char* path, int depth,
+                            const struct stat* statbuf) {
+  blkcnt_t disk_usage_kb = statbuf->st_blocks / 2;
+
+  // Following every link, entries were deduplicated by `Revisited`
+  if (S_ISREG(statbuf->st_mode) && statbuf->st_nlink > 1 &&
+      !state->opts->count_links && !state->visited) {
+    if (state->opts->link_filter) {
+      if (DuFilterTestAndSet(state->opts->link_filter, statbuf->st_dev,
+                             statbuf->st_ino, disk_usage_kb)) {
+        return 0;
+      }
+    } else if (state->links) {
+      if (DuLinksAdd(state->links, path, depth, statbuf,
+                     state->opts->include_files) < 0) {
+        ReportError(state, path, kDuOpSpill, errno);
+        return 0;
+      }
+      Account(state, disk_usage_kb);
+      return disk_usage_kb;
+    } else {
+      DuInode* seen =
+          SearchInode(state->seen, statbuf->st_dev, statbuf->st_ino);
+      if (seen) {
+        // No link can follow the last one, so the inode need not be kept
+        if (--seen->remaining == 0) {
+          EvictInode(state->seen, seen);
+        }
+        return 0;
+      }
+
+      if (InsertInode(state->seen, statbuf->st_dev, statbuf->st_ino,
+                      statbuf->st_nlink - 1) < 0) {
+        ReportError(state, path, kDuOpInsert, errno);
+        return 0;
+      }
+    }
+  }
+
+  Account(state, disk_usage_kb);
+  if (state->opts->include_files) {
+    Visit(state, path, depth, statbuf, disk_usage_kb);
+  }
+  return disk_usage_kb;
+}
+
+/**
+ * @brief Records the first error of a scan and forwards every error to the
+ *        error callback.
+ *
+ * @param state  Scan state.
+ * @param path   Path the failed operation was applied to.
+ * @param op     Operation that failed.
+ * @param errnum errno value describing the failure.
+ */
+static void ReportError(DuState* state, const char* path, DuOp op,
+                        int errnum) {
+  if (!errnum) {
+    errnum = EIO;
+  }
+  if (state->opts->keep_going && DuSkippable(op)) {
+    state->skipped++;
+  } else if (!state->error) {
+    state->error = errnum;
+  }
+
+  const DuOptions* opts = state->opts;
+  if (opts->on_error) {
+    opts->on_error(path, op, errnum, opts->ctx);
+  }
+}
+
+/**
+ * @brief Tells whether a failed operation only loses the entry it applies
+ *        to, so that a scan with `keep_going` can skip that entry and go on.
+ *
+ * @param op Operation that failed.
+ *
+ * @return Returns 1 for stat, opendir and path failures, 0 otherwise.
+ */
+int DuSkippable(DuOp op) {
+  return op == kDuOpStat || op == kDuOpOpenDir || op == kDuOpPath;
+}
+
+/**
+ * @brief Adds an entry to the running total of the scan, and to its
+ *        progress, stopping it once the total passes `opts->exceeds`.
+ *
+ * @param state      Scan state.
+ * @param disk_usage Kilobytes newly accounted.
+ */
+static void Account(DuState* state, blkcnt_t disk_usage) {
+  state->accounted += disk_usage;
+  if (state->opts->progress) {
+    DuProgressAdd(state->opts->progress, 1, (uint64_t)disk_usage);
+  }
+
+  long long exceeds = state->opts->exceeds;
+  if (exceeds && (long long)state->accounted * 1024 > exceeds) {
+    state->stopped = 1;
+  }
+}
+
+/**
+ * @brief Accounts a directory that could not be opened, once the failure has
+ *        been reported: with `keep_going` it counts for its own size, as its
+ *        contents cannot be listed.
+ *
+ * @param state   Scan state.
+ * @param path    Path of the directory.
+ * @param depth   Depth of the directory relative to the scan root.
+ * @param statbuf Stat information of the directory.
+ *
+ * @return Returns the disk usage in kilobytes accounted, or 0 after a fatal
+ *         error.
+ */
+static blkcnt_t AccountUnreadable(DuState* state, const char* path, int depth,
+                                  const struct stat* statbuf) {
+  if (state->error) {
+    return 0;
+  }
+
+  blkcnt_t disk_usage_kb = statbuf->st_blocks / 2;
+  Account(state, disk_usage_kb);
+  Visit(state, path, depth, statbuf, disk_usage_kb);
+  return disk_usage_kb;
+}
+
+/**
+ * @brief Hands an accounted entry to the visitor, or logs it for replay when
+ *        hard links are spilled.
+ *
+ * @param state      Scan state.
+ * @param path       Path of the entry.
+ * @param depth      Depth of the entry relative to the scan root.
+ * @param statbuf    Stat information of the entry.
+ * @param disk_usage Disk usage of the entry (subtree total for directories).
+ */
+static void Visit(DuState* state, const char* path, int depth,
+                  const struct stat* statbuf, blkcnt_t disk_usage) {
+  if (!state->links) {
+    Deliver(state, path, depth, statbuf, disk_usage);
+  } else if (DuLinksEntry(state->links, path, depth, disk_usage) < 0) {
+    ReportError(state, path, kDuOpSpill, errno);
+  }
+}
+
+/**
+ * @brief Hands a replayed entry to `Deliver`.
+ *
+ * @param entry Entry with its corrected disk usage.
+ * @param state Scan state.
+ *
+ * @return Returns 1 once the visitor asked to stop.
+ */
+static int ReplayEntry(const DuEntry* entry, void* state) {
+  DuState* scan = (DuState*)state;
+  Deliver(scan, entry->path, entry->depth, entry->statbuf,
+          entry->disk_usage);
+  return scan->stopped;
+}
+
+/**
+ * @brief Hands an accounted entry to the visitor, if any, and records whether
+ *        it asked to stop. Entries outside the size threshold are accounted by
+ *        the caller but never reach the visitor.
+ *
+ * @param state      Scan state.
+ * @param path       Path of the entry.
+ * @param depth      Depth of the entry relative to the scan root.
+ * @param statbuf    Stat information of the entry.
+ * @param disk_usage Disk usage of the entry (subtree total for directories).
+ */
+static void Deliver(DuState* state, const char* path, int depth,
+                    const struct stat* statbuf, blkcnt_t disk_usage) {
+  const DuOptions* opts = state->opts;
+  if (state->stopped || !opts->visit) {
+    return;
+  }
+
+  if (opts->threshold) {
+    long long bytes = (long long)disk_usage * 1024;
+    if (opts->threshold > 0 ? bytes < opts->threshold
+                            : bytes > -opts->threshold) {
+      return;
+    }
+  }
+
+  DuEntry entry = {
+      .path = path,
+      .depth = depth,
+      .statbuf = statbuf,
+      .disk_usage = disk_usage,
+  };
+  if (opts->visit(&entry, opts->ctx)) {
+    state->stopped = 1;
+  }
+}
+
+/**
+ * @brief Initializes a dynamic array to store inode numbers.
+ *
+ * @param size      Initial size of the dynamic array.
+ * @param type_size Data type of elements to be stored in the array.
+ *
+ * @return Returns a pointer to the initialized DynamicArray, or NULL if the
+ *         initialization fails.
+ */
+DynamicArray* InitDynamicArray(size_t size, size_t type_size) {
+  DynamicArray* da = malloc(sizeof(DynamicArray));
+  if (!da) {
+    return NULL;
+  }
+
+  da->size = size;
+  da->len = 0;
+  da->data = malloc(size * type_size);
+  if (!da->data) {
+    free(da);
+    return NULL;
+  }
+  return da;
+}
+
+/**
+ * @brief Frees the memory allocated for a DynamicArray.
+ *
+ * @param da Pointer to the DynamicArray to be freed.
+ */
+void FreeDynamicArray(DynamicArray* da) {
+  if (da) {
+    if (da->data) {
+      free(da->data);
+    }
+    free(da);
+  }
+}
+
+/**
+ * @brief Makes room for `count` more elements in a DynamicArray, doubling its
+ *        size as many times as needed.
+ *
+ * @param da        Pointer to the DynamicArray to grow.
+ * @param count     Number of elements about to be appended.
+ * @param type_size Size of the elements stored in the array.
+ *
+ * @return Returns 0 on success, or -1 if the array could not be resized. The
+ *         array is left untouched on failure.
+ */
+int ReserveDynamicArray(DynamicArray* da, size_t count, size_t type_size) {
+  size_t size = da->size ? da->size : 1;
+  while (size - da->len < count) {
+    size *= 2;
+  }
+
+  if (size != da->size) {
+    void* dummy = realloc(da->data, size * type_size);
+    if (!dummy) {
+      return -1;
+    }
+
+    da->data = dummy;
+    da->size = size;
+  }
+  return 0;
+}
+
+/**
+ * @brief Appends an element to a DynamicArray, growing it as needed.
+ *
+ * @param da        Pointer to the DynamicArray to append to.
+ * @param element   Element to copy in.
+ * @param type_size Size of the elements stored in the array.
+ *
+ * @return Returns 0 on success, or -1 if the array could not be resized.
+ */
+int AppendDynamicArray(DynamicArray* da, const void* element,
+                       size_t type_size) {
+  if (ReserveDynamicArray(da, 1, type_size) < 0) {
+    return -1;
+  }
+  memcpy((char*)da->data + da->len * type_size, element, type_size);
+  da->len++;
+  return 0;
+}
+
+/**
+ * @brief Searches for an inode in a DynamicArray.
+ *
+ * @param da  Pointer to the DynamicArray to search.
+ * @param dev Device of the inode.
+ * @param ino Inode number to search for.
+ *
+ * @return Returns a pointer to the inode if found, or NULL if not found or if
+ *         the DynamicArray is NULL.
+ */
+DuInode* SearchInode(DynamicArray* da, dev_t dev, ino_t ino) {
+  if (!da) {
+    return NULL;
+  }
+
+  size_t i = 0;
+  DuInode* inodes = (DuInode*)da->data;
+
+  while (i < da->len) {
+    if (inodes[i].ino == ino && inodes[i].dev == dev) {
+      return &inodes[i];
+    }
+    i++;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Inserts an inode into a DynamicArray, resizing the array if necessary.
+ *
+ * @param da        Pointer to the DynamicArray where the inode should be
+ *                  inserted.
+ * @param dev       Device of the inode.
+ * @param ino       Inode number to insert.
+ * @param remaining Links of the inode not yet seen.
+ *
+ * @return Returns 0 on successful insertion, or -1 if the array could not be
+ *         resized.
+ */
+int InsertInode(DynamicArray* da, dev_t dev, ino_t ino, nlink_t remaining) {
+  if (ReserveDynamicArray(da, 1, sizeof(DuInode)) < 0) {
+    // Cleanup is taken care of by caller
+    return -1;
+  }
+  DuInode* inodes = (DuInode*)da->data;
+  inodes[da->len].dev = dev;
+  inodes[da->len].ino = ino;
+  inodes[da->len].remaining = remaining;
+  da->len++;
+
+  return 0;
+}
+
+/**
+ * @brief Removes an inode from a DynamicArray once all of its links have been
+ *        seen, by moving the last inode into its slot. The set thus only holds
+ *        inodes with links still ahead of the scan, which for trees whose
+ *        links are close together keeps it small enough to stay in cache.
+ *
+ * @param da    Pointer to the DynamicArray holding the inode.
+ * @param inode Inode to remove, as returned by `SearchInode`.
+ */
+void EvictInode(DynamicArray* da, DuInode* inode) {
+  DuInode* inodes = (DuInode*)da->data;
+  *inode = inodes[--da->len];
+}
@@ -0,0 +1,179 @@
+#ifndef LIBDU_H_
+#define LIBDU_H_
+
+#include <dirent.h>     // DIR
+#include <stdint.h>     // int64_t
+#include <stdio.h>      // FILE
+#include <sys/stat.h>   // struct stat, blkcnt_t
+#include <sys/types.h>  // dev_t, ino_t, nlink_t
+#include <time.h>       // struct timespec
+
+#include "throttle.h"
+
+typedef struct DynamicArray {
+  size_t size;
+  size_t len;
+  void *data;
+} DynamicArray;
+
+/**
+ * @brief A hard-linked inode that has been counted, with the number of its
+ *        links the scan has yet to reach.
+ */
+typedef struct DuInode {
+  dev_t dev;
+  ino_t ino;
+  nlink_t remaining;
+} DuInode;
+
+/**
+ * @brief Operation that failed, as reported to `DuOptions::on_error`.
+ */
+typedef enum DuOp {
+  kDuOpStat,     // lstat() on an entry, or stat() on a followed link
+  kDuOpOpenDir,  // opendir() on a directory
+  kDuOpPath,     // building the path of a directory entry
+  kDuOpInsert,   // recording a hard-linked inode
+  kDuOpAlloc,    // allocating scan state
+  kDuOpSpill,    // spilling or merging hard-link keys on disk
+} DuOp;  // the first three only lose the entry, see DuOptions::keep_going
+
+/**
+ * @brief Symbolic links a scan follows, as `DuOptions::follow`.
+ */
+typedef enum DuFollow {
+  kDuFollowNone,   // no link is followed; links count for themselves
+  kDuFollowRoots,  // only root paths that are links are followed
+  kDuFollowAll,    // every link is followed, and every entry is counted once
+                   // however many links lead to it
+} DuFollow;
+
+/**
+ * @brief A single entry handed to the visitor callback.
+ *
+ * Directories are visited in post-order, once their subtree has been fully
+ * accounted, so `disk_usage` holds the subtree total. For files it holds the
+ * size of the file itself. All pointers are only valid during the callback.
+ */
+typedef struct DuEntry {
+  const char *path;
+  int depth;                    // 0 for the root path
+  const struct stat *statbuf;   // NULL for entries read back from an index
+                                // or replayed after the scan
+  blkcnt_t disk_usage;          // kilobytes
+} DuEntry;
+
+/**
+ * @brief Visitor callback. Returning non-zero stops the traversal.
+ */
+typedef int (*DuVisitFn)(const DuEntry *entry, void *ctx);
+
+/**
+ * @brief Error callback, invoked once per failure before the scan unwinds.
+ */
+typedef void (*DuErrorFn)(const char *path, DuOp op, int errnum, void *ctx);
+
+/**
+ * @brief Root source for `DuScanRoots`. Returns the next path to scan, valid
+ *        until the next call, or NULL once there are none left.
+ */
+typedef const char *(*DuRootFn)(void *source);
+
+typedef struct DuOptions {
+  int include_files;   // visit files, not just directories
+  int sorted;          // visit siblings in name order
+  long long threshold; // bytes; visit only entries of at least this size if
+                       // positive, at most minus this size if negative
+  double max_ops_per_sec;   // lstat() calls per second, 0 for no limit
+  double max_dirs_per_sec;  // directories opened per second, 0 for no limit
+  int adaptive_throttle;    // scale the limits down when lstat() slows down
+  size_t link_memory;  // bytes of hard-link keys to hold before spilling them
+                       // to disk, 0 to hold all in memory (`du` only)
+  struct DuFilter *link_filter;  // approximate hard-link set used instead of
+                                 // the exact one, may be NULL (see filter.h)
+  int threads;         // scan with this many threads if above 1, resolving
+                       // hard links as the output is released (`du` only)
+  int unordered;       // with threads, visit each directory once its subtree
+                       // is complete rather than in serial order
+  int keep_going;      // skip entries that cannot be read, reporting each,
+                       // instead of failing the scan
+  int count_links;     // count every link of a hard-linked file, keeping no
+                       // set of seen inodes (`link_memory` and `link_filter`
+                       // are then unused)
+  DuFollow follow;     // symbolic links to follow; with `kDuFollowAll` the
+                       // scan is serial and counts every entry once by
+                       // (dev, ino), or with `count_links` skips only
+                       // directories that are their own ancestors, so cycles
+                       // end (`link_memory` and `link_filter` are unused)
+  long long exceeds;   // bytes; stop once the total accounted so far passes
+                       // this, 0 for no limit (`du` only, serial scans)
+  struct DuProgress *progress;  // counters the scan bumps as it accounts
+                                // entries, may be NULL (see progress.h)
+  const struct DuIndex *guide;  // earlier scan of the same tree, whose sizes
+                                // order siblings largest first, may be NULL
+                                // (`du` only, serial scans, see index.h)
+  DuVisitFn visit;     // may be NULL
+  DuErrorFn on_error;  // may be NULL
+  void *ctx;           // passed to both callbacks
+} DuOptions;
+
+/**
+ * @brief Per-scan state threaded through `dfs`. Owned by the caller of `dfs`,
+ *        so independent scans never share anything.
+ */
+typedef struct DuState {
+  const DuOptions *opts;
+  DynamicArray *seen;     // of DuInode
+  struct DuLinks *links;  // replaces `seen` when hard links are spilled
+  struct DuInodeSet *visited;  // replaces `seen` when following every link
+                               // or scanning several roots: every entry
+                               // reached, directories included
+  DynamicArray *ancestors;  // of DuInode, the directories being read, in
+                            // place of `visited` when also counting links
+  DuThrottle throttle;
+  int error;    // errno of the first failure, 0 if none
+  size_t skipped;  // entries skipped under `keep_going`
+  int stopped;  // set when the visitor asked to stop or `exceeds` was passed
+  blkcnt_t accounted;  // kilobytes accounted so far, for `exceeds`
+  int64_t guide_node;  // node in `guide` of the path `dfs` enters next, -1 if
+                       // it is not there
+} DuState;
+
+/**
+ * @brief Resumable scan handle. Holds the directory stack, the seen inodes and
+ *        the partial totals, so a scan can be advanced in bounded slices and
+ *        interleaved with other scans. Sorted scans can also be saved to a
+ *        checkpoint file and continued from it.
+ */
+typedef struct DuIter DuIter;
+
+// Library Functions
+void DuDefaultOptions(DuOptions *opts);
+int du(const char *rootpath, const DuOptions *opts, blkcnt_t *total);
+int DuScanRoots(DuRootFn next_root, void *source, const DuOptions *opts);
+int DuSkippable(DuOp op);
+DynamicArray *DuReadNames(DIR *dirp, int sorted);
+void DuFreeNames(DynamicArray *names);
+FILE *DuReplaceOpen(const char *path);
+int DuReplaceClose(FILE *file, const char *path, int publish);
+blkcnt_t dfs(const char *rootpath, int depth, DuState *state);
+
+// Iterator Functions
+DuIter *DuOpen(const char *rootpath, const DuOptions *opts);
+int DuNext(DuIter *it, size_t max_entries, const struct timespec *deadline);
+blkcnt_t DuIterTotal(const DuIter *it);
+void DuClose(DuIter *it);
+int DuIterSave(const DuIter *it, const char *path);
+DuIter *DuIterLoad(const char *path, const DuOptions *opts);
+
+// DynamicArray-Specific Functions
+DynamicArray *InitDynamicArray(size_t size, size_t type_size);
+void FreeDynamicArray(DynamicArray *da);
+int ReserveDynamicArray(DynamicArray *da, size_t count, size_t type_size);
+int AppendDynamicArray(DynamicArray *da, const void *element,
+                       size_t type_size);
+DuInode *SearchInode(DynamicArray *da, dev_t dev, ino_t ino);
+int InsertInode(DynamicArray *da, dev_t dev, ino_t ino, nlink_t remaining);
+void EvictInode(DynamicArray *da, DuInode *inode);
+
+#endif  // LIBDU_H_
@@ -0,0 +1,406 @@
+/**
+ * @file   links.c
+ *
+ * @brief  Hard-link accounting with a bounded memory footprint. Occurrences
+ *         of multiply-linked inodes are logged to an external sort and
+ *         deduplicated once the scan ends, and the visits of the scan are
+ *         logged to a temporary file and replayed with corrected totals.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "links.h"
+
+#include <errno.h>      // errno, EIO, ENOMEM
+#include <stdint.h>     // int32_t, int64_t, uint32_t, uint64_t
+#include <stdio.h>      // FILE, fclose, fflush, fread, fwrite, rewind
+#include <stdlib.h>     // calloc, free, realloc
+#include <string.h>     // memset, strlen
+
+#include "spill.h"
+
+/**
+ * @brief Kind of a record in the visit log.
+ */
+typedef enum RecordKind {
+  kRecordEntry,       // a visited directory or unlinked file
+  kRecordLink,        // a visited occurrence of a linked inode
+  kRecordHiddenLink,  // an occurrence of a linked inode that is not visited
+} RecordKind;
+
+typedef struct RecordHeader {
+  int32_t kind;
+  int32_t depth;
+  int64_t disk_usage;  // kilobytes
+  uint32_t path_len;   // bytes following the header
+} RecordHeader;
+
+/**
+ * @brief An occurrence of a linked inode, numbered in scan order.
+ */
+typedef struct Occurrence {
+  dev_t dev;
+  ino_t ino;
+  uint64_t seq;
+  blkcnt_t disk_usage;  // kilobytes
+} Occurrence;
+
+/**
+ * @brief An occurrence found to repeat an earlier one of the same inode.
+ */
+typedef struct Duplicate {
+  uint64_t seq;
+  blkcnt_t disk_usage;  // kilobytes
+} Duplicate;
+
+struct DuLinks {
+  size_t memory;
+  DuSpill* occurrences;  // by (dev, ino, seq)
+  uint64_t next_seq;
+  FILE* log;             // visits to replay, NULL if there is no visitor
+};
+
+static int WriteRecord(DuLinks* links, RecordKind kind, const char* path,
+                       int depth, blkcnt_t disk_usage);
+static int Replay(DuLinks* links, DuSpill* duplicates, DuVisitFn visit,
+                  void* ctx);
+static int CompareOccurrences(const void* a, const void* b);
+static int CompareDuplicates(const void* a, const void* b);
+
+/**
+ * @brief Creates an empty hard-link log.
+ *
+ * @param memory Bytes of keys to hold in memory before spilling them to disk.
+ * @param replay Whether visits will be logged and replayed, as needed to
+ *               report per-directory totals.
+ *
+ * @return Returns the log, or NULL on error with errno set.
+ */
+DuLinks* DuLinksCreate(size_t memory, int replay) {
+  DuLinks* links = calloc(1, sizeof(DuLinks));
+  if (!links) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  links->memory = memory;
+  links->occurrences =
+      DuSpillCreate(sizeof(Occurrence), memory, CompareOccurrences);
+  if (!links->occurrences) {
+    free(links);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (replay && !(links->log = DuSpillTempFile())) {
+    int saved_errno = errno;
+    DuLinksFree(links);
+    errno = saved_errno;
+    return NULL;
+  }
+  return links;
+}
+
+/**
+ * @brief Logs an occurrence of a multiply-linked inode. The caller counts it
+ *        provisionally; `DuLinksResolve` takes it back if it is a repeat.
+ *
+ * @param links   Hard-link log.
+ * @param path    Path of the occurrence.
+ * @param depth   Depth of the occurrence relative to the scan root.
+ * @param statbuf Stat information of the occurrence.
+ * @param visible Whether the occurrence is to be visited, if not a repeat.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuLinksAdd(DuLinks* links, const char* path, int depth,
+               const struct stat* statbuf, int visible) {
+  Occurrence occurrence = {
+      .dev = statbuf->st_dev,
+      .ino = statbuf->st_ino,
+      .seq = links->next_seq++,
+      .disk_usage = statbuf->st_blocks / 2,
+  };
+  if (DuSpillAdd(links->occurrences, &occurrence) < 0) {
+    return -1;
+  }
+
+  if (!links->log) {
+    return 0;
+  }
+  return WriteRecord(links, visible ? kRecordLink : kRecordHiddenLink,
+                     visible ? path : "", depth, occurrence.disk_usage);
+}
+
+/**
+ * @brief Logs a visit for replay once the links are resolved.
+ *
+ * @param links      Hard-link log.
+ * @param path       Path of the entry.
+ * @param depth      Depth of the entry relative to the scan root.
+ * @param disk_usage Provisional disk usage of the entry in kilobytes.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuLinksEntry(DuLinks* links, const char* path, int depth,
+                 blkcnt_t disk_usage) {
+  if (!links->log) {
+    return 0;
+  }
+  return WriteRecord(links, kRecordEntry, path, depth, disk_usage);
+}
+
+/**
+ * @brief Finds the repeated occurrences with an external merge of the logged
+ *        keys, then replays the logged visits with the repeats removed from
+ *        every total that counted them.
+ *
+ * The first occurrence of an inode in scan order is the one kept, as with the
+ * in-memory seen set, so the replay matches a scan without a budget.
+ *
+ * @param links      Hard-link log.
+ * @param visit      Visitor receiving the corrected entries, with a NULL
+ *                   `statbuf`. Returning non-zero stops the replay.
+ * @param ctx        Passed to `visit`.
+ * @param duplicates Receives the disk usage counted for repeats, to subtract
+ *                   from the scan total.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuLinksResolve(DuLinks* links, DuVisitFn visit, void* ctx,
+                   blkcnt_t* duplicates) {
+  *duplicates = 0;
+  if (DuSpillSort(links->occurrences) < 0) {
+    return -1;
+  }
+
+  DuSpill* repeats = NULL;
+  if (links->log) {
+    repeats = DuSpillCreate(sizeof(Duplicate), links->memory,
+                            CompareDuplicates);
+    if (!repeats) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  Occurrence previous = {0};
+  Occurrence current;
+  int status;
+  int first = 1;
+  while ((status = DuSpillNext(links->occurrences, &current)) == 1) {
+    if (!first && current.dev == previous.dev &&
+        current.ino == previous.ino) {
+      *duplicates += current.disk_usage;
+
+      Duplicate duplicate = {current.seq, current.disk_usage};
+      if (repeats && DuSpillAdd(repeats, &duplicate) < 0) {
+        status = -1;
+        break;
+      }
+    }
+    previous = current;
+    first = 0;
+  }
+
+  // The keys are no longer needed, so release their memory for the replay
+  DuSpillFree(links->occurrences);
+  links->occurrences = NULL;
+
+  if (status == 0 && repeats) {
+    status = DuSpillSort(repeats);
+    if (status == 0) {
+      status = Replay(links, repeats, visit, ctx);
+    }
+  }
+
+  int saved_errno = errno;
+  DuSpillFree(repeats);
+  errno = saved_errno;
+  return status < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Frees a hard-link log and its temporary files.
+ *
+ * @param links Hard-link log to free, may be NULL.
+ */
+void DuLinksFree(DuLinks* links) {
+  if (!links) {
+    return;
+  }
+
+  DuSpillFree(links->occurrences);
+  if (links->log) {
+    fclose(links->log);
+  }
+  free(links);
+}
+
+/**
+ * @brief Appends a record to the visit log.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int WriteRecord(DuLinks* links, RecordKind kind, const char* path,
+                       int depth, blkcnt_t disk_usage) {
+  RecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.kind = kind;
+  header.depth = depth;
+  header.disk_usage = disk_usage;
+  header.path_len = (uint32_t)strlen(path);
+
+  if (fwrite(&header, sizeof(header), 1, links->log) != 1 ||
+      fwrite(path, 1, header.path_len, links->log) != header.path_len) {
+    errno = errno ? errno : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Replays the visit log in order, skipping repeated occurrences and
+ *        subtracting them from the totals of their ancestors.
+ *
+ * Visits are in post-order, so the corrections pending for the directory
+ * open at each depth are accumulated until that directory is visited, then
+ * passed on to its parent.
+ *
+ * @param links      Hard-link log.
+ * @param duplicates Repeated occurrences, sorted by sequence number.
+ * @param visit      Visitor receiving the corrected entries.
+ * @param ctx        Passed to `visit`.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int Replay(DuLinks* links, DuSpill* duplicates, DuVisitFn visit,
+                  void* ctx) {
+  if (fflush(links->log) != 0) {
+    return -1;
+  }
+  rewind(links->log);
+
+  Duplicate next;
+  int has_next = DuSpillNext(duplicates, &next);
+  if (has_next < 0) {
+    return -1;
+  }
+
+  blkcnt_t* pending = NULL;  // corrections by depth
+  size_t depths = 0;
+  char* path = NULL;
+  size_t path_size = 0;
+  uint64_t seq = 0;
+  int status = 0;
+
+  RecordHeader header;
+  while (fread(&header, sizeof(header), 1, links->log) == 1) {
+    size_t depth = (size_t)header.depth;
+    if (depth + 1 > depths || header.path_len + 1 > path_size) {
+      size_t new_depths = depth + 1 > depths ? 2 * (depth + 1) : depths;
+      size_t new_size =
+          header.path_len + 1 > path_size ? 2 * (header.path_len + 1)
+                                          : path_size;
+      blkcnt_t* new_pending = realloc(pending, new_depths * sizeof(blkcnt_t));
+      if (new_pending) {
+        pending = new_pending;
+        memset(pending + depths, 0, (new_depths - depths) * sizeof(blkcnt_t));
+        depths = new_depths;
+      }
+      char* new_path = realloc(path, new_size);
+      if (new_path) {
+        path = new_path;
+        path_size = new_size;
+      }
+      if (!new_pending || !new_path) {
+        errno = ENOMEM;
+        status = -1;
+        break;
+      }
+    }
+
+    if (fread(path, 1, header.path_len, links->log) != header.path_len) {
+      errno = EIO;
+      status = -1;
+      break;
+    }
+    path[header.path_len] = '\0';
+
+    if (header.kind != kRecordEntry) {
+      // Only repeats carry a correction, and they are never visited
+      if (has_next == 1 && next.seq == seq) {
+        if (depth > 0) {
+          pending[depth - 1] += next.disk_usage;
+        }
+        if ((has_next = DuSpillNext(duplicates, &next)) < 0) {
+          status = -1;
+          break;
+        }
+        seq++;
+        continue;
+      }
+      seq++;
+      if (header.kind == kRecordHiddenLink) {
+        continue;
+      }
+    }
+
+    // Files have no pending corrections; directories take their subtree's
+    blkcnt_t correction = pending[depth];
+    pending[depth] = 0;
+    if (depth > 0) {
+      pending[depth - 1] += correction;
+    }
+
+    DuEntry entry = {
+        .path = path,
+        .depth = (int)depth,
+        .statbuf = NULL,
+        .disk_usage = header.disk_usage - correction,
+    };
+    if (visit && visit(&entry, ctx)) {
+      break;
+    }
+  }
+
+  if (status == 0 && ferror(links->log)) {
+    errno = EIO;
+    status = -1;
+  }
+
+  free(pending);
+  free(path);
+  return status;
+}
+
+/**
+ * @brief Orders occurrences by inode, then in scan order.
+ */
+static int CompareOccurrences(const void* a, const void* b) {
+  const Occurrence* x = (const Occurrence*)a;
+  const Occurrence* y = (const Occurrence*)b;
+  if (x->dev != y->dev) {
+    return x->dev < y->dev ? -1 : 1;
+  }
+  if (x->ino != y->ino) {
+    return x->ino < y->ino ? -1 : 1;
+  }
+  if (x->seq != y->seq) {
+    return x->seq < y->seq ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Orders duplicates in scan order.
+ */
+static int CompareDuplicates(const void* a, const void* b) {
+  const Duplicate* x = (const Duplicate*)a;
+  const Duplicate* y = (const Duplicate*)b;
+  if (x->seq != y->seq) {
+    return x->seq < y->seq ? -1 : 1;
+  }
+  return 0;
+}
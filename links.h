@@ -0,0 +1,31 @@
+#ifndef LINKS_H_
+#define LINKS_H_
+
+#include <stddef.h>     // size_t
+#include <sys/stat.h>   // struct stat, blkcnt_t
+
+#include "libdu.h"
+
+/**
+ * Hard-link accounting under a memory budget. Instead of deciding during the
+ * scan whether a multiply-linked inode was already counted, every occurrence
+ * is counted provisionally and its (dev, ino) key is logged to an external
+ * sort (see spill.h). When the scan ends, the sorted keys reveal which
+ * occurrences repeat an earlier one; their sizes are subtracted from the
+ * total and, while replaying the visits logged during the scan, from the
+ * totals of the directories that contain them. Memory stays within the
+ * budget however many links the tree holds.
+ */
+typedef struct DuLinks DuLinks;
+
+// Hard-Link Functions
+DuLinks *DuLinksCreate(size_t memory, int replay);
+int DuLinksAdd(DuLinks *links, const char *path, int depth,
+               const struct stat *statbuf, int visible);
+int DuLinksEntry(DuLinks *links, const char *path, int depth,
+                 blkcnt_t disk_usage);
+int DuLinksResolve(DuLinks *links, DuVisitFn visit, void *ctx,
+                   blkcnt_t *duplicates);
+void DuLinksFree(DuLinks *links);
+
+#endif  // LINKS_H_
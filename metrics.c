@@ -0,0 +1,256 @@
+/**
+ * @file   metrics.c
+ *
+ * @brief  Prometheus exposition of a scan. A `DuMetrics` writer is a visitor
+ *         that streams the disk usage gauges to their file as entries come,
+ *         and the inode gauges to a temporary file appended once the scan is
+ *         over, since each family must be listed in one piece.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "metrics.h"
+
+#include <errno.h>      // errno, EIO, ENOMEM
+#include <stdint.h>     // uint64_t
+#include <stdio.h>      // FILE, fclose, fflush, fprintf, fputs, fread, fwrite,
+                        // tmpfile
+#include <stdlib.h>     // calloc, free
+#include <string.h>     // memset, strcspn, strdup
+#include <sys/stat.h>   // S_ISDIR
+
+struct DuMetrics {
+  FILE* out;           // the temporary file, or stdout
+  FILE* inodes;        // du_inodes samples, appended to `out` on close
+  char* path;          // file to replace, or NULL for stdout
+  int max_depth;       // -1 for no limit
+  int include_files;
+  DynamicArray* pending;  // of uint64_t; entries counted at each depth and
+                          // not yet claimed by their directory
+  int failed;          // errno of the first failure, 0 if none
+};
+
+static const char* kBytesHeader =
+    "# HELP du_disk_usage_bytes Disk usage of the entry and everything below "
+    "it.\n"
+    "# TYPE du_disk_usage_bytes gauge\n";
+static const char* kInodesHeader =
+    "# HELP du_inodes Entries below the entry, itself included, hard links "
+    "counted once.\n"
+    "# TYPE du_inodes gauge\n";
+
+static int PutSample(FILE* file, const char* name, const char* path,
+                     unsigned long long value);
+static int Append(FILE* to, FILE* from);
+static void Fail(DuMetrics* metrics);
+
+/**
+ * @brief Starts an exposition.
+ *
+ * @param path          File to replace once the exposition is complete, or
+ *                      NULL to write it to stdout.
+ * @param max_depth     Deepest entries to report, -1 for no limit.
+ * @param include_files Report files, not just directories.
+ *
+ * @return Returns the exposition, or NULL on error with errno set.
+ */
+DuMetrics* DuMetricsCreate(const char* path, int max_depth,
+                           int include_files) {
+  DuMetrics* metrics = calloc(1, sizeof(DuMetrics));
+  if (!metrics) {
+    return NULL;
+  }
+  metrics->max_depth = max_depth;
+  metrics->include_files = include_files;
+  metrics->out = stdout;
+
+  metrics->pending = InitDynamicArray(16, sizeof(uint64_t));
+  if (!metrics->pending) {
+    goto fail;
+  }
+
+  if (path) {
+    if (!(metrics->path = strdup(path)) ||
+        !(metrics->out = DuReplaceOpen(path))) {
+      goto fail;
+    }
+  }
+
+  if (!(metrics->inodes = tmpfile()) || fputs(kBytesHeader, metrics->out) < 0 ||
+      fputs(kInodesHeader, metrics->inodes) < 0) {
+    goto fail;
+  }
+  return metrics;
+
+fail:;
+  int saved_errno = errno ? errno : ENOMEM;
+  DuMetricsClose(metrics, 0);
+  errno = saved_errno;
+  return NULL;
+}
+
+/**
+ * @brief Visitor that counts an entry into the inode totals of the
+ *        directories above it and reports it, if within the limits.
+ *
+ * @param entry   Entry accounted by the scanner.
+ * @param metrics Exposition being written.
+ *
+ * @return Returns 0, or 1 to stop the scan if writing failed.
+ */
+int DuMetricsAdd(const DuEntry* entry, void* metrics) {
+  DuMetrics* m = (DuMetrics*)metrics;
+  if (m->failed) {
+    return 1;
+  }
+
+  // Slots down to the children of this entry, zero until something is counted
+  DynamicArray* pending = m->pending;
+  size_t depth = (size_t)entry->depth;
+  if (pending->len < depth + 2) {
+    size_t grow = depth + 2 - pending->len;
+    if (ReserveDynamicArray(pending, grow, sizeof(uint64_t)) < 0) {
+      m->failed = ENOMEM;
+      return 1;
+    }
+    memset((uint64_t*)pending->data + pending->len, 0,
+           grow * sizeof(uint64_t));
+    pending->len += grow;
+  }
+
+  // Post-order: the whole subtree was counted one level down
+  uint64_t* counts = (uint64_t*)pending->data;
+  uint64_t inodes = 1 + counts[depth + 1];
+  counts[depth + 1] = 0;
+  counts[depth] += inodes;
+
+  int is_dir = entry->statbuf && S_ISDIR(entry->statbuf->st_mode);
+  if ((m->max_depth >= 0 && entry->depth > m->max_depth) ||
+      (!is_dir && !m->include_files)) {
+    return 0;
+  }
+
+  unsigned long long bytes = (unsigned long long)entry->disk_usage * 1024;
+  if (PutSample(m->out, "du_disk_usage_bytes", entry->path, bytes) < 0 ||
+      PutSample(m->inodes, "du_inodes", entry->path, inodes) < 0) {
+    Fail(m);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Completes an exposition and frees it. When written to a file, the
+ *        file is synced and renamed over the one it replaces, unless the
+ *        exposition is discarded.
+ *
+ * @param metrics Exposition to close, may be NULL.
+ * @param publish Whether to complete the exposition, rather than discard it.
+ *
+ * @return Returns 0 on success, or -1 if anything failed to be written, with
+ *         errno set.
+ */
+int DuMetricsClose(DuMetrics* metrics, int publish) {
+  if (!metrics) {
+    return 0;
+  }
+
+  if (publish && !metrics->failed &&
+      (Append(metrics->out, metrics->inodes) < 0 ||
+       fflush(metrics->out) != 0)) {
+    Fail(metrics);
+  }
+
+  if (metrics->inodes) {
+    fclose(metrics->inodes);
+  }
+  if (metrics->out && metrics->out != stdout &&
+      DuReplaceClose(metrics->out, metrics->path,
+                     publish && !metrics->failed) < 0) {
+    Fail(metrics);
+  }
+
+  int failed = publish ? metrics->failed : 0;
+  FreeDynamicArray(metrics->pending);
+  free(metrics->path);
+  free(metrics);
+
+  if (failed) {
+    errno = failed;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Writes one sample, escaping the path as a label value.
+ *
+ * Label values are UTF-8 strings in which backslashes, double quotes and
+ * newlines are escaped; other bytes are written as they are.
+ *
+ * @param file  Stream to write to.
+ * @param name  Metric name.
+ * @param path  Value of the `path` label.
+ * @param value Sample value.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int PutSample(FILE* file, const char* name, const char* path,
+                     unsigned long long value) {
+  if (fprintf(file, "%s{path=\"", name) < 0) {
+    return -1;
+  }
+
+  while (*path) {
+    size_t span = strcspn(path, "\\\"\n");
+    if (span && fwrite(path, 1, span, file) != span) {
+      return -1;
+    }
+    path += span;
+    if (!*path) {
+      break;
+    }
+
+    const char* escape = *path == '\n' ? "\\n" : *path == '"' ? "\\\"" : "\\\\";
+    if (fputs(escape, file) < 0) {
+      return -1;
+    }
+    path++;
+  }
+  return fprintf(file, "\"} %llu\n", value) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Copies a temporary file, from its start, to the end of another.
+ *
+ * @param to   Stream to append to.
+ * @param from Stream to copy.
+ *
+ * @return Returns 0 on success, or -1 on error.
+ */
+static int Append(FILE* to, FILE* from) {
+  char buffer[1 << 16];
+  if (fflush(from) != 0 || fseek(from, 0, SEEK_SET) != 0) {
+    return -1;
+  }
+
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+    if (fwrite(buffer, 1, n, to) != n) {
+      return -1;
+    }
+  }
+  return ferror(from) ? -1 : 0;
+}
+
+/**
+ * @brief Records the first failure of an exposition.
+ *
+ * @param metrics Exposition that failed.
+ */
+static void Fail(DuMetrics* metrics) {
+  if (!metrics->failed) {
+    metrics->failed = errno ? errno : EIO;
+  }
+}
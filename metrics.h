@@ -0,0 +1,31 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "libdu.h"
+
+/**
+ * Prometheus exposition. A `DuMetrics` writer is a visitor that turns the
+ * entries of a scan into two gauge families in the text exposition format:
+ *
+ *   du_disk_usage_bytes{path="..."}  disk usage of the entry and its subtree
+ *   du_inodes{path="..."}            entries in the subtree, the entry
+ *                                    included and hard links counted once
+ *
+ * Both are reported for directories, and for files too if requested, down to
+ * a maximum depth. The scan must visit files in serial post-order, with
+ * their `statbuf`, since the inode counts are summed up from them. Written
+ * to a file, the output replaces it only once complete, so a textfile
+ * collector never reads a partial scan.
+ */
+
+/**
+ * @brief An exposition being written. Opaque.
+ */
+typedef struct DuMetrics DuMetrics;
+
+// Metrics Functions
+DuMetrics *DuMetricsCreate(const char *path, int max_depth, int include_files);
+int DuMetricsAdd(const DuEntry *entry, void *metrics);
+int DuMetricsClose(DuMetrics *metrics, int publish);
+
+#endif  // METRICS_H_
@@ -0,0 +1,941 @@
+/**
+ * @file   parallel.c
+ *
+ * @brief  Multi-threaded scan engine with deferred hard-link resolution.
+ *         Workers read directories concurrently and share only the work
+ *         queue; a reorder cursor releases completed subtrees in serial
+ *         order, deduplicating hard links as it passes them. Scans without
+ *         a visitor deduplicate them by a radix sort once the scan ends, and
+ *         only unordered scans share a set of them while scanning.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "parallel.h"
+
+#include <dirent.h>     // opendir, DIR
+#include <errno.h>      // errno, EIO, ENOMEM
+#include <pthread.h>    // pthread_create, pthread_join, pthread_mutex_t
+#include <stdint.h>     // uint64_t, SIZE_MAX
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free, malloc
+#include <string.h>     // memcpy, memmove, strdup
+
+#include "inodeset.h"
+#include "progress.h"
+
+enum {
+  kParallelPathMax = 512,    // bytes, as for serial scans
+  kReorderWindow = 1 << 16,  // entries read ahead of the reorder cursor
+};
+
+typedef struct DuNode DuNode;
+
+/**
+ * @brief An entry of a directory that the reorder cursor releases.
+ */
+typedef struct DuChild {
+  DuNode* dir;          // NULL for a file, or once the directory is released
+  char* name;           // files only
+  size_t pos;           // files only, index among the directory's entries
+  blkcnt_t disk_usage;  // files only, kilobytes
+  int duplicate;        // a file repeating a link reached earlier
+} DuChild;
+
+/**
+ * @brief A directory read by the scan.
+ */
+struct DuNode {
+  char* path;
+  DuNode* parent;
+  size_t pos;              // index among the parent's entries, in scan order
+  int depth;
+  struct stat statbuf;
+  blkcnt_t files;          // kilobytes of the files directly inside
+  DynamicArray* children;  // of DuChild: subdirectories unless unordered, and
+                           // files if visited
+  int read;                // `children` is final, set under the output lock
+  DynamicArray* links;     // of LinkRecord, the multiply-linked files in
+                           // scan order, NULL if none
+  size_t pending;          // unordered: 1 until read, plus subdirectories
+                           // not complete
+  blkcnt_t subdirs;        // unordered: totals of the complete subdirectories
+};
+
+/**
+ * @brief An occurrence of a multiply-linked file.
+ */
+typedef struct LinkRecord {
+  dev_t dev;
+  ino_t ino;
+  size_t pos;           // index among the directory's entries
+  size_t child;         // index in the directory's children, or SIZE_MAX
+  blkcnt_t disk_usage;  // kilobytes
+} LinkRecord;
+
+/**
+ * @brief A directory open in the reorder cursor.
+ */
+typedef struct Frame {
+  DuNode* node;
+  size_t next;        // index of the next child to release
+  size_t link;        // index of the next link record to resolve
+  blkcnt_t subdirs;   // totals of the released subdirectories
+} Frame;
+
+typedef struct Engine {
+  DuState* state;
+  DuVisitFn deliver;
+  int unordered;        // deliver subtrees as they complete
+  int halted;           // set on error or once the visitor stops the scan
+
+  pthread_mutex_t lock;  // guards the queue
+  pthread_cond_t ready;
+  DynamicArray* queue;   // of DuNode*, directories waiting to be read
+  size_t outstanding;    // directories queued or being read
+  size_t waiting;        // workers waiting for a directory
+  DuInodeSet* inodes;    // unordered: hard links seen, as directories are
+                         // delivered with their totals once complete
+  int deferred;          // no visitor: hard links are resolved from the
+                         // workers' records once the scan ends
+
+  pthread_mutex_t output;  // guards the cursor and the visitor
+  DynamicArray* frames;    // of Frame, the reorder cursor
+  DuInodeSet* released;    // hard links the cursor has passed, when their
+                           // order matters
+  DuNode* root;            // NULL once released
+  DuNode* awaited;         // unread directory the cursor waits for
+  size_t buffered;         // entries read but not yet released
+  blkcnt_t total;          // of the root, once released
+} Engine;
+
+typedef struct Worker {
+  Engine* engine;
+  pthread_t thread;
+  DuThrottle throttle;
+  DynamicArray* links;  // of LinkRecord, when deferred
+} Worker;
+
+static void* WorkerMain(void* arg);
+static void ReadDirectory(Worker* worker, DuNode* node);
+static void Finish(Engine* engine, DuNode* node);
+static void Advance(Engine* engine);
+static int ResolveLinks(Engine* engine, Frame* frame, size_t pos);
+static void Complete(Engine* engine, DuNode* node);
+static blkcnt_t Repeated(Worker* workers, int count);
+static void RadixSort(LinkRecord* records, LinkRecord* tmp, size_t count);
+static void Emit(Engine* engine, const char* path, int depth,
+                 const struct stat* statbuf, blkcnt_t disk_usage);
+static DuNode* NewNode(const char* path, DuNode* parent, size_t pos,
+                       const struct stat* statbuf);
+static void FreeNode(DuNode* node);
+static void FreeTree(DuNode* node);
+static DuNode* Pop(Engine* engine);
+static int Push(Engine* engine, DynamicArray* nodes);
+static void Done(Engine* engine);
+static int Saturated(Engine* engine);
+static void Fail(Engine* engine, const char* path, DuOp op, int errnum);
+static void Halt(Engine* engine);
+static int Halted(const Engine* engine);
+
+/**
+ * @brief Scans `rootpath` with `state->opts->threads` threads, the calling
+ *        thread being one of them, and hands every accounted entry to
+ *        `deliver`.
+ *
+ * Entries are delivered in serial order as soon as everything before them
+ * is complete, unless `state->opts->unordered` is set, and at most about
+ * kReorderWindow entries are read ahead of the last one delivered.
+ *
+ * Errors are recorded in `state->error`, or counted in `state->skipped` if
+ * `keep_going` lets the scan go on, and reported through the error callback,
+ * as by `dfs`; nothing is delivered after an error.
+ *
+ * @param rootpath The path to the directory or file to scan.
+ * @param state    Scan state holding the options.
+ * @param deliver  Receives the entries, with `state` as context; returning
+ *                 non-zero stops the scan.
+ *
+ * @return Returns the total disk usage in kilobytes, or 0 on error.
+ */
+blkcnt_t DuParallelScan(const char* rootpath, DuState* state,
+                        DuVisitFn deliver) {
+  const size_t kInitSize = 64;
+  const DuOptions* opts = state->opts;
+  int count = opts->threads > 1 ? opts->threads : 1;
+
+  Engine engine = {
+      .state = state,
+      .deliver = deliver,
+      .unordered = opts->unordered,
+  };
+  pthread_mutex_init(&engine.lock, NULL);
+  pthread_cond_init(&engine.ready, NULL);
+  pthread_mutex_init(&engine.output, NULL);
+
+  // Which occurrence of a link is counted only matters to a serial visitor
+  engine.deferred = !opts->visit && !opts->count_links;
+
+  Worker* workers = calloc((size_t)count, sizeof(Worker));
+  engine.queue = InitDynamicArray(kInitSize, sizeof(DuNode*));
+  engine.frames = InitDynamicArray(kInitSize, sizeof(Frame));
+  if (opts->count_links || engine.deferred) {
+    // Nothing to share
+  } else if (engine.unordered) {
+    engine.inodes = DuInodeSetCreate();
+  } else {
+    engine.released = DuInodeSetCreate();
+  }
+  int ok = workers && engine.queue && engine.frames &&
+           (engine.inodes || engine.released || opts->count_links ||
+            engine.deferred);
+  for (int i = 0; ok && i < count; i++) {
+    workers[i].engine = &engine;
+    DuThrottleInit(&workers[i].throttle, opts->max_ops_per_sec / count,
+                   opts->max_dirs_per_sec / count, opts->adaptive_throttle);
+    if (engine.deferred) {
+      workers[i].links = InitDynamicArray(kInitSize, sizeof(LinkRecord));
+      ok = workers[i].links != NULL;
+    }
+  }
+  if (!ok) {
+    Fail(&engine, rootpath, kDuOpAlloc, ENOMEM);
+  }
+
+  struct stat statbuf;
+  // Every link is only followed in serial scans, so only the root can be
+  if (ok && DuThrottleStat(&workers[0].throttle, rootpath,
+                            opts->follow != kDuFollowNone, &statbuf) < 0) {
+    Fail(&engine, rootpath, kDuOpStat, errno);
+  } else if (ok && !S_ISDIR(statbuf.st_mode)) {
+    engine.total = statbuf.st_blocks / 2;
+    if (opts->include_files) {
+      Emit(&engine, rootpath, 0, &statbuf, engine.total);
+    }
+  } else if (ok) {
+    engine.root = NewNode(rootpath, NULL, 0, &statbuf);
+    DynamicArray* first = InitDynamicArray(1, sizeof(DuNode*));
+    Frame frame = {engine.root, 0, 0, 0};
+    if (!engine.root || !first ||
+        AppendDynamicArray(first, &engine.root, sizeof(DuNode*)) < 0 ||
+        AppendDynamicArray(engine.frames, &frame, sizeof(Frame)) < 0 ||
+        Push(&engine, first) < 0) {
+      Fail(&engine, rootpath, kDuOpAlloc, ENOMEM);
+      if (engine.unordered) {
+        FreeNode(engine.root);
+      }
+    } else {
+      engine.awaited = engine.root;
+
+      int started = 1;
+      while (started < count &&
+             pthread_create(&workers[started].thread, NULL, WorkerMain,
+                            &workers[started]) == 0) {
+        started++;
+      }
+      WorkerMain(&workers[0]);
+      for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+      }
+
+      blkcnt_t repeated = engine.deferred ? Repeated(workers, count) : 0;
+      if (repeated < 0) {
+        Fail(&engine, rootpath, kDuOpInsert, ENOMEM);
+      } else {
+        engine.total -= repeated;
+      }
+    }
+    FreeDynamicArray(first);
+  }
+
+  // Directories left unread after a stop, with their ancestors
+  DuNode** queued = engine.queue ? (DuNode**)engine.queue->data : NULL;
+  for (size_t i = 0; engine.unordered && queued && i < engine.queue->len;
+       i++) {
+    Complete(&engine, queued[i]);
+  }
+  if (!engine.unordered && engine.root) {
+    FreeTree(engine.root);
+  }
+
+  for (int i = 0; workers && i < count; i++) {
+    FreeDynamicArray(workers[i].links);
+  }
+  free(workers);
+  FreeDynamicArray(engine.queue);
+  FreeDynamicArray(engine.frames);
+  DuInodeSetFree(engine.inodes);
+  DuInodeSetFree(engine.released);
+  pthread_mutex_destroy(&engine.output);
+  pthread_cond_destroy(&engine.ready);
+  pthread_mutex_destroy(&engine.lock);
+
+  return state->error ? 0 : engine.total;
+}
+
+/**
+ * @brief Reads directories from the queue until the scan is complete or has
+ *        been halted.
+ *
+ * @param arg The worker.
+ *
+ * @return Returns NULL.
+ */
+static void* WorkerMain(void* arg) {
+  Worker* worker = (Worker*)arg;
+  DuNode* node;
+  while ((node = Pop(worker->engine))) {
+    ReadDirectory(worker, node);
+    Done(worker->engine);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Reads one directory: accounts its files, logs its hard links for
+ *        the reorder cursor, or the worker if deferred, and queues its
+ *        subdirectories.
+ *
+ * @param worker Worker reading the directory, the only one to touch `node`
+ *               until it is finished.
+ * @param node   Directory to read.
+ */
+static void ReadDirectory(Worker* worker, DuNode* node) {
+  const size_t kInitSize = 8;
+  Engine* engine = worker->engine;
+  const DuOptions* opts = engine->state->opts;
+
+  if (opts->progress) {
+    DuProgressEnter(opts->progress, node->path);
+  }
+
+  DuThrottleDir(&worker->throttle);
+  DIR* dirp = opendir(node->path);
+  if (!dirp) {
+    // Skipped directories still count for their own size
+    Fail(engine, node->path, kDuOpOpenDir, errno);
+    node->children = InitDynamicArray(1, sizeof(DuChild));
+    if (!node->children) {
+      Fail(engine, node->path, kDuOpAlloc, ENOMEM);
+    }
+    Finish(engine, node);
+    return;
+  }
+
+  DynamicArray* names = DuReadNames(dirp, opts->sorted && !engine->unordered);
+  DynamicArray* subdirs = InitDynamicArray(kInitSize, sizeof(DuNode*));
+  node->children = InitDynamicArray(kInitSize, sizeof(DuChild));
+  if (!names || !subdirs || !node->children) {
+    Fail(engine, node->path, kDuOpAlloc, ENOMEM);
+  }
+
+  uint64_t files = 0;
+  for (size_t pos = 0; names && subdirs && node->children &&
+                       pos < names->len && !Halted(engine);
+       pos++) {
+    const char* name = ((char**)names->data)[pos];
+    char path[kParallelPathMax];
+    if (snprintf(path, kParallelPathMax, "%s/%s", node->path, name) < 0) {
+      Fail(engine, node->path, kDuOpPath, errno);
+      continue;
+    }
+
+    struct stat statbuf;
+    if (DuThrottleStat(&worker->throttle, path, 0, &statbuf) < 0) {
+      Fail(engine, path, kDuOpStat, errno);
+      continue;
+    }
+
+    if (S_ISDIR(statbuf.st_mode)) {
+      DuNode* dir = NewNode(path, node, pos, &statbuf);
+      if (!dir || AppendDynamicArray(subdirs, &dir, sizeof(DuNode*)) < 0) {
+        FreeNode(dir);
+        Fail(engine, path, kDuOpAlloc, ENOMEM);
+        break;
+      }
+
+      // Unordered subdirectories report to their parent instead
+      DuChild child = {.dir = dir};
+      if (!engine->unordered &&
+          AppendDynamicArray(node->children, &child, sizeof(DuChild)) < 0) {
+        subdirs->len--;
+        FreeNode(dir);
+        Fail(engine, path, kDuOpAlloc, ENOMEM);
+        break;
+      }
+      continue;
+    }
+
+    blkcnt_t disk_usage = statbuf.st_blocks / 2;
+    node->files += disk_usage;
+    int linked = S_ISREG(statbuf.st_mode) && statbuf.st_nlink > 1 &&
+                 !opts->count_links;
+
+    // Counted for now, and subtracted once the scan ends if repeated
+    if (linked && engine->deferred) {
+      LinkRecord record = {statbuf.st_dev, statbuf.st_ino, pos, SIZE_MAX,
+                           disk_usage};
+      if (AppendDynamicArray(worker->links, &record, sizeof(LinkRecord)) < 0) {
+        Fail(engine, path, kDuOpInsert, ENOMEM);
+        break;
+      }
+      linked = 0;
+    }
+
+    // Directories are delivered as soon as complete, so repeats are
+    // subtracted as they are met, and any occurrence may be the one counted
+    if (linked && engine->inodes) {
+      int inserted =
+          DuInodeSetInsert(engine->inodes, statbuf.st_dev, statbuf.st_ino);
+      if (inserted < 0) {
+        Fail(engine, path, kDuOpInsert, ENOMEM);
+        break;
+      }
+      if (!inserted) {
+        node->files -= disk_usage;
+        continue;
+      }
+      linked = 0;
+    }
+    files++;
+
+    size_t index = SIZE_MAX;
+    if (opts->include_files) {
+      DuChild child = {
+          .name = strdup(name),
+          .pos = pos,
+          .disk_usage = disk_usage,
+      };
+      index = node->children->len;
+      if (!child.name ||
+          AppendDynamicArray(node->children, &child, sizeof(DuChild)) < 0) {
+        free(child.name);
+        Fail(engine, path, kDuOpAlloc, ENOMEM);
+        break;
+      }
+    }
+
+    // Deferred to the cursor, so no set is shared between workers
+    if (linked) {
+      LinkRecord record = {statbuf.st_dev, statbuf.st_ino, pos, index,
+                           disk_usage};
+      if (!node->links) {
+        node->links = InitDynamicArray(kInitSize, sizeof(LinkRecord));
+      }
+      if (!node->links ||
+          AppendDynamicArray(node->links, &record, sizeof(LinkRecord)) < 0) {
+        Fail(engine, path, kDuOpInsert, ENOMEM);
+        break;
+      }
+    }
+  }
+
+  // Counted once per directory, so workers rarely touch the shared counters
+  if (opts->progress) {
+    DuProgressAdd(opts->progress, 1 + files,
+                  (uint64_t)(node->statbuf.st_blocks / 2 + node->files));
+  }
+
+  if (subdirs && subdirs->len > 0) {
+    if (engine->unordered) {
+      __atomic_add_fetch(&node->pending, subdirs->len, __ATOMIC_RELAXED);
+    }
+    if (Halted(engine) || Push(engine, subdirs) < 0) {
+      // Ordered subdirectories are freed with the tree
+      for (size_t i = 0; engine->unordered && i < subdirs->len; i++) {
+        FreeNode(((DuNode**)subdirs->data)[i]);
+      }
+      if (engine->unordered) {
+        __atomic_sub_fetch(&node->pending, subdirs->len, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  Finish(engine, node);
+
+  DuFreeNames(names);
+  FreeDynamicArray(subdirs);
+}
+
+/**
+ * @brief Hands a directory just read over for output: to the reorder cursor,
+ *        or, unordered, delivers its files and completes it.
+ */
+static void Finish(Engine* engine, DuNode* node) {
+  if (!engine->unordered) {
+    size_t entries = node->children ? node->children->len : 0;
+    __atomic_add_fetch(&engine->buffered, entries, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&engine->output);
+    node->read = 1;
+    Advance(engine);
+    pthread_mutex_unlock(&engine->output);
+    return;
+  }
+
+  if (node->children && node->children->len > 0 && !Halted(engine)) {
+    DuChild* children = (DuChild*)node->children->data;
+    pthread_mutex_lock(&engine->output);
+    for (size_t i = 0; i < node->children->len; i++) {
+      char path[kParallelPathMax];
+      snprintf(path, kParallelPathMax, "%s/%s", node->path, children[i].name);
+      Emit(engine, path, node->depth + 1, NULL, children[i].disk_usage);
+    }
+    pthread_mutex_unlock(&engine->output);
+  }
+  Complete(engine, node);
+}
+
+/**
+ * @brief Releases entries in serial post-order for as long as the ones due
+ *        next are final, freeing every subtree released. Called with the
+ *        output lock held, whenever a directory has been read.
+ *
+ * The cursor holds the chain of directories from the root to the one being
+ * released, so it only ever waits for a directory still to be read, which
+ * becomes `awaited`. Everything a serial scan reaches before an entry has
+ * been released by then, so each hard link is resolved as the cursor passes
+ * it, as `dfs` would, and nothing waits for the scan to end.
+ */
+static void Advance(Engine* engine) {
+  DuNode* awaited = NULL;
+
+  while (engine->frames->len > 0 && !Halted(engine)) {
+    Frame* frame = (Frame*)engine->frames->data + engine->frames->len - 1;
+    DuNode* node = frame->node;
+    if (!node->read) {
+      awaited = node;
+      break;
+    }
+
+    DuChild* children = (DuChild*)node->children->data;
+    if (frame->next < node->children->len) {
+      DuChild* child = &children[frame->next];
+      if (ResolveLinks(engine, frame,
+                       child->dir ? child->dir->pos : child->pos) < 0) {
+        Fail(engine, node->path, kDuOpInsert, ENOMEM);
+        break;
+      }
+      if (child->dir) {
+        // `next` moves past the subdirectory once it is released
+        Frame next = {child->dir, 0, 0, 0};
+        if (AppendDynamicArray(engine->frames, &next, sizeof(Frame)) < 0) {
+          Fail(engine, child->dir->path, kDuOpAlloc, ENOMEM);
+        }
+        continue;
+      }
+
+      if (!child->duplicate) {
+        char path[kParallelPathMax];
+        snprintf(path, kParallelPathMax, "%s/%s", node->path, child->name);
+        Emit(engine, path, node->depth + 1, NULL, child->disk_usage);
+      }
+      frame->next++;
+      __atomic_sub_fetch(&engine->buffered, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    // The directory's own files may still include repeated links
+    if (ResolveLinks(engine, frame, SIZE_MAX) < 0) {
+      Fail(engine, node->path, kDuOpInsert, ENOMEM);
+      break;
+    }
+
+    blkcnt_t total = node->statbuf.st_blocks / 2 + node->files + frame->subdirs;
+    Emit(engine, node->path, node->depth, &node->statbuf, total);
+
+    engine->frames->len--;
+    if (engine->frames->len > 0) {
+      Frame* parent = (Frame*)engine->frames->data + engine->frames->len - 1;
+      parent->subdirs += total;
+      ((DuChild*)parent->node->children->data)[parent->next++].dir = NULL;
+      __atomic_sub_fetch(&engine->buffered, 1, __ATOMIC_RELAXED);
+    } else {
+      engine->total = total;
+      engine->root = NULL;
+    }
+    FreeNode(node);
+  }
+
+  __atomic_store_n(&engine->awaited, awaited, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Resolves the hard links of the cursor's directory up to an entry:
+ *        an occurrence of an inode the cursor has passed before is a repeat,
+ *        taken out of the directory's files and not visited.
+ *
+ * @param engine Engine, with the output lock held.
+ * @param frame  Frame of the directory.
+ * @param pos    Index of the entry among the directory's entries; the links
+ *               at or before it are resolved.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int ResolveLinks(Engine* engine, Frame* frame, size_t pos) {
+  DuNode* node = frame->node;
+  if (!node->links) {
+    return 0;
+  }
+
+  LinkRecord* records = (LinkRecord*)node->links->data;
+  DuChild* children = (DuChild*)node->children->data;
+  for (; frame->link < node->links->len && records[frame->link].pos <= pos;
+       frame->link++) {
+    const LinkRecord* record = &records[frame->link];
+    int inserted =
+        DuInodeSetInsert(engine->released, record->dev, record->ino);
+    if (inserted < 0) {
+      return -1;
+    }
+    if (!inserted) {
+      node->files -= record->disk_usage;
+      if (record->child != SIZE_MAX) {
+        children[record->child].duplicate = 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Totals the repeated occurrences in the workers' link records, done
+ *        scanning, for scans without a visitor.
+ *
+ * The records of all workers are radix sorted by (dev, ino), and within each
+ * run of one inode every occurrence but one is a repeat. Only the total is
+ * reported, so which occurrence is kept does not matter.
+ *
+ * @param workers Workers, done scanning.
+ * @param count   Number of workers.
+ *
+ * @return Returns the kilobytes counted more than once, or -1 if allocation
+ *         fails.
+ */
+static blkcnt_t Repeated(Worker* workers, int count) {
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += workers[i].links->len;
+  }
+  if (total < 2) {
+    return 0;
+  }
+
+  LinkRecord* records = malloc(total * sizeof(LinkRecord));
+  LinkRecord* tmp = malloc(total * sizeof(LinkRecord));
+  if (!records || !tmp) {
+    free(records);
+    free(tmp);
+    return -1;
+  }
+
+  size_t len = 0;
+  for (int i = 0; i < count; i++) {
+    memcpy(records + len, workers[i].links->data,
+           workers[i].links->len * sizeof(LinkRecord));
+    len += workers[i].links->len;
+  }
+  RadixSort(records, tmp, total);
+
+  blkcnt_t repeated = 0;
+  for (size_t i = 1; i < total; i++) {
+    if (records[i].dev == records[i - 1].dev &&
+        records[i].ino == records[i - 1].ino) {
+      repeated += records[i].disk_usage;
+    }
+  }
+
+  free(records);
+  free(tmp);
+  return repeated;
+}
+
+/**
+ * @brief Sorts records by (dev, ino) with a least-significant-byte radix
+ *        sort, skipping the byte positions on which all keys agree, such as
+ *        the high bytes of `dev` on a single filesystem.
+ *
+ * @param records Records to sort.
+ * @param tmp     Scratch space for as many records.
+ * @param count   Number of records, at least one.
+ */
+static void RadixSort(LinkRecord* records, LinkRecord* tmp, size_t count) {
+  LinkRecord* src = records;
+  LinkRecord* dst = tmp;
+
+  for (int pass = 0; pass < 16; pass++) {
+    int shift = 8 * (pass % 8);
+    size_t offsets[256] = {0};
+    for (size_t i = 0; i < count; i++) {
+      uint64_t key = pass < 8 ? (uint64_t)src[i].ino : (uint64_t)src[i].dev;
+      offsets[(key >> shift) & 0xff]++;
+    }
+
+    uint64_t key = pass < 8 ? (uint64_t)src[0].ino : (uint64_t)src[0].dev;
+    if (offsets[(key >> shift) & 0xff] == count) {
+      continue;
+    }
+
+    size_t offset = 0;
+    for (int b = 0; b < 256; b++) {
+      size_t n = offsets[b];
+      offsets[b] = offset;
+      offset += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      key = pass < 8 ? (uint64_t)src[i].ino : (uint64_t)src[i].dev;
+      dst[offsets[(key >> shift) & 0xff]++] = src[i];
+    }
+
+    LinkRecord* swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != records) {
+    memcpy(records, src, count * sizeof(LinkRecord));
+  }
+}
+
+/**
+ * @brief Marks a piece of an unordered directory as done: its own read, or
+ *        one of its subdirectories. The last piece delivers the directory
+ *        with its total, frees it and completes its parent in turn.
+ */
+static void Complete(Engine* engine, DuNode* node) {
+  while (node &&
+         __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    DuNode* parent = node->parent;
+    blkcnt_t total = node->statbuf.st_blocks / 2 + node->files +
+                     __atomic_load_n(&node->subdirs, __ATOMIC_ACQUIRE);
+
+    if (!Halted(engine)) {
+      pthread_mutex_lock(&engine->output);
+      Emit(engine, node->path, node->depth, &node->statbuf, total);
+      pthread_mutex_unlock(&engine->output);
+    }
+
+    if (parent) {
+      __atomic_add_fetch(&parent->subdirs, total, __ATOMIC_ACQ_REL);
+    } else {
+      engine->total = total;
+    }
+    FreeNode(node);
+    node = parent;
+  }
+}
+
+/**
+ * @brief Delivers an entry, halting the scan if the visitor asks to stop.
+ *        Called with the output lock held, or before any worker starts.
+ */
+static void Emit(Engine* engine, const char* path, int depth,
+                 const struct stat* statbuf, blkcnt_t disk_usage) {
+  DuEntry entry = {path, depth, statbuf, disk_usage};
+  if (engine->deliver(&entry, engine->state)) {
+    Halt(engine);
+  }
+}
+
+/**
+ * @brief Creates a directory node, pending its own read.
+ *
+ * @return Returns the node, or NULL if allocation fails.
+ */
+static DuNode* NewNode(const char* path, DuNode* parent, size_t pos,
+                       const struct stat* statbuf) {
+  DuNode* node = calloc(1, sizeof(DuNode));
+  if (!node) {
+    return NULL;
+  }
+
+  node->path = strdup(path);
+  if (!node->path) {
+    free(node);
+    return NULL;
+  }
+
+  node->parent = parent;
+  node->pos = pos;
+  node->depth = parent ? parent->depth + 1 : 0;
+  node->statbuf = *statbuf;
+  node->pending = 1;
+  return node;
+}
+
+/**
+ * @brief Frees a directory node and the names of its files, but not its
+ *        subdirectories.
+ *
+ * @param node Node to free, may be NULL.
+ */
+static void FreeNode(DuNode* node) {
+  if (!node) {
+    return;
+  }
+
+  if (node->children) {
+    DuChild* children = (DuChild*)node->children->data;
+    for (size_t i = 0; i < node->children->len; i++) {
+      free(children[i].name);
+    }
+  }
+  FreeDynamicArray(node->children);
+  FreeDynamicArray(node->links);
+  free(node->path);
+  free(node);
+}
+
+/**
+ * @brief Frees a directory node and the subdirectories not yet released.
+ */
+static void FreeTree(DuNode* node) {
+  if (node->children) {
+    DuChild* children = (DuChild*)node->children->data;
+    for (size_t i = 0; i < node->children->len; i++) {
+      if (children[i].dir) {
+        FreeTree(children[i].dir);
+      }
+    }
+  }
+  FreeNode(node);
+}
+
+/**
+ * @brief Takes a directory to read, waiting while other workers may still
+ *        queue some.
+ *
+ * Once the reorder window is full, only the directory the cursor waits for
+ * is taken, so reading never runs further ahead of the output.
+ *
+ * @return Returns the directory, or NULL once the scan is complete or
+ *         halted.
+ */
+static DuNode* Pop(Engine* engine) {
+  DuNode* node = NULL;
+
+  pthread_mutex_lock(&engine->lock);
+  while (!Halted(engine)) {
+    DynamicArray* queue = engine->queue;
+    DuNode** nodes = (DuNode**)queue->data;
+    if (queue->len > 0 && !Saturated(engine)) {
+      node = nodes[--queue->len];
+      break;
+    }
+
+    if (queue->len > 0) {
+      DuNode* awaited = __atomic_load_n(&engine->awaited, __ATOMIC_RELAXED);
+      size_t i = queue->len;
+      while (i > 0 && nodes[i - 1] != awaited) {
+        i--;
+      }
+      if (i > 0) {
+        node = nodes[i - 1];
+        memmove(nodes + i - 1, nodes + i, (queue->len - i) * sizeof(DuNode*));
+        queue->len--;
+        break;
+      }
+    }
+
+    if (engine->outstanding == 0) {
+      break;
+    }
+    engine->waiting++;
+    pthread_cond_wait(&engine->ready, &engine->lock);
+    engine->waiting--;
+  }
+  pthread_mutex_unlock(&engine->lock);
+  return node;
+}
+
+/**
+ * @brief Queues the subdirectories found in one directory.
+ *
+ * @return Returns 0 on success, or -1 if the queue could not grow.
+ */
+static int Push(Engine* engine, DynamicArray* nodes) {
+  pthread_mutex_lock(&engine->lock);
+  if (ReserveDynamicArray(engine->queue, nodes->len, sizeof(DuNode*)) < 0) {
+    pthread_mutex_unlock(&engine->lock);
+    Fail(engine, ((DuNode**)nodes->data)[0]->path, kDuOpAlloc, ENOMEM);
+    return -1;
+  }
+
+  memcpy((DuNode**)engine->queue->data + engine->queue->len, nodes->data,
+         nodes->len * sizeof(DuNode*));
+  engine->queue->len += nodes->len;
+  engine->outstanding += nodes->len;
+  if (engine->waiting > 0) {
+    pthread_cond_broadcast(&engine->ready);
+  }
+  pthread_mutex_unlock(&engine->lock);
+  return 0;
+}
+
+/**
+ * @brief Marks a directory as read, waking the waiting workers: the scan may
+ *        be complete, or the cursor may have moved on.
+ */
+static void Done(Engine* engine) {
+  pthread_mutex_lock(&engine->lock);
+  engine->outstanding--;
+  if (engine->waiting > 0) {
+    pthread_cond_broadcast(&engine->ready);
+  }
+  pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * @brief Tells whether the reorder window is full. It is never full once the
+ *        cursor waits for no directory, as after a stop.
+ */
+static int Saturated(Engine* engine) {
+  return !engine->unordered &&
+         __atomic_load_n(&engine->buffered, __ATOMIC_RELAXED) >
+             kReorderWindow &&
+         __atomic_load_n(&engine->awaited, __ATOMIC_RELAXED) != NULL;
+}
+
+/**
+ * @brief Forwards every error to the error callback. The first error that
+ *        cannot be skipped is recorded and halts the scan.
+ */
+static void Fail(Engine* engine, const char* path, DuOp op, int errnum) {
+  DuState* state = engine->state;
+  int skip = state->opts->keep_going && DuSkippable(op);
+  if (!errnum) {
+    errnum = EIO;
+  }
+
+  pthread_mutex_lock(&engine->lock);
+  if (skip) {
+    state->skipped++;
+  } else if (!state->error) {
+    state->error = errnum;
+  }
+  if (state->opts->on_error) {
+    state->opts->on_error(path, op, errnum, state->opts->ctx);
+  }
+  pthread_mutex_unlock(&engine->lock);
+
+  if (!skip) {
+    Halt(engine);
+  }
+}
+
+/**
+ * @brief Stops the workers from taking more directories, and wakes them.
+ */
+static void Halt(Engine* engine) {
+  pthread_mutex_lock(&engine->lock);
+  __atomic_store_n(&engine->halted, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&engine->ready);
+  pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * @brief Tells whether the scan has been halted, without taking the lock.
+ */
+static int Halted(const Engine* engine) {
+  return __atomic_load_n(&engine->halted, __ATOMIC_RELAXED) != 0;
+}
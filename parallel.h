@@ -0,0 +1,36 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <sys/types.h>  // blkcnt_t
+
+#include "libdu.h"
+
+/**
+ * Multi-threaded scan engine. Worker threads take directories from a shared
+ * queue, which is the only point they synchronize on, and build a tree of
+ * the directories they read. Hard links are not looked up while scanning:
+ * each worker appends a record for every multiply-linked file to the
+ * directory it reads. A reorder cursor releases entries in serial post-order
+ * as soon as all that comes before them is complete, so they reach the
+ * visitor in exactly the order of a serial scan, while reading runs only a
+ * bounded window ahead. By then every occurrence a serial scan reaches
+ * earlier has been released, so the cursor resolves the records as it
+ * passes them, keeping the first occurrence of each inode and subtracting
+ * the others, and the totals are exactly those of a serial scan too.
+ * Unordered scans skip the cursor and deliver each directory as soon as its
+ * subtree is complete.
+ *
+ * Without a visitor only the total is reported, so the occurrence kept does
+ * not matter: each worker then logs its records on its own, and once the
+ * scan ends they are radix sorted by (dev, ino) and every occurrence but one
+ * of each inode is subtracted from the total. Unordered visitors do not
+ * expect the serial order either, but get each directory's total as soon as
+ * its subtree is complete, so repeats must be known while scanning: their
+ * workers share a concurrent set of the links met (see inodeset.h).
+ */
+
+// Parallel Functions
+blkcnt_t DuParallelScan(const char *rootpath, DuState *state,
+                        DuVisitFn deliver);
+
+#endif  // PARALLEL_H_
@@ -0,0 +1,294 @@
+/**
+ * @file   progress.c
+ *
+ * @brief  Progress reporting for long scans. The scan only bumps two relaxed
+ *         counters per entry and tests a flag per directory; a reporter
+ *         thread sleeps in `sigtimedwait`, waking on its timer or on SIGUSR1,
+ *         reads the counters and hands a snapshot to its callback.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "progress.h"
+
+#include <errno.h>      // errno, EINTR, ENOMEM
+#include <pthread.h>    // pthread_create, pthread_join, pthread_kill,
+                        // pthread_sigmask, pthread_mutex_t
+#include <signal.h>     // sigset_t, sigaddset, sigemptyset, sigtimedwait,
+                        // sigwaitinfo, SIGUSR1
+#include <stdlib.h>     // aligned_alloc, free
+#include <string.h>     // memcpy, memset, strlen
+#include <time.h>       // clock_gettime, nanosleep, struct timespec
+
+enum {
+  kCacheLine = 64,          // bytes
+  kProgressPathMax = 4096,  // bytes; longer directories are cut short
+  kFreshPolls = 50,         // polls for a fresh directory, a millisecond apart
+};
+
+struct DuProgress {
+  // Bumped by the scan, on a cache line the reporter only reads
+  __attribute__((aligned(kCacheLine))) uint64_t entries;
+  uint64_t kilobytes;
+
+  // Set by the reporter when it wants `dir`, cleared by the scan as it
+  // copies the next directory it enters
+  __attribute__((aligned(kCacheLine))) int wanted;
+  int stopping;
+  pthread_mutex_t lock;  // guards `dir`
+  char dir[kProgressPathMax];
+
+  double interval;  // seconds between snapshots, 0 for SIGUSR1 only
+  DuProgressFn report;
+  void* ctx;
+  pthread_t thread;
+  sigset_t saved;  // signal mask of the thread that started the reporter
+};
+
+static void* ReporterMain(void* arg);
+static int Wait(const DuProgress* progress, const sigset_t* set,
+                struct timespec* next);
+static void Refresh(DuProgress* progress);
+static void Advance(struct timespec* time, double seconds);
+static double Seconds(const struct timespec* from, const struct timespec* to);
+
+/**
+ * @brief Blocks SIGUSR1 in the calling thread and starts a reporter thread
+ *        that takes snapshots every `interval` seconds and on SIGUSR1.
+ *
+ * @param interval Seconds between snapshots, or 0 to take them on SIGUSR1
+ *                 alone.
+ * @param report   Receives each snapshot, on the reporter thread.
+ * @param ctx      Passed to `report`.
+ *
+ * @return Returns the progress to hand to scans in `DuOptions::progress`, or
+ *         NULL on error with errno set.
+ */
+DuProgress* DuProgressStart(double interval, DuProgressFn report, void* ctx) {
+  DuProgress* progress = aligned_alloc(kCacheLine, sizeof(DuProgress));
+  if (!progress) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(progress, 0, sizeof(DuProgress));
+  progress->interval = interval;
+  progress->report = report;
+  progress->ctx = ctx;
+  pthread_mutex_init(&progress->lock, NULL);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, &progress->saved);
+
+  int err = pthread_create(&progress->thread, NULL, ReporterMain, progress);
+  if (err) {
+    pthread_sigmask(SIG_SETMASK, &progress->saved, NULL);
+    pthread_mutex_destroy(&progress->lock);
+    free(progress);
+    errno = err;
+    return NULL;
+  }
+  return progress;
+}
+
+/**
+ * @brief Stops the reporter without a last snapshot, restores the signal
+ *        mask of the calling thread and frees the progress. A SIGUSR1 still
+ *        pending is discarded.
+ *
+ * @param progress Progress to stop, may be NULL.
+ */
+void DuProgressStop(DuProgress* progress) {
+  if (!progress) {
+    return;
+  }
+
+  __atomic_store_n(&progress->stopping, 1, __ATOMIC_RELEASE);
+  pthread_kill(progress->thread, SIGUSR1);
+  pthread_join(progress->thread, NULL);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  struct timespec now = {0};
+  while (sigtimedwait(&set, NULL, &now) == SIGUSR1) {
+  }
+  pthread_sigmask(SIG_SETMASK, &progress->saved, NULL);
+
+  pthread_mutex_destroy(&progress->lock);
+  free(progress);
+}
+
+/**
+ * @brief Counts accounted entries and their disk usage. Called by scans, from
+ *        any number of threads.
+ *
+ * @param progress  Progress of the scan.
+ * @param entries   Entries newly accounted.
+ * @param kilobytes Their disk usage.
+ */
+void DuProgressAdd(DuProgress* progress, uint64_t entries,
+                   uint64_t kilobytes) {
+  __atomic_fetch_add(&progress->entries, entries, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&progress->kilobytes, kilobytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Notes a directory the scan enters, copying its path only if the
+ *        reporter asked for one since the last copy. Called by scans, from
+ *        any number of threads.
+ *
+ * @param progress Progress of the scan.
+ * @param path     Path of the directory.
+ */
+void DuProgressEnter(DuProgress* progress, const char* path) {
+  if (!__atomic_load_n(&progress->wanted, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  // Workers entering directories at once may all copy theirs, in turn
+  size_t len = strlen(path);
+  if (len >= kProgressPathMax) {
+    len = kProgressPathMax - 1;
+  }
+  pthread_mutex_lock(&progress->lock);
+  memcpy(progress->dir, path, len);
+  progress->dir[len] = '\0';
+  __atomic_store_n(&progress->wanted, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&progress->lock);
+}
+
+/**
+ * @brief Reporter thread: takes a snapshot on every tick and every SIGUSR1
+ *        until stopped.
+ *
+ * @param arg The progress.
+ *
+ * @return Returns NULL.
+ */
+static void* ReporterMain(void* arg) {
+  DuProgress* progress = (DuProgress*)arg;
+  char dir[kProgressPathMax] = "";
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct timespec next = start;
+  struct timespec last = start;
+  Advance(&next, progress->interval);
+  uint64_t last_entries = 0;
+
+  for (;;) {
+    int requested = Wait(progress, &set, &next);
+    if (__atomic_load_n(&progress->stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+
+    Refresh(progress);
+    pthread_mutex_lock(&progress->lock);
+    memcpy(dir, progress->dir, sizeof(dir));
+    pthread_mutex_unlock(&progress->lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t entries = __atomic_load_n(&progress->entries, __ATOMIC_RELAXED);
+
+    double span = Seconds(&last, &now);
+    DuProgressSnapshot snapshot = {
+        .entries = entries,
+        .kilobytes =
+            __atomic_load_n(&progress->kilobytes, __ATOMIC_RELAXED),
+        .elapsed = Seconds(&start, &now),
+        .rate = span > 0 ? (double)(entries - last_entries) / span : 0,
+        .dir = dir,
+        .requested = requested,
+    };
+    last = now;
+    last_entries = entries;
+    progress->report(&snapshot, progress->ctx);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Sleeps until the next tick or a SIGUSR1, whichever comes first.
+ *
+ * @param progress Progress being reported.
+ * @param set      Signal set holding SIGUSR1.
+ * @param next     Time of the next tick, advanced once it is reached.
+ *
+ * @return Returns 1 if woken by SIGUSR1, 0 on a tick.
+ */
+static int Wait(const DuProgress* progress, const sigset_t* set,
+                struct timespec* next) {
+  double interval = progress->interval;
+  if (interval <= 0) {
+    while (sigwaitinfo(set, NULL) < 0 && errno == EINTR) {
+    }
+    return 1;
+  }
+
+  for (;;) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double left = Seconds(&now, next);
+    if (left <= 0) {
+      if (left <= -interval) {
+        *next = now;  // a whole tick behind, as after a slow report
+      }
+      Advance(next, interval);
+      return 0;
+    }
+
+    struct timespec timeout = {.tv_sec = (time_t)left};
+    timeout.tv_nsec = (long)((left - (double)timeout.tv_sec) * 1e9);
+    if (sigtimedwait(set, NULL, &timeout) == SIGUSR1) {
+      return 1;
+    }
+  }
+}
+
+/**
+ * @brief Asks the scan for the directory it enters next, and waits a little
+ *        for it. A scan that enters none meanwhile is still reading the
+ *        directory it copied last, or a file too large to stat quickly.
+ *
+ * @param progress Progress being reported.
+ */
+static void Refresh(DuProgress* progress) {
+  const struct timespec kPoll = {.tv_nsec = 1000000L};
+
+  __atomic_store_n(&progress->wanted, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < kFreshPolls &&
+                  __atomic_load_n(&progress->wanted, __ATOMIC_RELAXED);
+       i++) {
+    nanosleep(&kPoll, NULL);
+  }
+}
+
+/**
+ * @brief Moves a time forward by a number of seconds.
+ */
+static void Advance(struct timespec* time, double seconds) {
+  time_t whole = (time_t)seconds;
+  time->tv_sec += whole;
+  time->tv_nsec += (long)((seconds - (double)whole) * 1e9);
+  if (time->tv_nsec >= 1000000000L) {
+    time->tv_sec++;
+    time->tv_nsec -= 1000000000L;
+  }
+}
+
+/**
+ * @brief Returns the seconds from one time to another, negative if `to` is
+ *        earlier.
+ */
+static double Seconds(const struct timespec* from, const struct timespec* to) {
+  return (double)(to->tv_sec - from->tv_sec) +
+         (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
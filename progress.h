@@ -0,0 +1,50 @@
+#ifndef PROGRESS_H_
+#define PROGRESS_H_
+
+#include <stdint.h>     // uint64_t
+
+/**
+ * Scan progress. A scan given a `DuProgress` bumps its counters with relaxed
+ * atomic adds as entries are accounted, and copies out the directory it is
+ * reading only when asked to, at most once per report, so the walk pays no
+ * lock and no string copy per entry. A reporter thread wakes every
+ * `interval` seconds, and whenever SIGUSR1 arrives, and hands a snapshot to
+ * a callback.
+ *
+ * SIGUSR1 is blocked in the thread that starts the reporter, and so in every
+ * thread it creates afterwards, such as the workers of a threaded scan, so
+ * that only the reporter takes it. Start the reporter before any other
+ * thread.
+ */
+
+/**
+ * @brief Progress of a scan at one point in time.
+ */
+typedef struct DuProgressSnapshot {
+  uint64_t entries;    // entries accounted so far
+  uint64_t kilobytes;  // disk usage accounted so far
+  double elapsed;      // seconds since the reporter started
+  double rate;         // entries per second since the previous snapshot
+  const char *dir;     // a directory read since the previous snapshot, or
+                       // the last one if none was entered; "" before any
+  int requested;       // taken for SIGUSR1 rather than on the timer
+} DuProgressSnapshot;
+
+/**
+ * @brief Report callback, invoked on the reporter thread.
+ */
+typedef void (*DuProgressFn)(const DuProgressSnapshot *snapshot, void *ctx);
+
+/**
+ * @brief Counters of a scan, with their reporter thread. Opaque.
+ */
+typedef struct DuProgress DuProgress;
+
+// Progress Functions
+DuProgress *DuProgressStart(double interval, DuProgressFn report, void *ctx);
+void DuProgressStop(DuProgress *progress);
+void DuProgressAdd(DuProgress *progress, uint64_t entries,
+                   uint64_t kilobytes);
+void DuProgressEnter(DuProgress *progress, const char *path);
+
+#endif  // PROGRESS_H_
@@ -0,0 +1,215 @@
+/**
+ * @file   quote.c
+ *
+ * @brief  Shell quoting of paths, with a SIMD scan for the bytes that need
+ *         it so that ordinary paths are copied straight to the output.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "quote.h"
+
+#include <string.h>     // strlen
+
+#if defined(__SSE2__)
+#include <emmintrin.h>  // _mm_cmpeq_epi8, _mm_loadu_si128, _mm_movemask_epi8
+#endif
+
+static int IsSafe(unsigned char c);
+static int IsControl(unsigned char c);
+static size_t CharLength(const unsigned char* s, size_t len);
+#if defined(__SSE2__)
+static inline __m128i InRange(__m128i bytes, unsigned char lo,
+                              unsigned char hi);
+#endif
+
+/**
+ * @brief Finds how many leading bytes of a path need no quoting: letters,
+ *        digits, `%+,-./:=@_` and printable multi-byte UTF-8 characters.
+ *
+ * Sixteen bytes are classified at a time with SSE2 where available, by
+ * testing each byte against the ranges of safe ASCII bytes at once. Bytes
+ * from 0x80 up stop the vector scan and are checked one character at a time,
+ * so invalid UTF-8 and C1 controls are never taken as safe.
+ *
+ * @param path Path to scan.
+ * @param len  Length of `path` in bytes.
+ *
+ * @return Returns the index of the first byte to quote, or `len` if none.
+ */
+size_t DuQuoteSafeSpan(const char* path, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)path;
+  size_t i = 0;
+
+  while (i < len) {
+#if defined(__SSE2__)
+    if (i + 16 <= len) {
+      __m128i chunk = _mm_loadu_si128((const __m128i*)(path + i));
+      __m128i safe = _mm_or_si128(InRange(chunk, 'a', 'z'),
+                                  InRange(chunk, '@', 'Z'));
+      safe = _mm_or_si128(safe, InRange(chunk, '+', ':'));
+      safe = _mm_or_si128(safe, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+      safe = _mm_or_si128(safe, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('=')));
+      safe = _mm_or_si128(safe, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('%')));
+
+      unsigned unsafe = ~(unsigned)_mm_movemask_epi8(safe) & 0xffff;
+      if (!unsafe) {
+        i += 16;
+        continue;
+      }
+      i += (size_t)__builtin_ctz(unsafe);
+    }
+#endif
+
+    if (IsSafe(bytes[i])) {
+      i++;
+      continue;
+    }
+
+    size_t n = CharLength(bytes + i, len - i);
+    if (n == 0) {
+      return i;
+    }
+    i += n;
+  }
+  return len;
+}
+
+/**
+ * @brief Writes a path so that a POSIX shell reads it back unchanged.
+ *
+ * Safe paths are written as they are. Paths with control characters, C1
+ * controls included, or bytes that are not valid UTF-8 are written as
+ * `$'...'`, with `\n`, `\t`, `\\`, `\'` and octal escapes, so no raw
+ * newline or terminal control sequence reaches the output. Any other path
+ * is single-quoted, each `'` becoming `'\''`.
+ *
+ * @param path   Path to write.
+ * @param stream Stream to write to.
+ *
+ * @return Returns 0 on success, or EOF on a write error.
+ */
+int DuQuoteShell(const char* path, FILE* stream) {
+  size_t len = strlen(path);
+  size_t span = DuQuoteSafeSpan(path, len);
+  if (span == len && len > 0) {
+    return fwrite(path, 1, len, stream) == len ? 0 : EOF;
+  }
+
+  const unsigned char* bytes = (const unsigned char*)path;
+  int control = 0;
+  for (size_t i = span; i < len && !control;) {
+    size_t n = bytes[i] >= 0x80 ? CharLength(bytes + i, len - i) : 1;
+    control = n == 0 || IsControl(bytes[i]);
+    i += n;
+  }
+
+  if (!control) {
+    fputc('\'', stream);
+    for (const char* p = path; *p; p++) {
+      if (*p == '\'') {
+        fputs("'\\''", stream);
+      } else {
+        fputc(*p, stream);
+      }
+    }
+    fputc('\'', stream);
+    return ferror(stream) ? EOF : 0;
+  }
+
+  fputs("$'", stream);
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = bytes[i];
+    size_t n = c >= 0x80 ? CharLength(bytes + i, len - i) : 1;
+    if (c == '\n') {
+      fputs("\\n", stream);
+    } else if (c == '\t') {
+      fputs("\\t", stream);
+    } else if (c == '\\' || c == '\'') {
+      fputc('\\', stream);
+      fputc(c, stream);
+    } else if (n == 0 || IsControl(c)) {
+      fprintf(stream, "\\%03o", c);
+    } else {
+      fwrite(bytes + i, 1, n, stream);
+      i += n - 1;
+    }
+  }
+  fputc('\'', stream);
+  return ferror(stream) ? EOF : 0;
+}
+
+/**
+ * @brief Tells whether an ASCII byte can appear unquoted in a shell word.
+ */
+static int IsSafe(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= '@' && c <= 'Z') ||
+         (c >= '+' && c <= ':') || c == '_' || c == '=' || c == '%';
+}
+
+/**
+ * @brief Tells whether a byte is an ASCII control character.
+ */
+static int IsControl(unsigned char c) {
+  return c < 0x20 || c == 0x7f;
+}
+
+/**
+ * @brief Measures the printable multi-byte UTF-8 character at `s`: well
+ *        formed, neither overlong nor a surrogate, at most U+10FFFF, and not
+ *        a C1 control (U+0080 to U+009F).
+ *
+ * @param s   Bytes starting with a lead byte from 0x80 up.
+ * @param len Bytes available at `s`.
+ *
+ * @return Returns the length of the character in bytes, or 0 if it is
+ *         invalid or a control.
+ */
+static size_t CharLength(const unsigned char* s, size_t len) {
+  size_t n;
+  unsigned min;  // smallest code point of this length, to reject overlongs
+  unsigned code;
+  if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    n = 2;
+    min = 0xa0;
+    code = s[0] & 0x1f;
+  } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    n = 3;
+    min = 0x800;
+    code = s[0] & 0x0f;
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    n = 4;
+    min = 0x10000;
+    code = s[0] & 0x07;
+  } else {
+    return 0;
+  }
+
+  if (len < n) {
+    return 0;
+  }
+  for (size_t i = 1; i < n; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    code = (code << 6) | (s[i] & 0x3f);
+  }
+
+  int surrogate = code >= 0xd800 && code <= 0xdfff;
+  return (code < min || code > 0x10ffff || surrogate) ? 0 : n;
+}
+
+#if defined(__SSE2__)
+/**
+ * @brief Sets the lanes whose byte lies within [lo, hi]: subtracting `lo`
+ *        wraps the range to [0, hi - lo], which an unsigned saturating
+ *        subtraction of `hi - lo` turns into zeroes.
+ */
+static inline __m128i InRange(__m128i bytes, unsigned char lo,
+                              unsigned char hi) {
+  __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8((char)lo));
+  __m128i excess = _mm_subs_epu8(offset, _mm_set1_epi8((char)(hi - lo)));
+  return _mm_cmpeq_epi8(excess, _mm_setzero_si128());
+}
+#endif
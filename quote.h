@@ -0,0 +1,20 @@
+#ifndef QUOTE_H_
+#define QUOTE_H_
+
+#include <stddef.h>  // size_t
+#include <stdio.h>   // FILE
+
+/**
+ * Shell quoting of paths for output. Paths made only of bytes that need no
+ * quoting, as nearly all are, are found with a vectorized scan and written
+ * as they are. Others are single-quoted, or written as `$'...'` with escape
+ * sequences if they hold control characters or bytes that are not valid
+ * UTF-8, so every path can be pasted back into a POSIX shell and the stream
+ * stays one entry per line.
+ */
+
+// Quote Functions
+size_t DuQuoteSafeSpan(const char *path, size_t len);
+int DuQuoteShell(const char *path, FILE *stream);
+
+#endif  // QUOTE_H_
@@ -98,6 +98,766 @@ if exists ./tests/* ; then
         printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
         cat diff.txt
     done
+
+    echo
+    echo "Running testcases with '-t' option..."
+    for dir in ./tests/* ; do
+        for threshold in 8K -4K ; do
+            ./du -a -t ${threshold} ${dir} > output.txt
+            du -a -t ${threshold} ${dir} > expected.txt
+
+            diff output.txt expected.txt > diff.txt
+            if [ $? -eq 0 ]; then
+                pmsg="PASS"
+                passed=$((passed + 1))
+            else
+                pmsg="FAIL"
+                failed=$((failed + 1))
+            fi
+            [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+            printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}") (${threshold})" "${pmsg}"
+            cat diff.txt
+        done
+    done
+
+    echo
+    echo "Running testcases from a saved index..."
+    for dir in ./tests/* ; do
+        ./du -a --save-index=index.bin ${dir} > /dev/null
+        ./du --index=index.bin | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+    rm -f index.bin
+
+    echo
+    echo "Running testcases guided by a saved index, with quota checks..."
+    for dir in ./tests/* ; do
+        ./du -a --save-index=index.bin ${dir} > /dev/null
+        ./du -a --guide=index.bin ${dir} | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        # Exactly the total is within the limit, one byte less is exceeded
+        total=$(du -s ${dir} | cut -f1)
+        ./du --guide=index.bin --exceeds=$((total * 1024)) ${dir} > /dev/null
+        echo "within $?" >> output.txt
+        echo "within 3" >> expected.txt
+        ./du --exceeds=$((total * 1024 - 1)) ${dir} > /dev/null
+        echo "exceeds $?" >> output.txt
+        echo "exceeds 0" >> expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+    rm -f index.bin
+
+    echo
+    echo "Running testcases with a live top-N scan..."
+    for dir in ./tests/* ; do
+        ./du -a --save-index=index.bin ${dir} > /dev/null
+        ./du -a --top=1000000 --guide=index.bin ${dir} | sort > output.txt
+        # The root is the last entry and is not ranked
+        du -a ${dir} | head -n -1 | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+    rm -f index.bin
+
+    echo
+    echo "Running testcases with a saved snapshot..."
+    for dir in ./tests/* ; do
+        ./du -a --save-snapshot=snapshot.bin ${dir} | sort > output.txt
+        ./du --diff snapshot.bin snapshot.bin >> output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+    rm -f snapshot.bin
+
+    echo
+    echo "Running testcases diffing two snapshots..."
+    # A file grows, a subtree is removed and a directory is created between
+    # the snapshots, and GNU du's listings give the expected changes
+    tree=$(mktemp -d)
+    mkdir -p ${tree}/a ${tree}/b/s
+    echo a > ${tree}/a/f
+    echo b > ${tree}/b/s/g
+    ./du -a --save-snapshot=old.bin ${tree} > /dev/null
+    du -a ${tree} > before.txt
+    head -c 65536 /dev/zero >> ${tree}/a/f
+    rm -rf ${tree}/b
+    mkdir ${tree}/c
+    echo c > ${tree}/c/h
+    ./du -a --save-snapshot=new.bin ${tree} > /dev/null
+    du -a ${tree} > after.txt
+    awk -F '\t' 'NR == FNR { old[$2] = $1; next } { new[$2] = $1 }
+        END {
+            for (p in old) if (!(p in new)) new[p] = 0
+            for (p in new) if (new[p] != old[p])
+                printf "%+d\t%s\n", new[p] - old[p], p
+        }' before.txt after.txt | sort > expected.txt
+    ./du --diff old.bin new.bin > full.txt
+    for opts in "" "--top=3"; do
+        if [ -z "${opts}" ]; then
+            sort full.txt > output.txt
+        else
+            # The first changes of the full report, ties in the same order
+            ./du --diff ${opts} old.bin new.bin > output.txt
+            head -n 3 full.txt > expected.txt
+        fi
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "diff ${opts}" "${pmsg}"
+        cat diff.txt
+    done
+    rm -rf ${tree} old.bin new.bin before.txt after.txt full.txt
+
+    echo
+    echo "Running testcases with checkpoints..."
+    for dir in ./tests/* ; do
+        ./du -a --checkpoint=checkpoint.bin ${dir} | sort > output.txt
+        [ -e checkpoint.bin ] && echo "checkpoint.bin left behind" >> output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+    rm -f checkpoint.bin
+
+    echo
+    echo "Running testcases resuming from a checkpoint..."
+    # 320 entries at 100 per second take over 3 s, so a checkpoint is saved
+    # after 1 s and the scan is killed then, to be resumed
+    tree=$(mktemp -d)
+    for d in $(seq 1 20); do
+        mkdir ${tree}/d${d}
+        for f in $(seq 1 15); do
+            echo "${f}" > ${tree}/d${d}/f${f}
+        done
+    done
+    ./du -a --checkpoint=checkpoint.bin --checkpoint-interval=1 \
+        --max-ops-per-sec=100 ${tree} > /dev/null &
+    scan=$!
+    for i in $(seq 1 100); do
+        [ -e checkpoint.bin ] && break
+        sleep 0.1
+    done
+    kill ${scan}
+    wait ${scan} 2> /dev/null
+
+    # A resumed scan prints the entries after the checkpoint, the root last,
+    # each with the size an uninterrupted scan gives it
+    ./du -a --resume=checkpoint.bin > resumed.txt
+    sort resumed.txt > output.txt
+    du -a ${tree} | sort | grep -F -x -f output.txt > expected.txt
+    [ "$(tail -n 1 resumed.txt)" = "$(du -s ${tree})" ] ||
+        echo "root total missing" >> output.txt
+    [ "$(wc -l < resumed.txt)" -lt "$(du -a ${tree} | wc -l)" ] ||
+        echo "scan started over" >> output.txt
+
+    diff output.txt expected.txt > diff.txt
+    if [ $? -eq 0 ]; then
+        pmsg="PASS"
+        passed=$((passed + 1))
+    else
+        pmsg="FAIL"
+        failed=$((failed + 1))
+    fi
+    [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+    printf "${rowcolor}%-50s %-5s${RESET}\n" "resume" "${pmsg}"
+    cat diff.txt
+    rm -rf ${tree} checkpoint.bin resumed.txt
+
+    echo
+    echo "Running testcases skipping an unreadable directory..."
+    if [ "$(id -u)" -eq 0 ]; then
+        echo "${YELLOW}Skipped: root can read every directory${RESET}"
+    else
+        tree=$(mktemp -d)
+        mkdir -p ${tree}/a/locked ${tree}/b
+        echo a > ${tree}/a/locked/f
+        echo b > ${tree}/b/g
+        chmod 000 ${tree}/a/locked
+
+        # The directory counts its own size, as with GNU du, and the scan
+        # exits with kExitPartial after logging the failure
+        ./du -a --keep-going --error-log=errors.log ${tree} 2> /dev/null |
+            sort > output.txt
+        status=${PIPESTATUS[0]}
+        [ "${status}" -eq 2 ] || echo "exit status ${status}" >> output.txt
+        [ "$(cat errors.log)" = "$(printf 'opendir\t13\t%s' \
+            "${tree}/a/locked")" ] || cat errors.log >> output.txt
+        du -a ${tree} 2> /dev/null | sort > expected.txt
+        chmod 700 ${tree}/a/locked
+        rm -rf ${tree} errors.log
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "keep-going" "${pmsg}"
+        cat diff.txt
+    fi
+
+    echo
+    echo "Running testcases with spilled hard links..."
+    for dir in ./tests/* ; do
+        ./du -a --link-memory=1 ${dir} | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with hard links made at test time..."
+    # git keeps no hard links, so link a tree here: 3 links to each of 300
+    # files, enough for one-record runs to be merged down several times
+    links=$(mktemp -d)
+    mkdir -p ${links}/a/b ${links}/c
+    for i in $(seq 1 300); do
+        echo "${i}" > ${links}/a/f${i}
+        ln ${links}/a/f${i} ${links}/a/b/g${i}
+        ln ${links}/a/f${i} ${links}/c/h${i}
+    done
+    for opts in "" "--link-memory=1" "--threads=4" "--threads=4 --unordered"
+    do
+        # Unordered scans may count any link of a file, so only the total of
+        # theirs is compared
+        case "${opts}" in
+            *--unordered*) flags="-d0" ;;
+            *) flags="-a" ;;
+        esac
+        (ulimit -n 256; ./du ${flags} ${opts} ${links}) | sort > output.txt
+        du ${flags} ${links} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "links ${opts}" "${pmsg}"
+        cat diff.txt
+    done
+    rm -rf ${links}
+
+    echo
+    echo "Running testcases with approximate hard links..."
+    for dir in ./tests/* ; do
+        ./du -a --approx-links=1000 ${dir} 2> /dev/null | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with threads..."
+    for dir in ./tests/* ; do
+        ./du -a --threads=4 ${dir} | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with unordered threads..."
+    for dir in ./tests/* ; do
+        ./du -a --threads=4 --unordered ${dir} | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with NUL-terminated output..."
+    for dir in ./tests/* ; do
+        ./du -a -0 ${dir} | tr '\0' '\n' | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with escaped file names..."
+    # Quoted as a POSIX shell reads them back: a space or a quote in single
+    # quotes, control characters and bytes that are not UTF-8 as $'...'
+    tree=$(mktemp -d)
+    touch "${tree}/a b" "${tree}/it's" "${tree}/new"$'\n'"line" \
+        "${tree}/e"$'\x85'"z" "${tree}/caf"$'\xc3\xa9'
+    ./du -a --escape ${tree} | cut -f 2 | LC_ALL=C sort > output.txt
+    printf '%s\n' "${tree}" "${tree}/caf"$'\xc3\xa9' "'${tree}/a b'" \
+        "'${tree}/it'\\''s'" "\$'${tree}/new\\nline'" \
+        "\$'${tree}/e\\205z'" | LC_ALL=C sort > expected.txt
+    rm -rf ${tree}
+
+    diff output.txt expected.txt > diff.txt
+    if [ $? -eq 0 ]; then
+        pmsg="PASS"
+        passed=$((passed + 1))
+    else
+        pmsg="FAIL"
+        failed=$((failed + 1))
+    fi
+    [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+    printf "${rowcolor}%-50s %-5s${RESET}\n" "escape" "${pmsg}"
+    cat diff.txt
+
+    echo
+    echo "Running testcases through a query server..."
+    for dir in ./tests/* ; do
+        rm -f du.sock
+        ./du -a --serve=du.sock ${dir} > /dev/null &
+        server=$!
+        until ./du --ask=du.sock INFO > /dev/null 2>&1; do
+            sleep 0.1
+        done
+        ./du --ask=du.sock 'LIST -1' | sort > output.txt
+        kill ${server}
+        wait ${server}
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with Prometheus i-node gauges..."
+    for dir in ./tests/* ; do
+        ./du -a --format=prometheus --output=du.prom ${dir}
+        sed -n 's/^du_inodes{path="\(.*\)"} \(.*\)$/\2\t\1/p' du.prom | sort > output.txt
+        rm -f du.prom
+        du -a --inodes ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with roots listed on standard input..."
+    for dir in ./tests/* ; do
+        find ${dir} -mindepth 1 -maxdepth 1 -print0 | sort -z > roots.txt
+        ./du -a --files0-from=- < roots.txt | sort > output.txt
+        du -a --files0-from=roots.txt | sort > expected.txt
+        rm -f roots.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with overlapping roots listed on standard input..."
+    for dir in ./tests/* ; do
+        find ${dir} -maxdepth 1 -print0 | sort -z > roots.txt
+        ./du -a --files0-from=- < roots.txt | sort > output.txt
+        du -a --files0-from=roots.txt | sort > expected.txt
+        rm -f roots.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with a polling watch..."
+    for dir in ./tests/* ; do
+        ./du -a --watch=60 ${dir} > watch.txt &
+        watcher=$!
+        until grep -q '^$' watch.txt; do
+            sleep 0.1
+        done
+        kill ${watcher}
+        wait ${watcher}
+        sed '/^$/,$d' watch.txt | sort > output.txt
+        rm -f watch.txt
+        du -a ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with estimates..."
+    # Subdirectories without subdirectories of their own are counted exactly
+    # by a single probe, so the estimates are exact with a half-width of 0
+    tree=$(mktemp -d)
+    for d in 1 2 3; do
+        mkdir ${tree}/d${d}
+        for f in $(seq 1 ${d}); do
+            head -c $((d * 5000)) /dev/zero > ${tree}/d${d}/f${f}
+        done
+    done
+    echo r > ${tree}/r
+    ./du --estimate ${tree} | sort > output.txt
+    du -d 1 ${tree} | awk -F '\t' '{ printf "%s\t\302\2610\t%s\n", $1, $2 }' |
+        sort > expected.txt
+    rm -rf ${tree}
+
+    diff output.txt expected.txt > diff.txt
+    if [ $? -eq 0 ]; then
+        pmsg="PASS"
+        passed=$((passed + 1))
+    else
+        pmsg="FAIL"
+        failed=$((failed + 1))
+    fi
+    [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+    printf "${rowcolor}%-50s %-5s${RESET}\n" "estimate" "${pmsg}"
+    cat diff.txt
+
+    echo
+    echo "Running testcases with watch sweeps..."
+    # A file is written after the first scan and a subtree removed after the
+    # first sweep, so the next two batches hold the changes GNU du's
+    # listings show
+    tree=$(mktemp -d)
+    mkdir -p ${tree}/a ${tree}/b/s
+    echo a > ${tree}/a/f
+    echo b > ${tree}/b/s/g
+    changes='NR == FNR { old[$2] = $1; next }
+        { new[$2] = $1 } old[$2] != $1
+        END { for (p in old) if (!(p in new)) printf "-\t%s\n", p }'
+    du -a ${tree} > before.txt
+    ./du -a --watch=1 ${tree} > watch.txt &
+    watcher=$!
+    until [ "$(grep -c '^$' watch.txt)" -ge 1 ]; do
+        sleep 0.1
+    done
+    head -c 65536 /dev/zero > ${tree}/a/new
+    du -a ${tree} > written.txt
+    until [ "$(grep -c '^$' watch.txt)" -ge 2 ]; do
+        sleep 0.1
+    done
+    rm -rf ${tree}/b
+    du -a ${tree} > removed.txt
+    until [ "$(grep -c '^$' watch.txt)" -ge 3 ]; do
+        sleep 0.1
+    done
+    kill ${watcher}
+    wait ${watcher}
+    awk -F '\t' "${changes}" before.txt written.txt | sort > written.exp
+    awk -F '\t' "${changes}" written.txt removed.txt | sort > removed.exp
+
+    batch=2
+    for change in written removed; do
+        awk -v n=${batch} 'BEGIN { RS = "" } NR == n' watch.txt |
+            sort > output.txt
+        cp ${change}.exp expected.txt
+        batch=$((batch + 1))
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "watch ${change}" "${pmsg}"
+        cat diff.txt
+    done
+    rm -rf ${tree} watch.txt before.txt written.* removed.*
+
+    echo
+    echo "Running testcases counting every hard link..."
+    for dir in ./tests/* ; do
+        ./du -a -l ${dir} | sort > output.txt
+        du -a -l ${dir} | sort > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases following symbolic links..."
+    for dir in ./tests/* ; do
+        {
+            ./du -a -L ${dir} | sort
+            ./du -a -L -l ${dir} | sort
+            for link in $(find ${dir} -type l | sort); do
+                ./du -a -H ${link}
+            done
+        } > output.txt
+        {
+            du -a -L ${dir} | sort
+            du -a -L -l ${dir} | sort
+            for link in $(find ${dir} -type l | sort); do
+                du -a -H ${link}
+            done
+        } > expected.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    echo
+    echo "Running testcases with progress reports..."
+    progress_line="^Progress: [0-9]+ entries, [0-9]+\.[0-9] [KMGTPE]iB"
+    progress_line+=" in [0-9]+ s \([0-9]+ entries/s\)(, reading '.*')?\.$"
+    for dir in ./tests/* ; do
+        ./du -a --progress ${dir} 2> progress.txt | sort > output.txt
+        du -a ${dir} | sort > expected.txt
+        # Any report on standard error must be a well-formed progress line
+        grep -Ev "${progress_line}" progress.txt >> output.txt
+        rm -f progress.txt
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "$(basename "${dir}")" "${pmsg}"
+        cat diff.txt
+    done
+
+    # SIGUSR1 asks a scan without --progress for one report; the throttle
+    # keeps the scan running long enough to take it
+    tree=$(mktemp -d)
+    mkdir ${tree}/sub
+    for i in $(seq 1 20); do
+        echo ${i} > ${tree}/sub/file${i}
+    done
+    ./du -a --max-ops-per-sec=10 ${tree} > /dev/null 2> progress.txt &
+    scanner=$!
+    sleep 1
+    kill -USR1 ${scanner}
+    wait ${scanner}
+    echo "status $?" > output.txt
+    grep -Ec "${progress_line}" progress.txt >> output.txt
+    wc -l < progress.txt >> output.txt
+    printf "status 0\n1\n1\n" > expected.txt
+    rm -rf ${tree} progress.txt
+
+    diff output.txt expected.txt > diff.txt
+    if [ $? -eq 0 ]; then
+        pmsg="PASS"
+        passed=$((passed + 1))
+    else
+        pmsg="FAIL"
+        failed=$((failed + 1))
+    fi
+    [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+    printf "${rowcolor}%-50s %-5s${RESET}\n" "report on SIGUSR1" "${pmsg}"
+    cat diff.txt
+
+    echo
+    echo "Running testcases with throttled scans..."
+    # 101 entries in 11 directories: each limit below holds the scan for
+    # about two seconds, so one that finishes within a second is not applied
+    tree=$(mktemp -d)
+    for i in $(seq 1 10); do
+        mkdir ${tree}/dir${i}
+        for j in $(seq 1 9); do
+            echo ${j} > ${tree}/dir${i}/file${j}
+        done
+    done
+    du -a ${tree} | sort > expected.txt
+    echo "at least 1000 ms" >> expected.txt
+    for limit in "--max-ops-per-sec=50" "--max-dirs-per-sec=5" \
+                 "--max-ops-per-sec=50 --adaptive-throttle"; do
+        start=$(date +%s%N)
+        ./du -a ${limit} ${tree} | sort > output.txt
+        elapsed=$((($(date +%s%N) - start) / 1000000))
+        if [ ${elapsed} -ge 1000 ]; then
+            echo "at least 1000 ms" >> output.txt
+        else
+            echo "${elapsed} ms" >> output.txt
+        fi
+
+        diff output.txt expected.txt > diff.txt
+        if [ $? -eq 0 ]; then
+            pmsg="PASS"
+            passed=$((passed + 1))
+        else
+            pmsg="FAIL"
+            failed=$((failed + 1))
+        fi
+        [ "${pmsg}" = "PASS" ] && rowcolor=${GREEN} || rowcolor=${RED}
+        printf "${rowcolor}%-50s %-5s${RESET}\n" "${limit}" "${pmsg}"
+        cat diff.txt
+    done
+    rm -rf ${tree}
 else
     echo "${YELLOW}Skipped: no testcases found in './tests'${RESET}"
 fi
@@ -0,0 +1,725 @@
+/**
+ * @file   server.c
+ *
+ * @brief  Query server over a Unix socket. A scanner thread rescans the tree
+ *         into an in-memory index on a schedule and swaps it in whole, while
+ *         the serving thread multiplexes clients with `poll` and answers each
+ *         request from the current index, without touching the filesystem.
+ *         Responses are queued per client and written as each socket drains,
+ *         so a slow reader never holds up the others.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "server.h"
+
+#include <errno.h>      // errno, EADDRINUSE, EAGAIN, EINTR, ENAMETOOLONG,
+                        // EPIPE, EWOULDBLOCK
+#include <fcntl.h>      // fcntl, F_GETFL, F_SETFL, O_NONBLOCK
+#include <poll.h>       // poll, pollfd, POLLIN, POLLOUT
+#include <pthread.h>    // pthread_create, pthread_mutex_t, pthread_cond_t
+#include <stdarg.h>     // va_list, va_start, va_end
+#include <stdio.h>      // fclose, fwrite, open_memstream, vsnprintf
+#include <stdlib.h>     // calloc, free, strtol
+#include <string.h>     // memchr, memmove, strchr, strcmp, strcpy, strlen
+#include <sys/socket.h> // accept, bind, connect, listen, recv, send, socket
+#include <sys/stat.h>   // lstat, S_ISSOCK
+#include <sys/un.h>     // sockaddr_un
+#include <time.h>       // clock_gettime
+#include <unistd.h>     // close, unlink
+
+#include "index.h"
+#include "quote.h"
+
+enum {
+  kBacklog = 64,
+  kPollMillis = 500,  // longest wait before checking `stop`
+  kRequestMax = 4096,  // bytes, including the newline
+};
+
+/**
+ * @brief A complete scan, encoded as an index.
+ */
+typedef struct Snapshot {
+  DynamicArray* bytes;
+  DuIndex index;
+  struct timespec taken;  // CLOCK_MONOTONIC time the scan ended
+  double duration;        // seconds the scan took
+} Snapshot;
+
+/**
+ * @brief A connected client, with the part of a request read so far and the
+ *        responses not yet written. Requests are only read once the
+ *        responses to earlier ones are out, so neither buffer grows while
+ *        the client does not read.
+ */
+typedef struct Client {
+  int fd;
+  size_t len;
+  char request[kRequestMax];
+  DynamicArray* out;  // responses queued
+  size_t sent;        // bytes of `out` already written
+  int closing;        // drop the client once `out` is written
+} Client;
+
+typedef struct Server {
+  const DuServeOptions* opts;
+  const char* rootpath;
+  pthread_mutex_t lock;    // guards the fields below
+  pthread_cond_t wake;     // signalled when `stopping` is set
+  Snapshot* current;       // NULL until the first scan completes
+  unsigned long generation;  // scans swapped in so far
+  int stopping;
+} Server;
+
+/**
+ * @brief What a scan of the scanner thread hands its callbacks.
+ */
+typedef struct ScanContext {
+  Server* server;
+  DuTree* tree;
+} ScanContext;
+
+static void* ScanLoop(void* arg);
+static Snapshot* TakeSnapshot(Server* server);
+static int AddEntry(const DuEntry* entry, void* ctx);
+static void ForwardError(const char* path, DuOp op, int errnum, void* ctx);
+static void FreeSnapshot(Snapshot* snapshot);
+static int Listen(const char* path);
+static Client* Accept(int listener);
+static void FreeClient(Client* client);
+static int Receive(Server* server, Client* client);
+static int Flush(Client* client);
+static int Answer(Server* server, Client* client, char* line);
+static void Respond(const Snapshot* snapshot, unsigned long generation,
+                    char* line, DynamicArray* out, size_t start);
+static int AppendEntry(const DuEntry* entry, void* out);
+static int AppendPath(DynamicArray* out, long long size, const char* path);
+static int Appendf(DynamicArray* out, const char* format, ...);
+static char* Split(char* word);
+static int SendAll(int fd, const char* data, size_t len);
+static double Since(const struct timespec* start);
+
+/**
+ * @brief Scans `rootpath` and answers queries about it on a Unix socket
+ *        until `opts->stop` is set, rescanning every `opts->refresh`
+ *        seconds.
+ *
+ * Queries are answered from the last complete scan; a scan that fails
+ * leaves the previous one in place.
+ *
+ * @param rootpath The path to the directory or file to scan.
+ * @param opts     Socket, schedule and scan options.
+ *
+ * @return Returns 0 once stopped, or -1 with errno set if the socket could
+ *         not be set up.
+ */
+int DuServe(const char* rootpath, const DuServeOptions* opts) {
+  Server server = {.opts = opts, .rootpath = rootpath};
+
+  int listener = Listen(opts->socket_path);
+  if (listener < 0) {
+    return -1;
+  }
+
+  DynamicArray* clients = InitDynamicArray(8, sizeof(Client*));
+  DynamicArray* polls = InitDynamicArray(8, sizeof(struct pollfd));
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t scanner;
+  int status = 0;
+  if (!clients || !polls) {
+    errno = ENOMEM;
+    status = -1;
+  } else if ((errno = pthread_create(&scanner, NULL, ScanLoop, &server))) {
+    status = -1;
+  }
+
+  while (status == 0 && !(opts->stop && *opts->stop)) {
+    if (ReserveDynamicArray(polls, clients->len + 1, sizeof(struct pollfd)) <
+        0) {
+      break;
+    }
+
+    struct pollfd* fds = (struct pollfd*)polls->data;
+    Client** list = (Client**)clients->data;
+    fds[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+    for (size_t i = 0; i < clients->len; i++) {
+      int pending = list[i]->sent < list[i]->out->len;
+      fds[i + 1] = (struct pollfd){.fd = list[i]->fd,
+                                   .events = pending ? POLLOUT : POLLIN};
+    }
+
+    size_t count = clients->len;
+    if (poll(fds, count + 1, kPollMillis) <= 0) {
+      continue;
+    }
+
+    // From the back, so the client moved in place of a closed one is done
+    for (size_t i = count; i-- > 0;) {
+      short revents = fds[i + 1].revents;
+      if (!revents) {
+        continue;
+      }
+      int status = (fds[i + 1].events & POLLOUT) ? Flush(list[i])
+                                                 : Receive(&server, list[i]);
+      if (status < 0) {
+        FreeClient(list[i]);
+        list[i] = list[--clients->len];
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      Client* client = Accept(listener);
+      if (client && ReserveDynamicArray(clients, 1, sizeof(Client*)) < 0) {
+        FreeClient(client);
+        client = NULL;
+      }
+      if (client) {
+        ((Client**)clients->data)[clients->len++] = client;
+      }
+    }
+  }
+
+  if (clients && polls && status == 0) {
+    pthread_mutex_lock(&server.lock);
+    __atomic_store_n(&server.stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&server.wake);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(scanner, NULL);
+  }
+
+  if (clients) {
+    Client** list = (Client**)clients->data;
+    for (size_t i = 0; i < clients->len; i++) {
+      FreeClient(list[i]);
+    }
+  }
+  FreeDynamicArray(clients);
+  FreeDynamicArray(polls);
+  close(listener);
+  unlink(opts->socket_path);
+
+  FreeSnapshot(server.current);
+  pthread_cond_destroy(&server.wake);
+  pthread_mutex_destroy(&server.lock);
+  return status;
+}
+
+/**
+ * @brief Sends one request to a server and copies the response to a stream.
+ *
+ * @param socket_path Socket the server listens on.
+ * @param request     Request line, without the newline.
+ * @param stream      Stream receiving the response, without the empty line
+ *                    that ends it.
+ *
+ * @return Returns 0 on success, 1 if the server answered with an error, or
+ *         -1 with errno set if it could not be reached.
+ */
+int DuServeAsk(const char* socket_path, const char* request, FILE* stream) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      SendAll(fd, request, strlen(request)) < 0 || SendAll(fd, "\n", 1) < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  // The response ends at its first empty line, as no line is ever empty
+  char buf[kRequestMax];
+  char last[2] = {'\n', '\0'};  // the last two bytes received
+  int first = -1;               // first byte of the response
+  for (;;) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      int saved = n < 0 ? errno : EPIPE;
+      close(fd);
+      errno = saved;
+      return -1;
+    }
+
+    for (ssize_t i = 0; i < n; i++) {
+      if (first < 0) {
+        first = (unsigned char)buf[i];
+      }
+      if (buf[i] == '\n' && last[1] == '\n') {
+        fwrite(buf, 1, (size_t)i, stream);
+        close(fd);
+        return first == 'E' ? 1 : 0;
+      }
+      last[0] = last[1];
+      last[1] = buf[i];
+    }
+    fwrite(buf, 1, (size_t)n, stream);
+  }
+}
+
+/**
+ * @brief Scanner thread: scans, swaps the new snapshot in, and waits for
+ *        the next refresh or for the server to stop.
+ */
+static void* ScanLoop(void* arg) {
+  Server* server = (Server*)arg;
+  double refresh = server->opts->refresh;
+
+  for (;;) {
+    Snapshot* fresh = TakeSnapshot(server);
+
+    pthread_mutex_lock(&server->lock);
+    Snapshot* stale = NULL;
+    if (fresh) {
+      stale = server->current;
+      server->current = fresh;
+      server->generation++;
+    }
+
+    if (refresh > 0) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      double whole = (double)(long)refresh;
+      deadline.tv_sec += (time_t)whole;
+      deadline.tv_nsec += (long)((refresh - whole) * 1e9);
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (!server->stopping &&
+             pthread_cond_timedwait(&server->wake, &server->lock,
+                                    &deadline) != ETIMEDOUT) {
+      }
+    }
+    int done = server->stopping || refresh <= 0;
+    pthread_mutex_unlock(&server->lock);
+
+    // Queries hold the lock, so none can still be reading the old snapshot
+    FreeSnapshot(stale);
+    if (done) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * @brief Scans the tree into a new snapshot.
+ *
+ * @return Returns the snapshot, or NULL if the scan failed or was stopped.
+ */
+static Snapshot* TakeSnapshot(Server* server) {
+  const DuOptions* scan = server->opts->scan;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ScanContext context = {server, DuTreeCreate()};
+  Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+  if (!context.tree || !snapshot) {
+    ForwardError(server->rootpath, kDuOpAlloc, ENOMEM, &context);
+    DuTreeFree(context.tree);
+    free(snapshot);
+    return NULL;
+  }
+
+  DuOptions opts = *scan;
+  opts.visit = AddEntry;
+  opts.on_error = ForwardError;
+  opts.ctx = &context;
+  if (du(server->rootpath, &opts, NULL) != 0 ||
+      !(snapshot->bytes = DuTreeSerialize(context.tree)) ||
+      DuIndexView(&snapshot->index, snapshot->bytes->data,
+                  snapshot->bytes->len) < 0) {
+    DuTreeFree(context.tree);
+    FreeSnapshot(snapshot);
+    return NULL;
+  }
+  DuTreeFree(context.tree);
+
+  clock_gettime(CLOCK_MONOTONIC, &snapshot->taken);
+  snapshot->duration = Since(&start);
+  return snapshot;
+}
+
+/**
+ * @brief Visitor adding each scanned entry to the tree, and stopping the
+ *        scan once the server is stopping.
+ */
+static int AddEntry(const DuEntry* entry, void* ctx) {
+  ScanContext* context = (ScanContext*)ctx;
+  if (__atomic_load_n(&context->server->stopping, __ATOMIC_RELAXED)) {
+    return 1;
+  }
+  return DuTreeAdd(entry, context->tree);
+}
+
+/**
+ * @brief Hands scan failures to the error callback of the caller's options.
+ */
+static void ForwardError(const char* path, DuOp op, int errnum, void* ctx) {
+  const DuOptions* scan = ((ScanContext*)ctx)->server->opts->scan;
+  if (scan->on_error) {
+    scan->on_error(path, op, errnum, scan->ctx);
+  }
+}
+
+/**
+ * @brief Frees a snapshot.
+ *
+ * @param snapshot Snapshot to free, may be NULL.
+ */
+static void FreeSnapshot(Snapshot* snapshot) {
+  if (!snapshot) {
+    return;
+  }
+  FreeDynamicArray(snapshot->bytes);
+  free(snapshot);
+}
+
+/**
+ * @brief Creates the listening socket. A socket file left behind by a
+ *        server that is gone is replaced; one still in use is not.
+ *
+ * @return Returns the socket, or -1 with errno set.
+ */
+static int Listen(const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (lstat(path, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode)) {
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      close(fd);
+      errno = EADDRINUSE;
+      return -1;
+    }
+    unlink(path);
+  }
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, kBacklog) < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Accepts a client on a non-blocking socket.
+ *
+ * @return Returns the client, or NULL if it could not be accepted.
+ */
+static Client* Accept(int listener) {
+  int fd = accept(listener, NULL, NULL);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  Client* client = calloc(1, sizeof(Client));
+  int flags = fcntl(fd, F_GETFL);
+  if (!client || flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      !(client->out = InitDynamicArray(256, 1))) {
+    close(fd);
+    free(client);
+    return NULL;
+  }
+  client->fd = fd;
+  return client;
+}
+
+/**
+ * @brief Disconnects a client and frees it.
+ */
+static void FreeClient(Client* client) {
+  close(client->fd);
+  FreeDynamicArray(client->out);
+  free(client);
+}
+
+/**
+ * @brief Reads what a client sent and queues the answer to every complete
+ *        request.
+ *
+ * @return Returns 0 while the client stays connected, or -1 once it is gone
+ *         or must be dropped.
+ */
+static int Receive(Server* server, Client* client) {
+  ssize_t n = recv(client->fd, client->request + client->len,
+                   kRequestMax - client->len, 0);
+  if (n <= 0) {
+    return (n < 0 && errno == EINTR) ? 0 : -1;
+  }
+  client->len += (size_t)n;
+
+  char* newline;
+  while ((newline = memchr(client->request, '\n', client->len))) {
+    *newline = '\0';
+    if (newline > client->request && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+    if (Answer(server, client, client->request) < 0) {
+      return -1;
+    }
+
+    size_t used = (size_t)(newline + 1 - client->request);
+    client->len -= used;
+    memmove(client->request, newline + 1, client->len);
+  }
+
+  if (client->len == kRequestMax) {
+    client->closing = 1;
+    if (Appendf(client->out, "ERR request too long\n\n") < 0) {
+      return -1;
+    }
+  }
+  return Flush(client);
+}
+
+/**
+ * @brief Writes as much of a client's queued responses as its socket takes
+ *        without blocking.
+ *
+ * @return Returns 0 while the client stays connected, or -1 once it is gone
+ *         or must be dropped.
+ */
+static int Flush(Client* client) {
+  DynamicArray* out = client->out;
+  while (client->sent < out->len) {
+    ssize_t n = send(client->fd, (const char*)out->data + client->sent,
+                     out->len - client->sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    client->sent += (size_t)n;
+  }
+
+  out->len = 0;
+  client->sent = 0;
+  return client->closing ? -1 : 0;
+}
+
+/**
+ * @brief Queues the answer to one request. The response is built while
+ *        holding the lock, and written once the lock is released, so a slow
+ *        client never delays the next snapshot.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int Answer(Server* server, Client* client, char* line) {
+  DynamicArray* out = client->out;
+  size_t start = out->len;
+
+  pthread_mutex_lock(&server->lock);
+  if (server->current) {
+    Respond(server->current, server->generation, line, out, start);
+  } else {
+    Appendf(out, "ERR scanning\n");
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  return Appendf(out, "\n");
+}
+
+/**
+ * @brief Builds the response to a request from a snapshot.
+ *
+ * @param snapshot   Snapshot to answer from.
+ * @param generation Number of the snapshot.
+ * @param line       Request, modified in place.
+ * @param out        Buffer the response is appended to.
+ * @param start      Length of `out` before the response, to which it is
+ *                   cut back if the response fails.
+ */
+static void Respond(const Snapshot* snapshot, unsigned long generation,
+                    char* line, DynamicArray* out, size_t start) {
+  const DuIndex* index = &snapshot->index;
+  char* arg = Split(line);
+
+  if (strcmp(line, "INFO") == 0) {
+    Appendf(out,
+            "entries %llu\nage %.3f\nduration %.3f\ngeneration %lu\n",
+            (unsigned long long)index->header->node_count,
+            Since(&snapshot->taken), snapshot->duration, generation);
+    return;
+  }
+
+  // TOP and LIST take a number before the path
+  long number = 0;
+  char* path = arg;
+  int counted = strcmp(line, "TOP") == 0 || strcmp(line, "LIST") == 0;
+  if (counted) {
+    char* end = arg;
+    if (arg) {
+      path = Split(arg);
+      number = strtol(arg, &end, 10);
+    }
+    if (end == arg || *end != '\0' ||
+        (strcmp(line, "TOP") == 0 ? number < 0 : number < -1)) {
+      Appendf(out, "ERR bad count\n");
+      return;
+    }
+  } else if (strcmp(line, "SIZE") != 0) {
+    Appendf(out, "ERR unknown request\n");
+    return;
+  }
+
+  char root[4096];
+  int64_t node = 0;
+  if (!path) {
+    DuIndexName(index, 0, root, sizeof(root));
+    path = root;
+  } else if ((node = DuIndexLookup(index, path)) < 0) {
+    Appendf(out, "ERR not found\n");
+    return;
+  }
+
+  int status = 0;
+  if (strcmp(line, "SIZE") == 0) {
+    status = AppendPath(out, (long long)index->nodes[node].disk_usage, path);
+  } else if (strcmp(line, "TOP") == 0) {
+    status = DuIndexTop(index, (uint32_t)node, path, (size_t)number,
+                        AppendEntry, out);
+  } else {
+    status = DuIndexWalk(index, (uint32_t)node, path, (int)number,
+                         AppendEntry, out);
+  }
+
+  if (status != 0) {
+    out->len = start;
+    Appendf(out, "ERR failed\n");
+  }
+}
+
+/**
+ * @brief Visitor appending an entry to a response.
+ */
+static int AppendEntry(const DuEntry* entry, void* out) {
+  return AppendPath((DynamicArray*)out, (long long)entry->disk_usage,
+                    entry->path) < 0;
+}
+
+/**
+ * @brief Appends a `SIZE<TAB>PATH` line, shell-quoting the path as
+ *        `--escape` does if it needs it, so that no path can end a line, or
+ *        the response, early.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int AppendPath(DynamicArray* out, long long size, const char* path) {
+  size_t len = strlen(path);
+  if (len > 0 && DuQuoteSafeSpan(path, len) == len) {
+    return Appendf(out, "%lld\t%s\n", size, path);
+  }
+
+  char* quoted = NULL;
+  size_t quoted_len = 0;
+  FILE* stream = open_memstream(&quoted, &quoted_len);
+  if (!stream) {
+    return -1;
+  }
+  int failed = DuQuoteShell(path, stream) != 0;
+  if (fclose(stream) != 0 || failed) {
+    free(quoted);
+    return -1;
+  }
+
+  int status = Appendf(out, "%lld\t%s\n", size, quoted);
+  free(quoted);
+  return status;
+}
+
+/**
+ * @brief Appends formatted text to a buffer.
+ *
+ * @return Returns 0 on success, or -1 if allocation fails.
+ */
+static int Appendf(DynamicArray* out, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (len < 0 || ReserveDynamicArray(out, (size_t)len + 1, 1) < 0) {
+    return -1;
+  }
+
+  va_start(args, format);
+  vsnprintf((char*)out->data + out->len, (size_t)len + 1, format, args);
+  va_end(args);
+  out->len += (size_t)len;
+  return 0;
+}
+
+/**
+ * @brief Ends a word at its first space.
+ *
+ * @return Returns what follows the space, or NULL if there is none.
+ */
+static char* Split(char* word) {
+  char* space = strchr(word, ' ');
+  if (!space) {
+    return NULL;
+  }
+  *space = '\0';
+  return space + 1;
+}
+
+/**
+ * @brief Writes all of a buffer to a socket.
+ *
+ * @return Returns 0 on success, or -1 with errno set.
+ */
+static int SendAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Returns the seconds elapsed since a CLOCK_MONOTONIC time.
+ */
+static double Since(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,43 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <signal.h>     // sig_atomic_t
+#include <stdio.h>      // FILE
+
+#include "libdu.h"
+
+/**
+ * Query server. A tree is scanned into an in-memory index, rescanned on a
+ * schedule, and queried over a Unix stream socket with a line protocol. Each
+ * request is one line, and each response is zero or more lines followed by
+ * an empty line:
+ *
+ *   SIZE [PATH]          the total of PATH, as `SIZE<TAB>PATH`
+ *   TOP N [PATH]         the N largest entries below PATH, largest first
+ *   LIST DEPTH [PATH]    the subtree of PATH in post-order, DEPTH levels deep
+ *                        or entirely if DEPTH is -1
+ *   INFO                 the scan being served: `entries N`, `age SECONDS`,
+ *                        `duration SECONDS` and `generation N`
+ *
+ * PATH defaults to the scanned root. Paths in responses are shell-quoted
+ * when they need it, as `--escape` writes them, so a newline in a name cannot
+ * end a response early. Failed requests are answered with a single
+ * `ERR <reason>` line, which is also the answer to every query until the
+ * first scan completes.
+ */
+
+typedef struct DuServeOptions {
+  const char *socket_path;
+  double refresh;     // seconds from the end of a scan to the next one, 0 to
+                      // scan only once
+  const DuOptions *scan;  // options of each scan; the visitor is replaced,
+                          // failures go to its error callback
+  const volatile sig_atomic_t *stop;  // serving ends once this is set, may
+                                      // be NULL
+} DuServeOptions;
+
+// Server Functions
+int DuServe(const char *rootpath, const DuServeOptions *opts);
+int DuServeAsk(const char *socket_path, const char *request, FILE *stream);
+
+#endif  // SERVER_H_
@@ -0,0 +1,151 @@
+/**
+ * @file   setbench.c
+ *
+ * @brief  Microbenchmark of the concurrent inode set from 1 to 64 threads.
+ *         Each thread inserts its share of the keys, then inserts the share
+ *         of another thread again, as a multi-threaded scan does with new and
+ *         repeated hard links.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include <pthread.h>    // pthread_create, pthread_join, pthread_barrier_t
+#include <stdio.h>      // printf, fprintf
+#include <stdlib.h>     // EXIT_FAILURE, EXIT_SUCCESS, strtol
+#include <time.h>       // clock_gettime
+
+#include "inodeset.h"
+
+enum {
+  kDefaultKeys = 1 << 21,
+  kMaxThreads = 64,
+  kDevices = 4,
+};
+
+typedef struct Bench {
+  DuInodeSet* set;
+  pthread_barrier_t start;
+  long keys;
+  int threads;
+} Bench;
+
+typedef struct Worker {
+  Bench* bench;
+  pthread_t thread;
+  int id;
+  long inserted;  // keys this thread was told it inserted
+  int failed;
+} Worker;
+
+static void* Run(void* arg);
+static void InsertShare(Worker* worker, int share);
+static double Now(void);
+
+/**
+ * @brief Times the inserts of `KEYS` keys (default kDefaultKeys) into a fresh
+ *        set with 1, 2, 4 and up to kMaxThreads threads, printing the
+ *        throughput and speedup over one thread for each.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments.
+ *
+ * @return Returns EXIT_SUCCESS, or EXIT_FAILURE on invalid arguments, on a
+ *         failure to allocate or start threads, or if the keys reported
+ *         inserted do not add up to `KEYS`.
+ */
+int main(int argc, char* argv[]) {
+  long keys = argc > 1 ? strtol(argv[1], NULL, 10) : kDefaultKeys;
+  if (argc > 2 || keys <= 0) {
+    fprintf(stderr, "Usage: %s [KEYS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("%-8s %12s %12s %8s\n", "threads", "seconds", "Mops/s", "speedup");
+  double base = 0;
+  for (int threads = 1; threads <= kMaxThreads; threads *= 2) {
+    Bench bench = {.keys = keys, .threads = threads};
+    bench.set = DuInodeSetCreate();
+    if (!bench.set) {
+      fprintf(stderr, "Error: Failed to create the set.\n");
+      return EXIT_FAILURE;
+    }
+    pthread_barrier_init(&bench.start, NULL, (unsigned)threads + 1);
+
+    Worker workers[kMaxThreads] = {{0}};
+    for (int i = 0; i < threads; i++) {
+      workers[i].bench = &bench;
+      workers[i].id = i;
+      if (pthread_create(&workers[i].thread, NULL, Run, &workers[i]) != 0) {
+        fprintf(stderr, "Error: Failed to start %d threads.\n", threads);
+        return EXIT_FAILURE;
+      }
+    }
+
+    pthread_barrier_wait(&bench.start);
+    double start = Now();
+    long inserted = 0;
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+      pthread_join(workers[i].thread, NULL);
+      inserted += workers[i].inserted;
+      failed |= workers[i].failed;
+    }
+    double seconds = Now() - start;
+
+    pthread_barrier_destroy(&bench.start);
+    DuInodeSetFree(bench.set);
+
+    if (failed || inserted != keys) {
+      fprintf(stderr, "Error: %ld of %ld keys inserted with %d threads.\n",
+              inserted, keys, threads);
+      return EXIT_FAILURE;
+    }
+
+    if (threads == 1) {
+      base = seconds;
+    }
+    printf("%-8d %12.3f %12.1f %8.2f\n", threads, seconds,
+           2.0 * (double)keys / seconds / 1e6, base / seconds);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Inserts the thread's own share of the keys, then the share of the
+ *        next thread, which are mostly present by then.
+ */
+static void* Run(void* arg) {
+  Worker* worker = (Worker*)arg;
+  Bench* bench = worker->bench;
+
+  pthread_barrier_wait(&bench->start);
+  InsertShare(worker, worker->id);
+  InsertShare(worker, (worker->id + 1) % bench->threads);
+  return NULL;
+}
+
+/**
+ * @brief Inserts every key `i` with `i % threads == share`.
+ */
+static void InsertShare(Worker* worker, int share) {
+  Bench* bench = worker->bench;
+  for (long i = share; i < bench->keys; i += bench->threads) {
+    int status = DuInodeSetInsert(bench->set, (dev_t)(i % kDevices),
+                                  (ino_t)(i / kDevices));
+    if (status < 0) {
+      worker->failed = 1;
+      return;
+    }
+    worker->inserted += status;
+  }
+}
+
+/**
+ * @brief Returns a monotonic time in seconds.
+ */
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,617 @@
+/**
+ * @file   snapshot.c
+ *
+ * @brief  Scan snapshots. A `DuSnapshot` writer is a visitor that streams the
+ *         entries of a sorted scan to a file; two such files are compared
+ *         with a linear merge that only ever holds one record of each, and
+ *         the changes are ordered in a bounded heap or an external sort.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "snapshot.h"
+
+#include <errno.h>      // errno, EINVAL, EIO, ENOMEM
+#include <stdio.h>      // FILE, fopen, fclose, fflush, fgetc, fputc, fread,
+                        // fseeko, fwrite
+#include <stdlib.h>     // calloc, free, qsort
+#include <string.h>     // memcmp, memcpy, strdup, strlen
+
+#include "spill.h"
+
+enum {
+  kSnapshotPathMax = 4096,  // bytes
+  kDiffMemory = 16 << 20,   // bytes of changes sorted in memory
+};
+
+struct DuSnapshot {
+  FILE* file;
+  int writing;
+  int failed;             // errno of the first failure, 0 if none
+  char path[kSnapshotPathMax];
+  size_t path_len;
+};
+
+typedef struct Delta {
+  char* path;
+  blkcnt_t delta;  // kilobytes, positive for growth
+  uint64_t seq;    // order in which the change was met
+} Delta;
+
+/**
+ * @brief A change in the external sort, its path left in the path file.
+ */
+typedef struct SpilledDelta {
+  blkcnt_t delta;   // kilobytes, positive for growth
+  uint64_t offset;  // of the path in the path file
+  uint64_t len;     // bytes of the path
+} SpilledDelta;
+
+/**
+ * @brief The changes met by a diff: the `top` first in a heap, or all of
+ *        them in an external sort.
+ */
+typedef struct Report {
+  size_t top;
+  DynamicArray* deltas;  // of Delta, with `top`
+  uint64_t seq;          // changes met so far
+  DuSpill* spill;        // of SpilledDelta, without `top`
+  FILE* paths;           // the paths of the spilled changes, one after another
+  uint64_t offset;       // bytes written to `paths`
+} Report;
+
+static DuSnapshot* OpenFile(const char* path, const char* mode);
+static int PutVarint(FILE* file, uint64_t v);
+static int GetVarint(FILE* file, uint64_t* v);
+static int KeepDelta(Report* report, const char* path, blkcnt_t delta);
+static int VisitKept(Report* report, DuVisitFn visit, void* ctx);
+static int VisitSpilled(Report* report, DuVisitFn visit, void* ctx);
+static int CompareDeltas(const void* a, const void* b);
+static int CompareSpilled(const void* a, const void* b);
+static blkcnt_t Magnitude(blkcnt_t delta);
+
+/**
+ * @brief Creates a snapshot file for writing.
+ *
+ * @param path Path of the snapshot file.
+ *
+ * @return Returns the snapshot, or NULL on error with errno set.
+ */
+DuSnapshot* DuSnapshotCreate(const char* path) {
+  DuSnapshot* snapshot = OpenFile(path, "wb");
+  if (!snapshot) {
+    return NULL;
+  }
+
+  snapshot->writing = 1;
+  if (fwrite(DU_SNAPSHOT_MAGIC, 1, 4, snapshot->file) != 4 ||
+      fwrite(&kDuSnapshotVersion, sizeof(uint32_t), 1, snapshot->file) != 1) {
+    snapshot->failed = errno ? errno : EIO;
+  }
+  return snapshot;
+}
+
+/**
+ * @brief Visitor that appends an entry to a snapshot being written.
+ *
+ * The scan must visit siblings in name order (`DuOptions::sorted`) for the
+ * snapshot to be comparable with others.
+ *
+ * @param entry    Entry accounted by the scanner.
+ * @param snapshot Snapshot open for writing.
+ *
+ * @return Returns 0, or 1 to stop the scan if writing failed.
+ */
+int DuSnapshotAdd(const DuEntry* entry, void* snapshot) {
+  DuSnapshot* s = (DuSnapshot*)snapshot;
+  if (s->failed) {
+    return 1;
+  }
+
+  size_t len = strlen(entry->path);
+  if (len >= kSnapshotPathMax) {
+    s->failed = ENAMETOOLONG;
+    return 1;
+  }
+
+  size_t shared = 0;
+  while (shared < s->path_len && shared < len &&
+         s->path[shared] == entry->path[shared]) {
+    shared++;
+  }
+  size_t suffix = len - shared;
+
+  if (PutVarint(s->file, shared) < 0 || PutVarint(s->file, suffix) < 0 ||
+      fwrite(entry->path + shared, 1, suffix, s->file) != suffix ||
+      PutVarint(s->file, (uint64_t)entry->disk_usage) < 0) {
+    s->failed = errno ? errno : EIO;
+    return 1;
+  }
+
+  memcpy(s->path + shared, entry->path + shared, suffix);
+  s->path_len = len;
+  return 0;
+}
+
+/**
+ * @brief Opens a snapshot file for reading.
+ *
+ * @param path Path of the snapshot file.
+ *
+ * @return Returns the snapshot, or NULL on error with errno set.
+ */
+DuSnapshot* DuSnapshotOpen(const char* path) {
+  DuSnapshot* snapshot = OpenFile(path, "rb");
+  if (!snapshot) {
+    return NULL;
+  }
+
+  char magic[4];
+  uint32_t version;
+  if (fread(magic, 1, 4, snapshot->file) != 4 ||
+      memcmp(magic, DU_SNAPSHOT_MAGIC, 4) != 0 ||
+      fread(&version, sizeof(uint32_t), 1, snapshot->file) != 1 ||
+      version != kDuSnapshotVersion) {
+    DuSnapshotClose(snapshot);
+    errno = EINVAL;
+    return NULL;
+  }
+  return snapshot;
+}
+
+/**
+ * @brief Reads the next record of a snapshot.
+ *
+ * @param snapshot   Snapshot open for reading.
+ * @param path       Receives the path, valid until the next call.
+ * @param disk_usage Receives the disk usage in kilobytes.
+ *
+ * @return Returns 1 if a record was read, 0 at the end of the snapshot, or -1
+ *         if the snapshot is truncated or corrupt.
+ */
+int DuSnapshotNext(DuSnapshot* snapshot, const char** path,
+                   blkcnt_t* disk_usage) {
+  uint64_t shared;
+  uint64_t suffix;
+  uint64_t usage;
+
+  int status = GetVarint(snapshot->file, &shared);
+  if (status <= 0) {
+    return status;
+  }
+
+  if (GetVarint(snapshot->file, &suffix) <= 0 ||
+      shared > snapshot->path_len ||
+      suffix >= kSnapshotPathMax - shared ||
+      fread(snapshot->path + shared, 1, suffix, snapshot->file) != suffix ||
+      GetVarint(snapshot->file, &usage) <= 0) {
+    snapshot->failed = EINVAL;
+    return -1;
+  }
+
+  snapshot->path_len = shared + suffix;
+  snapshot->path[snapshot->path_len] = '\0';
+  *path = snapshot->path;
+  *disk_usage = (blkcnt_t)usage;
+  return 1;
+}
+
+/**
+ * @brief Closes a snapshot, flushing it if it was being written.
+ *
+ * @param snapshot Snapshot to close, may be NULL.
+ *
+ * @return Returns 0 on success, or -1 with errno set if any write failed.
+ */
+int DuSnapshotClose(DuSnapshot* snapshot) {
+  if (!snapshot) {
+    return 0;
+  }
+
+  int failed = snapshot->failed;
+  if (fclose(snapshot->file) != 0 && !failed) {
+    failed = errno ? errno : EIO;
+  }
+  int writing = snapshot->writing;
+  free(snapshot);
+
+  if (writing && failed) {
+    errno = failed;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Orders two paths the way a sorted scan visits them: post-order, with
+ *        siblings in name order.
+ *
+ * Paths are compared component by component, where the end of a component
+ * sorts before any byte. When one path is an ancestor of the other, the
+ * ancestor comes last because directories are visited after their contents.
+ *
+ * @param a First path.
+ * @param b Second path.
+ *
+ * @return Returns a negative value, zero or a positive value if `a` comes
+ *         before, together with or after `b`.
+ */
+int DuSnapshotCompare(const char* a, const char* b) {
+  size_t i = 0;
+  while (a[i] && a[i] == b[i]) {
+    i++;
+  }
+
+  unsigned char ca = (unsigned char)a[i];
+  unsigned char cb = (unsigned char)b[i];
+  if (ca == cb) {
+    return 0;
+  }
+
+  // An ancestor follows its descendants
+  if (ca == '\0' && cb == '/') {
+    return 1;
+  }
+  if (cb == '\0' && ca == '/') {
+    return -1;
+  }
+
+  // The shorter of two sibling names comes first
+  if (ca == '\0' || ca == '/') {
+    return -1;
+  }
+  if (cb == '\0' || cb == '/') {
+    return 1;
+  }
+  return (int)ca - (int)cb;
+}
+
+/**
+ * @brief Compares two snapshots and reports the entries whose disk usage
+ *        changed, largest absolute change first, and equal changes in the
+ *        order of the snapshots.
+ *
+ * Both snapshots are read once, in step. Entries present in only one of them
+ * count as growing from or shrinking to zero. With `top`, only the `top`
+ * largest changes are held; otherwise the changed paths are written to a
+ * temporary file as they are met, and the changes sorted with an external
+ * sort that keeps kDiffMemory bytes of them in memory.
+ *
+ * @param old_path Path of the earlier snapshot.
+ * @param new_path Path of the later snapshot.
+ * @param top      Number of entries to report, or 0 for every changed entry.
+ * @param visit    Visitor receiving each change, with the signed delta in
+ *                 kilobytes as `disk_usage`, depth 0 and a NULL `statbuf`.
+ * @param ctx      Passed to `visit`.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the report, or -1 on
+ *         error with errno set.
+ */
+int DuSnapshotDiff(const char* old_path, const char* new_path, size_t top,
+                   DuVisitFn visit, void* ctx) {
+  DuSnapshot* old_snapshot = DuSnapshotOpen(old_path);
+  if (!old_snapshot) {
+    return -1;
+  }
+
+  DuSnapshot* new_snapshot = DuSnapshotOpen(new_path);
+  if (!new_snapshot) {
+    DuSnapshotClose(old_snapshot);
+    return -1;
+  }
+
+  Report report = {.top = top};
+  if (top) {
+    report.deltas = InitDynamicArray(top, sizeof(Delta));
+  } else {
+    report.spill = DuSpillCreate(sizeof(SpilledDelta), kDiffMemory,
+                                 CompareSpilled);
+    report.paths = report.spill ? DuSpillTempFile() : NULL;
+  }
+  if (!report.deltas && !report.paths) {
+    int saved_errno = report.spill ? errno : ENOMEM;
+    DuSpillFree(report.spill);
+    DuSnapshotClose(old_snapshot);
+    DuSnapshotClose(new_snapshot);
+    errno = saved_errno;
+    return -1;
+  }
+
+  const char* old_entry = NULL;
+  const char* new_entry = NULL;
+  blkcnt_t old_usage = 0;
+  blkcnt_t new_usage = 0;
+  int old_status = DuSnapshotNext(old_snapshot, &old_entry, &old_usage);
+  int new_status = DuSnapshotNext(new_snapshot, &new_entry, &new_usage);
+  int status = 0;
+
+  while (old_status == 1 || new_status == 1) {
+    int cmp;
+    if (old_status != 1) {
+      cmp = 1;
+    } else if (new_status != 1) {
+      cmp = -1;
+    } else {
+      cmp = DuSnapshotCompare(old_entry, new_entry);
+    }
+
+    const char* path = (cmp < 0) ? old_entry : new_entry;
+    blkcnt_t delta = (cmp < 0)   ? -old_usage
+                     : (cmp > 0) ? new_usage
+                                 : new_usage - old_usage;
+    if (delta != 0 && KeepDelta(&report, path, delta) < 0) {
+      status = -1;
+      break;
+    }
+
+    if (cmp <= 0) {
+      old_status = DuSnapshotNext(old_snapshot, &old_entry, &old_usage);
+    }
+    if (cmp >= 0) {
+      new_status = DuSnapshotNext(new_snapshot, &new_entry, &new_usage);
+    }
+  }
+
+  if (old_status < 0 || new_status < 0) {
+    errno = EINVAL;
+    status = -1;
+  }
+  DuSnapshotClose(old_snapshot);
+  DuSnapshotClose(new_snapshot);
+
+  if (status == 0) {
+    status = top ? VisitKept(&report, visit, ctx)
+                 : VisitSpilled(&report, visit, ctx);
+  }
+
+  Delta* kept = report.deltas ? (Delta*)report.deltas->data : NULL;
+  for (size_t i = 0; kept && i < report.deltas->len; i++) {
+    free(kept[i].path);
+  }
+  FreeDynamicArray(report.deltas);
+  DuSpillFree(report.spill);
+  if (report.paths) {
+    fclose(report.paths);
+  }
+  return status;
+}
+
+/**
+ * @brief Allocates a snapshot handle around a newly opened file.
+ */
+static DuSnapshot* OpenFile(const char* path, const char* mode) {
+  DuSnapshot* snapshot = calloc(1, sizeof(DuSnapshot));
+  if (!snapshot) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  snapshot->file = fopen(path, mode);
+  if (!snapshot->file) {
+    free(snapshot);
+    return NULL;
+  }
+  return snapshot;
+}
+
+/**
+ * @brief Writes `v` as a little-endian base-128 varint.
+ *
+ * @return Returns 0 on success, or -1 on write error.
+ */
+static int PutVarint(FILE* file, uint64_t v) {
+  while (v >= 0x80) {
+    if (fputc((int)((v & 0x7f) | 0x80), file) == EOF) {
+      return -1;
+    }
+    v >>= 7;
+  }
+  return fputc((int)v, file) == EOF ? -1 : 0;
+}
+
+/**
+ * @brief Reads a varint written by `PutVarint`.
+ *
+ * @return Returns 1 if a varint was read, 0 at end of file before its first
+ *         byte, or -1 if it is truncated or too long.
+ */
+static int GetVarint(FILE* file, uint64_t* v) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = fgetc(file);
+    if (byte == EOF) {
+      return (shift == 0 && !ferror(file)) ? 0 : -1;
+    }
+
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *v = result;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Records a change. With a `top` limit, the array is kept as a heap
+ *        with the change to be reported last at its root, so only the `top`
+ *        first changes are ever held; otherwise the change is added to the
+ *        external sort and its path to the path file.
+ *
+ * @return Returns 0 on success, or -1 with errno set on error.
+ */
+static int KeepDelta(Report* report, const char* path, blkcnt_t delta) {
+  uint64_t seq = report->seq++;
+  if (!report->top) {
+    size_t len = strlen(path);
+    SpilledDelta record = {delta, report->offset, len};
+    if (fwrite(path, 1, len, report->paths) != len) {
+      return -1;
+    }
+    report->offset += len;
+    return DuSpillAdd(report->spill, &record);
+  }
+
+  DynamicArray* deltas = report->deltas;
+  size_t top = report->top;
+  Delta* heap = (Delta*)deltas->data;
+  Delta added = {NULL, delta, seq};
+
+  if (deltas->len == top) {
+    // Later changes come after equal ones held already
+    if (CompareDeltas(&added, &heap[0]) >= 0) {
+      return 0;
+    }
+
+    added.path = strdup(path);
+    if (!added.path) {
+      errno = ENOMEM;
+      return -1;
+    }
+    free(heap[0].path);
+    heap[0] = added;
+
+    // Sift the new root down
+    size_t i = 0;
+    for (;;) {
+      size_t last = i;
+      size_t left = 2 * i + 1;
+      size_t right = left + 1;
+      if (left < top && CompareDeltas(&heap[left], &heap[last]) > 0) {
+        last = left;
+      }
+      if (right < top && CompareDeltas(&heap[right], &heap[last]) > 0) {
+        last = right;
+      }
+      if (last == i) {
+        return 0;
+      }
+
+      Delta tmp = heap[i];
+      heap[i] = heap[last];
+      heap[last] = tmp;
+      i = last;
+    }
+  }
+
+  added.path = strdup(path);
+  if (!added.path || ReserveDynamicArray(deltas, 1, sizeof(Delta)) < 0) {
+    free(added.path);
+    errno = ENOMEM;
+    return -1;
+  }
+  heap = (Delta*)deltas->data;
+
+  // Sift the new leaf up
+  size_t i = deltas->len++;
+  heap[i] = added;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (CompareDeltas(&heap[parent], &heap[i]) >= 0) {
+      break;
+    }
+
+    Delta tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
+  return 0;
+}
+
+/**
+ * @brief Reports the changes held in memory, in order.
+ *
+ * @return Returns 0 on success, or 1 if the visitor stopped the report.
+ */
+static int VisitKept(Report* report, DuVisitFn visit, void* ctx) {
+  Delta* kept = (Delta*)report->deltas->data;
+  qsort(kept, report->deltas->len, sizeof(Delta), CompareDeltas);
+  for (size_t i = 0; i < report->deltas->len; i++) {
+    DuEntry entry = {
+        .path = kept[i].path,
+        .depth = 0,
+        .statbuf = NULL,
+        .disk_usage = kept[i].delta,
+    };
+    if (visit(&entry, ctx)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Reports the changes of the external sort, in order, reading each
+ *        path back from the path file.
+ *
+ * @return Returns 0 on success, 1 if the visitor stopped the report, or -1
+ *         with errno set on error.
+ */
+static int VisitSpilled(Report* report, DuVisitFn visit, void* ctx) {
+  if (fflush(report->paths) != 0 || DuSpillSort(report->spill) < 0) {
+    return -1;
+  }
+
+  char path[kSnapshotPathMax];
+  SpilledDelta record;
+  int status;
+  while ((status = DuSpillNext(report->spill, &record)) == 1) {
+    if (record.len >= kSnapshotPathMax ||
+        fseeko(report->paths, (off_t)record.offset, SEEK_SET) != 0 ||
+        fread(path, 1, record.len, report->paths) != record.len) {
+      errno = errno ? errno : EIO;
+      return -1;
+    }
+    path[record.len] = '\0';
+
+    DuEntry entry = {
+        .path = path,
+        .depth = 0,
+        .statbuf = NULL,
+        .disk_usage = record.delta,
+    };
+    if (visit(&entry, ctx)) {
+      return 1;
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief Orders changes by decreasing magnitude, then as met in the
+ *        snapshots.
+ */
+static int CompareDeltas(const void* a, const void* b) {
+  const Delta* da = (const Delta*)a;
+  const Delta* db = (const Delta*)b;
+  blkcnt_t ma = Magnitude(da->delta);
+  blkcnt_t mb = Magnitude(db->delta);
+  if (ma != mb) {
+    return (ma > mb) ? -1 : 1;
+  }
+  return (da->seq > db->seq) - (da->seq < db->seq);
+}
+
+/**
+ * @brief Orders spilled changes as `CompareDeltas` does, their offsets in
+ *        the path file following the snapshots.
+ */
+static int CompareSpilled(const void* a, const void* b) {
+  const SpilledDelta* da = (const SpilledDelta*)a;
+  const SpilledDelta* db = (const SpilledDelta*)b;
+  blkcnt_t ma = Magnitude(da->delta);
+  blkcnt_t mb = Magnitude(db->delta);
+  if (ma != mb) {
+    return (ma > mb) ? -1 : 1;
+  }
+  return (da->offset > db->offset) - (da->offset < db->offset);
+}
+
+/**
+ * @brief Returns the absolute value of a change.
+ */
+static blkcnt_t Magnitude(blkcnt_t delta) {
+  return delta < 0 ? -delta : delta;
+}
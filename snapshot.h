@@ -0,0 +1,41 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t
+
+#include "libdu.h"
+
+/**
+ * Scan snapshot. A snapshot is a stream of (path, disk usage) records written
+ * by a sorted scan, so every snapshot of the same tree lists its entries in
+ * the same order: post-order, with siblings sorted by name. Two snapshots can
+ * therefore be diffed with a single linear merge.
+ *
+ *   "DUSN" | uint32_t version | record...
+ *
+ * Each record is front-coded against the previous path: varint shared prefix
+ * length, varint suffix length, suffix bytes, varint disk usage in kilobytes.
+ * The version uses the byte order of the host that wrote the file.
+ */
+#define DU_SNAPSHOT_MAGIC "DUSN"
+
+static const uint32_t kDuSnapshotVersion = 1;
+
+/**
+ * @brief A snapshot file open for writing or for reading. Opaque.
+ */
+typedef struct DuSnapshot DuSnapshot;
+
+// Snapshot Functions
+DuSnapshot *DuSnapshotCreate(const char *path);
+int DuSnapshotAdd(const DuEntry *entry, void *snapshot);
+DuSnapshot *DuSnapshotOpen(const char *path);
+int DuSnapshotNext(DuSnapshot *snapshot, const char **path,
+                   blkcnt_t *disk_usage);
+int DuSnapshotClose(DuSnapshot *snapshot);
+int DuSnapshotCompare(const char *a, const char *b);
+int DuSnapshotDiff(const char *old_path, const char *new_path, size_t top,
+                   DuVisitFn visit, void *ctx);
+
+#endif  // SNAPSHOT_H_
@@ -0,0 +1,445 @@
+/**
+ * @file   spill.c
+ *
+ * @brief  External sort of fixed-size records under a memory budget. Full
+ *         buffers are written out as sorted runs to unlinked temporary files
+ *         and read back through a k-way merge. Runs are merged down as they
+ *         are written, so that no more than `kSpillFanIn` files are ever
+ *         open however many records are added.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "spill.h"
+
+#include <errno.h>      // errno, EINVAL, EIO, ENOMEM, ENAMETOOLONG
+#include <stdio.h>      // FILE, fdopen, fclose, fread, fwrite, snprintf
+#include <stdlib.h>     // calloc, free, getenv, malloc, mkstemp, qsort
+#include <string.h>     // memcpy
+#include <unistd.h>     // close, unlink
+
+#include "libdu.h"
+
+enum { kSpillFanIn = 64 };  // files open at once, runs and merge output
+
+/**
+ * @brief A sorted run. A run written from the buffer is of level 0, and one
+ *        merged from others is a level above the highest of them.
+ */
+typedef struct Run {
+  FILE* file;
+  unsigned level;
+} Run;
+
+/**
+ * @brief A k-way merge of sorted runs.
+ */
+typedef struct Merge {
+  Run* runs;
+  size_t count;
+  char* heads;    // current record of each run
+  size_t* heap;   // indices of the runs not yet exhausted, min-heap by head
+  size_t heap_len;
+} Merge;
+
+struct DuSpill {
+  size_t record_size;
+  size_t capacity;        // records buffered before a run is written
+  DuSpillCompare compare;
+  char* buffer;
+  size_t buffer_size;     // records allocated
+  size_t count;           // records buffered
+  size_t next;            // next buffered record to read, without runs
+  DynamicArray* runs;     // of Run, by non-increasing level
+  Merge merge;
+  int sorted;
+};
+
+static int WriteRun(DuSpill* spill);
+static int MergeTail(DuSpill* spill);
+static int MergeInit(DuSpill* spill, Merge* merge, Run* runs, size_t count);
+static int MergeNext(DuSpill* spill, Merge* merge, void* record);
+static void MergeFree(Merge* merge);
+static void SiftDown(DuSpill* spill, Merge* merge, size_t pos);
+
+/**
+ * @brief Creates an empty sort.
+ *
+ * @param record_size Size of each record in bytes.
+ * @param memory      Bytes of records to buffer before spilling a run. At
+ *                    least one record is always buffered.
+ * @param compare     Record comparator.
+ *
+ * @return Returns the sort, or NULL if allocation fails.
+ */
+DuSpill* DuSpillCreate(size_t record_size, size_t memory,
+                       DuSpillCompare compare) {
+  const size_t kInitRuns = 8;
+
+  DuSpill* spill = calloc(1, sizeof(DuSpill));
+  if (!spill) {
+    return NULL;
+  }
+
+  spill->record_size = record_size;
+  spill->capacity = memory / record_size ? memory / record_size : 1;
+  spill->compare = compare;
+  spill->runs = InitDynamicArray(kInitRuns, sizeof(Run));
+  if (!spill->runs) {
+    free(spill);
+    return NULL;
+  }
+  return spill;
+}
+
+/**
+ * @brief Adds a record, writing out the buffer as a run once it is full.
+ *
+ * @param spill  Sort, not yet sorted.
+ * @param record Record to copy.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuSpillAdd(DuSpill* spill, const void* record) {
+  if (spill->sorted) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (spill->count == spill->capacity && WriteRun(spill) < 0) {
+    return -1;
+  }
+
+  if (spill->count == spill->buffer_size) {
+    size_t size = spill->buffer_size ? spill->buffer_size * 2 : 64;
+    if (size > spill->capacity) {
+      size = spill->capacity;
+    }
+
+    char* buffer = realloc(spill->buffer, size * spill->record_size);
+    if (!buffer) {
+      errno = ENOMEM;
+      return -1;
+    }
+    spill->buffer = buffer;
+    spill->buffer_size = size;
+  }
+
+  memcpy(spill->buffer + spill->count * spill->record_size, record,
+         spill->record_size);
+  spill->count++;
+  return 0;
+}
+
+/**
+ * @brief Ends the input and prepares to read the records back in order.
+ *
+ * Without runs the buffer is sorted in place. Otherwise it is written out as
+ * a last run and released, and `DuSpillNext` merges the runs as it reads.
+ *
+ * @param spill Sort.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+int DuSpillSort(DuSpill* spill) {
+  if (spill->sorted) {
+    errno = EINVAL;
+    return -1;
+  }
+  spill->sorted = 1;
+
+  if (spill->runs->len == 0) {
+    qsort(spill->buffer, spill->count, spill->record_size, spill->compare);
+    return 0;
+  }
+
+  if (spill->count > 0 && WriteRun(spill) < 0) {
+    return -1;
+  }
+  free(spill->buffer);
+  spill->buffer = NULL;
+  spill->buffer_size = 0;
+
+  return MergeInit(spill, &spill->merge, (Run*)spill->runs->data,
+                   spill->runs->len);
+}
+
+/**
+ * @brief Reads the next record in sorted order.
+ *
+ * @param spill  Sort, after `DuSpillSort`.
+ * @param record Receives the record.
+ *
+ * @return Returns 1 if a record was read, 0 at the end, or -1 on error with
+ *         errno set.
+ */
+int DuSpillNext(DuSpill* spill, void* record) {
+  if (!spill->sorted) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (spill->runs->len > 0) {
+    return MergeNext(spill, &spill->merge, record);
+  }
+
+  if (spill->next == spill->count) {
+    return 0;
+  }
+  memcpy(record, spill->buffer + spill->next * spill->record_size,
+         spill->record_size);
+  spill->next++;
+  return 1;
+}
+
+/**
+ * @brief Frees a sort and closes, thereby deleting, its runs.
+ *
+ * @param spill Sort to free, may be NULL.
+ */
+void DuSpillFree(DuSpill* spill) {
+  if (!spill) {
+    return;
+  }
+
+  MergeFree(&spill->merge);
+  Run* runs = (Run*)spill->runs->data;
+  for (size_t i = 0; i < spill->runs->len; i++) {
+    fclose(runs[i].file);
+  }
+  FreeDynamicArray(spill->runs);
+  free(spill->buffer);
+  free(spill);
+}
+
+/**
+ * @brief Sorts the buffer and writes it out as a new run, first merging
+ *        runs down if the new one would leave no file for a merge.
+ *
+ * @param spill Sort.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int WriteRun(DuSpill* spill) {
+  if (spill->runs->len == kSpillFanIn - 1 && MergeTail(spill) < 0) {
+    return -1;
+  }
+  if (ReserveDynamicArray(spill->runs, 1, sizeof(Run)) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  FILE* run = DuSpillTempFile();
+  if (!run) {
+    return -1;
+  }
+
+  qsort(spill->buffer, spill->count, spill->record_size, spill->compare);
+  if (fwrite(spill->buffer, spill->record_size, spill->count, run) !=
+          spill->count ||
+      fflush(run) != 0) {
+    int saved_errno = errno ? errno : EIO;
+    fclose(run);
+    errno = saved_errno;
+    return -1;
+  }
+
+  Run* runs = (Run*)spill->runs->data;
+  runs[spill->runs->len++] = (Run){.file = run, .level = 0};
+  spill->count = 0;
+  return 0;
+}
+
+/**
+ * @brief Merges the runs at the end of the list, those no higher than the
+ *        next to last, into one run that takes their place.
+ *
+ * Runs are kept by non-increasing level, so this merges the lowest levels
+ * first, as a counter carries, and each record is rewritten only about once
+ * per level rather than once per merge.
+ *
+ * @param spill Sort, with at least two runs.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int MergeTail(DuSpill* spill) {
+  Run* runs = (Run*)spill->runs->data;
+  size_t len = spill->runs->len;
+  unsigned level = runs[len - 2].level;
+  size_t first = len - 2;
+  while (first > 0 && runs[first - 1].level <= level) {
+    first--;
+  }
+
+  FILE* out = DuSpillTempFile();
+  if (!out) {
+    return -1;
+  }
+
+  char* record = malloc(spill->record_size);
+  Merge merge = {0};
+  int status = -1;
+  if (record && MergeInit(spill, &merge, runs + first, len - first) == 0) {
+    while ((status = MergeNext(spill, &merge, record)) == 1) {
+      if (fwrite(record, spill->record_size, 1, out) != 1) {
+        status = -1;
+        break;
+      }
+    }
+  } else if (!record) {
+    errno = ENOMEM;
+  }
+  MergeFree(&merge);
+  free(record);
+
+  if (status < 0 || fflush(out) != 0) {
+    int saved_errno = errno ? errno : EIO;
+    fclose(out);
+    errno = saved_errno;
+    return -1;
+  }
+
+  for (size_t i = first; i < len; i++) {
+    fclose(runs[i].file);
+  }
+  runs[first] = (Run){.file = out, .level = level + 1};
+  spill->runs->len = first + 1;
+  return 0;
+}
+
+/**
+ * @brief Rewinds runs and loads the first record of each into a heap.
+ *
+ * @param spill Sort.
+ * @param merge Merge to initialize.
+ * @param runs  Runs to merge, still owned by the caller.
+ * @param count Number of runs.
+ *
+ * @return Returns 0 on success, or -1 on error with errno set.
+ */
+static int MergeInit(DuSpill* spill, Merge* merge, Run* runs, size_t count) {
+  merge->runs = runs;
+  merge->count = count;
+  merge->heads = malloc(count * spill->record_size);
+  merge->heap = malloc(count * sizeof(size_t));
+  merge->heap_len = 0;
+  if (!merge->heads || !merge->heap) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    rewind(runs[i].file);
+    if (fread(merge->heads + i * spill->record_size, spill->record_size, 1,
+              runs[i].file) == 1) {
+      merge->heap[merge->heap_len++] = i;
+    } else if (ferror(runs[i].file)) {
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  for (size_t i = merge->heap_len / 2; i-- > 0;) {
+    SiftDown(spill, merge, i);
+  }
+  return 0;
+}
+
+/**
+ * @brief Pops the smallest head of a merge and refills it from its run.
+ *
+ * @return Returns 1 if a record was read, 0 at the end, or -1 on error with
+ *         errno set.
+ */
+static int MergeNext(DuSpill* spill, Merge* merge, void* record) {
+  if (merge->heap_len == 0) {
+    return 0;
+  }
+
+  size_t run = merge->heap[0];
+  char* head = merge->heads + run * spill->record_size;
+  memcpy(record, head, spill->record_size);
+
+  if (fread(head, spill->record_size, 1, merge->runs[run].file) != 1) {
+    if (ferror(merge->runs[run].file)) {
+      errno = EIO;
+      return -1;
+    }
+    merge->heap[0] = merge->heap[--merge->heap_len];
+  }
+  SiftDown(spill, merge, 0);
+  return 1;
+}
+
+/**
+ * @brief Frees the heap of a merge. The runs are left open.
+ */
+static void MergeFree(Merge* merge) {
+  free(merge->heads);
+  free(merge->heap);
+  merge->heads = NULL;
+  merge->heap = NULL;
+  merge->heap_len = 0;
+}
+
+/**
+ * @brief Restores the heap property below `pos`.
+ */
+static void SiftDown(DuSpill* spill, Merge* merge, size_t pos) {
+  size_t* heap = merge->heap;
+  size_t size = spill->record_size;
+
+  for (;;) {
+    size_t smallest = pos;
+    for (size_t child = 2 * pos + 1; child <= 2 * pos + 2; child++) {
+      if (child < merge->heap_len &&
+          spill->compare(merge->heads + heap[child] * size,
+                         merge->heads + heap[smallest] * size) < 0) {
+        smallest = child;
+      }
+    }
+    if (smallest == pos) {
+      return;
+    }
+
+    size_t tmp = heap[pos];
+    heap[pos] = heap[smallest];
+    heap[smallest] = tmp;
+    pos = smallest;
+  }
+}
+
+/**
+ * @brief Creates an anonymous temporary file in $TMPDIR, or /tmp.
+ *
+ * @return Returns the file open for reading and writing, or NULL on error
+ *         with errno set.
+ */
+FILE* DuSpillTempFile(void) {
+  const char* dir = getenv("TMPDIR");
+  if (!dir || !*dir) {
+    dir = "/tmp";
+  }
+
+  char path[4096];
+  if (snprintf(path, sizeof(path), "%s/du-spill-XXXXXX", dir) >=
+      (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return NULL;
+  }
+  unlink(path);
+
+  FILE* file = fdopen(fd, "w+b");
+  if (!file) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+  }
+  return file;
+}
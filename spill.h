@@ -0,0 +1,32 @@
+#ifndef SPILL_H_
+#define SPILL_H_
+
+#include <stddef.h>     // size_t
+#include <stdio.h>      // FILE
+
+/**
+ * External sort of fixed-size records. Records are buffered up to a memory
+ * budget; each full buffer is sorted and written to an anonymous temporary
+ * file as a run, and the runs are merged when the records are read back. A
+ * sort that fits in its budget never touches the disk.
+ *
+ * Temporary files are created in $TMPDIR, or /tmp, and unlinked at once, so
+ * nothing is left behind if the process dies.
+ */
+typedef struct DuSpill DuSpill;
+
+/**
+ * @brief Record comparator, as for `qsort`.
+ */
+typedef int (*DuSpillCompare)(const void *a, const void *b);
+
+// Spill Functions
+DuSpill *DuSpillCreate(size_t record_size, size_t memory,
+                       DuSpillCompare compare);
+int DuSpillAdd(DuSpill *spill, const void *record);
+int DuSpillSort(DuSpill *spill);
+int DuSpillNext(DuSpill *spill, void *record);
+void DuSpillFree(DuSpill *spill);
+FILE *DuSpillTempFile(void);
+
+#endif  // SPILL_H_
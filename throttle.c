@@ -0,0 +1,221 @@
+/**
+ * @file   throttle.c
+ *
+ * @brief  Token-bucket throttling of scan syscalls, so a scan can run on a
+ *         busy host at a bounded metadata rate. Optionally adapts the rates to
+ *         the observed lstat() latency.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "throttle.h"
+
+#include <errno.h>      // errno, EINTR
+#include <stdlib.h>     // qsort
+#include <string.h>     // memcpy, memset
+#include <sys/stat.h>   // stat, lstat
+
+static const double kBurstSeconds = 0.05;  // tokens a bucket may bank
+static const double kMinSleep = 0.001;     // seconds
+static const double kMinFactor = 1.0 / 64;
+static const double kBackoff = 0.5;        // factor applied when p99 rises
+static const double kRecovery = 1.25;      // factor applied when p99 settles
+static const double kRiseRatio = 2.0;      // p99 / baseline that backs off
+static const double kSettleRatio = 1.25;   // p99 / baseline that recovers
+static const uint64_t kQuietP99 = 100000;  // ns; cached stats never back off
+
+static void Acquire(DuBucket* bucket, double factor);
+static int CompareLatencies(const void* a, const void* b);
+
+/**
+ * @brief Initializes a throttle.
+ *
+ * @param throttle         Throttle to initialize.
+ * @param max_ops_per_sec  Maximum lstat() calls per second, or 0 for no limit.
+ * @param max_dirs_per_sec Maximum directories opened per second, or 0 for no
+ *                         limit.
+ * @param adaptive         Back off when lstat() latency rises.
+ */
+void DuThrottleInit(DuThrottle* throttle, double max_ops_per_sec,
+                    double max_dirs_per_sec, int adaptive) {
+  memset(throttle, 0, sizeof(*throttle));
+  throttle->ops.rate = max_ops_per_sec;
+  throttle->dirs.rate = max_dirs_per_sec;
+  throttle->adaptive = adaptive;
+  throttle->factor = 1.0;
+}
+
+/**
+ * @brief Tells whether a throttle limits anything, so callers can skip timing
+ *        syscalls altogether when it does not.
+ *
+ * @param throttle Throttle to check.
+ *
+ * @return Returns 1 if a rate is set, 0 otherwise.
+ */
+int DuThrottleEnabled(const DuThrottle* throttle) {
+  return throttle->ops.rate > 0 || throttle->dirs.rate > 0;
+}
+
+/**
+ * @brief Waits until an lstat() call is allowed.
+ *
+ * @param throttle Throttle to charge.
+ */
+void DuThrottleOp(DuThrottle* throttle) {
+  Acquire(&throttle->ops, throttle->factor);
+}
+
+/**
+ * @brief Waits until opening a directory is allowed.
+ *
+ * @param throttle Throttle to charge.
+ */
+void DuThrottleDir(DuThrottle* throttle) {
+  Acquire(&throttle->dirs, throttle->factor);
+}
+
+/**
+ * @brief Records the latency of an lstat() call. Every `kDuThrottleWindow`
+ *        samples the p99 is compared with the best p99 seen so far and the
+ *        rates are scaled down or back up.
+ *
+ * @param throttle   Throttle to update; ignored unless adaptive.
+ * @param latency_ns Latency of the call in nanoseconds.
+ */
+void DuThrottleRecord(DuThrottle* throttle, uint64_t latency_ns) {
+  if (!throttle->adaptive) {
+    return;
+  }
+
+  throttle->samples[throttle->sample_count++] = latency_ns;
+  if (throttle->sample_count < kDuThrottleWindow) {
+    return;
+  }
+  throttle->sample_count = 0;
+
+  uint64_t sorted[kDuThrottleWindow];
+  memcpy(sorted, throttle->samples, sizeof(sorted));
+  qsort(sorted, kDuThrottleWindow, sizeof(uint64_t), CompareLatencies);
+  uint64_t p99 = sorted[(kDuThrottleWindow * 99) / 100];
+
+  if (throttle->baseline_p99 == 0 || p99 < throttle->baseline_p99) {
+    throttle->baseline_p99 = p99;
+  }
+
+  double ratio = (double)p99 / (double)throttle->baseline_p99;
+  if (ratio > kRiseRatio && p99 > kQuietP99) {
+    throttle->factor *= kBackoff;
+    if (throttle->factor < kMinFactor) {
+      throttle->factor = kMinFactor;
+    }
+  } else if (ratio < kSettleRatio || p99 <= kQuietP99) {
+    throttle->factor *= kRecovery;
+    if (throttle->factor > 1.0) {
+      throttle->factor = 1.0;
+    }
+  }
+}
+
+/**
+ * @brief Gets the stat information of an entry, charging the throttle for
+ *        it and recording its latency.
+ *
+ * @param throttle Throttle to charge.
+ * @param path     Path of the entry.
+ * @param follow   Whether to follow a symbolic link, as stat() does.
+ * @param statbuf  Receives the stat information.
+ *
+ * @return Returns 0 on success, or -1 with errno set.
+ */
+int DuThrottleStat(DuThrottle* throttle, const char* path, int follow,
+                   struct stat* statbuf) {
+  int (*stat_fn)(const char*, struct stat*) = follow ? stat : lstat;
+  if (!DuThrottleEnabled(throttle)) {
+    return stat_fn(path, statbuf);
+  }
+
+  DuThrottleOp(throttle);
+  uint64_t start = DuThrottleNow();
+  int status = stat_fn(path, statbuf);
+  int saved_errno = errno;
+  DuThrottleRecord(throttle, DuThrottleNow() - start);
+
+  errno = saved_errno;
+  return status;
+}
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t DuThrottleNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Takes one token from a bucket, sleeping until one is available.
+ *
+ * @param bucket Bucket to take from; unlimited buckets return at once.
+ * @param factor Scale applied to the bucket's rate.
+ */
+static void Acquire(DuBucket* bucket, double factor) {
+  if (bucket->rate <= 0) {
+    return;
+  }
+
+  double rate = bucket->rate * factor;
+  double burst = rate * kBurstSeconds;
+  if (burst < 1.0) {
+    burst = 1.0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (bucket->last.tv_sec == 0 && bucket->last.tv_nsec == 0) {
+    bucket->tokens = 1.0;
+  } else {
+    double elapsed = (double)(now.tv_sec - bucket->last.tv_sec) +
+                     (double)(now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->tokens += elapsed * rate;
+    if (bucket->tokens > burst) {
+      bucket->tokens = burst;
+    }
+  }
+  bucket->last = now;
+
+  if (bucket->tokens < 1.0) {
+    // Sleep at least kMinSleep so fast rates are not dominated by the cost
+    // of one nanosleep() per call, and bank what accrued meanwhile
+    double wait = (1.0 - bucket->tokens) / rate;
+    if (wait < kMinSleep) {
+      wait = kMinSleep;
+    }
+    struct timespec delay = {
+        .tv_sec = (time_t)wait,
+        .tv_nsec = (long)((wait - (double)(time_t)wait) * 1e9),
+    };
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+    bucket->tokens += wait * rate;
+    if (bucket->tokens > burst) {
+      bucket->tokens = burst;
+    }
+  }
+  bucket->tokens -= 1.0;
+}
+
+/**
+ * @brief Orders latencies ascending.
+ */
+static int CompareLatencies(const void* a, const void* b) {
+  uint64_t la = *(const uint64_t*)a;
+  uint64_t lb = *(const uint64_t*)b;
+  return (la > lb) - (la < lb);
+}
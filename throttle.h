@@ -0,0 +1,48 @@
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <sys/stat.h>   // struct stat
+#include <time.h>       // struct timespec
+
+enum { kDuThrottleWindow = 128 };  // latency samples per p99 estimate
+
+/**
+ * @brief Token bucket refilled continuously at `rate` tokens per second.
+ */
+typedef struct DuBucket {
+  double rate;            // tokens per second, 0 for unlimited
+  double tokens;
+  struct timespec last;   // time of the last refill
+} DuBucket;
+
+/**
+ * @brief Rate limiter for the syscalls of a scan. `ops` is charged for every
+ *        lstat() and `dirs` for every directory opened. When adaptive, both
+ *        rates are scaled down while the p99 lstat() latency rises well
+ *        above the best p99 seen so far, and recover once it settles or drops
+ *        back to the latency of cached metadata.
+ */
+typedef struct DuThrottle {
+  DuBucket ops;
+  DuBucket dirs;
+  int adaptive;
+  double factor;          // scale applied to both rates, in (0, 1]
+  uint64_t baseline_p99;  // nanoseconds, 0 until the first window fills
+  uint64_t samples[kDuThrottleWindow];
+  size_t sample_count;
+} DuThrottle;
+
+// Throttle Functions
+void DuThrottleInit(DuThrottle *throttle, double max_ops_per_sec,
+                    double max_dirs_per_sec, int adaptive);
+int DuThrottleEnabled(const DuThrottle *throttle);
+void DuThrottleOp(DuThrottle *throttle);
+void DuThrottleDir(DuThrottle *throttle);
+void DuThrottleRecord(DuThrottle *throttle, uint64_t latency_ns);
+int DuThrottleStat(DuThrottle *throttle, const char *path, int follow,
+                   struct stat *statbuf);
+uint64_t DuThrottleNow(void);
+
+#endif  // THROTTLE_H_
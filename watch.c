@@ -0,0 +1,552 @@
+/**
+ * @file   watch.c
+ *
+ * @brief  Polling watch. The scanned tree stays in memory, each node with
+ *         the stat fields needed to tell whether it changed. A sweep walks
+ *         the directories alone, reading again only those whose mtime or
+ *         ctime moved, and merges their sorted names with the children held
+ *         so far. Totals are then summed up in memory, without a system call,
+ *         and compared with the ones last reported.
+ *
+ * @author Juan Diego Becerra (jdb9056@nyu.edu)
+ * @date   03-24-2024
+ */
+
+#include "watch.h"
+
+#include <dirent.h>     // opendir, DIR
+#include <errno.h>      // errno, EINTR, EIO, ENAMETOOLONG, ENOENT, ENOMEM
+#include <stdlib.h>     // calloc, free
+#include <string.h>     // memcpy, strcmp, strdup, strlen
+#include <sys/stat.h>   // lstat, struct stat, S_ISDIR, S_ISREG, S_IFMT
+#include <time.h>       // clock_gettime, clock_nanosleep
+
+enum { kPathMax = 4096 };  // bytes
+
+/**
+ * @brief An entry of the tree held in memory.
+ */
+typedef struct WatchNode {
+  char* name;              // entry name, or the root path
+  DynamicArray* children;  // of WatchNode*, sorted by name; NULL for files
+  dev_t dev;
+  ino_t ino;
+  mode_t mode;
+  nlink_t nlink;
+  struct timespec mtime;
+  struct timespec ctime;
+  blkcnt_t own;       // kilobytes taken by the entry itself
+  blkcnt_t reported;  // total last reported, -1 if never
+} WatchNode;
+
+typedef struct Watch {
+  const DuWatchOptions* opts;
+  char path[kPathMax];  // path of the entry being looked at
+  size_t len;
+  int depth;            // of the entry being looked at
+  DynamicArray* seen;   // of DuInode, while totals are summed up
+  DuSweep sweep;        // work done by the sweep under way
+  int error;            // errno of the first failure, 0 if none
+  int stopped;          // the visitor asked to stop
+} Watch;
+
+static WatchNode* Build(Watch* w, char* name, const struct stat* statbuf);
+static WatchNode* Refresh(Watch* w, WatchNode* node);
+static void ReadDir(Watch* w, WatchNode* dir);
+static blkcnt_t Total(Watch* w, WatchNode* node);
+static void Remove(Watch* w, WatchNode* node, int report);
+static void Update(WatchNode* node, const struct stat* statbuf);
+static int Changed(const WatchNode* node, const struct stat* statbuf);
+static int Stat(Watch* w, struct stat* statbuf);
+static int Enter(Watch* w, const char* name, size_t* saved);
+static void Leave(Watch* w, size_t saved);
+static void Report(Watch* w, blkcnt_t disk_usage);
+static int Wait(Watch* w, struct timespec* next);
+static int Stopping(const Watch* w);
+static void Fail(Watch* w, DuOp op, int errnum);
+
+/**
+ * @brief Scans `rootpath` into memory, reports every entry, and then sweeps
+ *        it every `interval` seconds, reporting the entries that changed,
+ *        until stopped.
+ *
+ * @param rootpath The path to the directory or file to watch.
+ * @param opts     Watch options and callbacks.
+ *
+ * @return Returns 0 once stopped, or -1 on error.
+ */
+int DuWatchRun(const char* rootpath, const DuWatchOptions* opts) {
+  const size_t kInitSize = 8;
+  Watch w = {.opts = opts};
+
+  size_t len = strlen(rootpath);
+  if (len >= kPathMax) {
+    memcpy(w.path, rootpath, kPathMax - 1);
+    Fail(&w, kDuOpPath, ENAMETOOLONG);
+    return -1;
+  }
+  memcpy(w.path, rootpath, len + 1);
+  w.len = len;
+
+  w.seen = InitDynamicArray(kInitSize, sizeof(DuInode));
+  char* name = strdup(rootpath);
+  if (!w.seen || !name) {
+    free(name);
+    FreeDynamicArray(w.seen);
+    Fail(&w, kDuOpAlloc, ENOMEM);
+    return -1;
+  }
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  struct stat statbuf;
+  WatchNode* root = NULL;
+  if (Stat(&w, &statbuf) < 0) {
+    free(name);
+    Fail(&w, kDuOpStat, errno);
+    w.error = w.error ? w.error : EIO;  // nothing to watch
+  } else {
+    root = Build(&w, name, &statbuf);
+  }
+
+  while (root && !Stopping(&w)) {
+    w.seen->len = 0;
+    Total(&w, root);
+    if (w.error || w.stopped ||
+        (opts->sweep && opts->sweep(&w.sweep, opts->ctx))) {
+      break;
+    }
+
+    memset(&w.sweep, 0, sizeof(w.sweep));
+    if (Wait(&w, &next) < 0) {
+      break;
+    }
+    if (!(root = Refresh(&w, root)) && !w.error) {
+      Fail(&w, kDuOpStat, ENOENT);
+      w.error = ENOENT;  // nothing left to watch
+    }
+  }
+
+  if (root) {
+    Remove(&w, root, 0);
+  }
+  FreeDynamicArray(w.seen);
+  return w.error ? -1 : 0;
+}
+
+/**
+ * @brief Creates the node of a new entry, reading the whole subtree of a
+ *        directory. The entry's path is `w->path`.
+ *
+ * @param w       Watch state.
+ * @param name    Name of the entry, owned by the node from then on.
+ * @param statbuf Stat information of the entry.
+ *
+ * @return Returns the node, or NULL after reporting an allocation failure.
+ */
+static WatchNode* Build(Watch* w, char* name, const struct stat* statbuf) {
+  WatchNode* node = calloc(1, sizeof(WatchNode));
+  if (!node) {
+    free(name);
+    Fail(w, kDuOpAlloc, ENOMEM);
+    return NULL;
+  }
+  node->name = name;
+  node->reported = -1;
+  Update(node, statbuf);
+
+  if (S_ISDIR(statbuf->st_mode)) {
+    if (!(node->children = InitDynamicArray(1, sizeof(WatchNode*)))) {
+      Remove(w, node, 0);
+      Fail(w, kDuOpAlloc, ENOMEM);
+      return NULL;
+    }
+    ReadDir(w, node);
+  }
+  return node;
+}
+
+/**
+ * @brief Brings a node up to date with its entry, at `w->path`.
+ *
+ * Directories are stat'ed again, and read again if they changed; unchanged
+ * ones only have their subdirectories refreshed. An entry replaced by another
+ * one is built anew, keeping what was reported under its path.
+ *
+ * @param w    Watch state.
+ * @param node Node to refresh.
+ *
+ * @return Returns the node, its replacement, or NULL if the entry is gone.
+ */
+static WatchNode* Refresh(Watch* w, WatchNode* node) {
+  struct stat statbuf;
+  if (Stat(w, &statbuf) < 0) {
+    if (errno == ENOENT) {
+      Remove(w, node, 1);
+      return NULL;
+    }
+    Fail(w, kDuOpStat, errno);
+    return node;
+  }
+
+  if (statbuf.st_dev != node->dev || statbuf.st_ino != node->ino ||
+      (statbuf.st_mode & S_IFMT) != (node->mode & S_IFMT)) {
+    // Whatever was below the old entry is gone, but its path is not
+    char* name = strdup(node->name);
+    blkcnt_t reported = node->reported;
+    node->reported = -1;
+    Remove(w, node, 1);
+    WatchNode* fresh = name ? Build(w, name, &statbuf) : NULL;
+    if (!name) {
+      Fail(w, kDuOpAlloc, ENOMEM);
+    } else if (fresh) {
+      fresh->reported = reported;
+    }
+    return fresh;
+  }
+
+  int changed = Changed(node, &statbuf);
+  Update(node, &statbuf);
+  if (!node->children) {
+    return node;
+  }
+
+  if (changed) {
+    ReadDir(w, node);
+    return node;
+  }
+
+  // Unchanged: same names, so only subdirectories can have changed below
+  WatchNode** children = (WatchNode**)node->children->data;
+  size_t kept = 0;
+  for (size_t i = 0; i < node->children->len; i++) {
+    WatchNode* child = children[i];
+    size_t saved;
+    if (child->children && !Stopping(w) &&
+        Enter(w, child->name, &saved) == 0) {
+      child = Refresh(w, child);
+      Leave(w, saved);
+    }
+    if (child) {
+      children[kept++] = child;
+    }
+  }
+  node->children->len = kept;
+  return node;
+}
+
+/**
+ * @brief Reads a directory, at `w->path`, and merges its names with its
+ *        children: children whose names are gone are removed, new names are
+ *        built, and the others are refreshed.
+ *
+ * An unreadable directory loses its children, counting its own size alone,
+ * as in a scan.
+ *
+ * @param w   Watch state.
+ * @param dir Directory node.
+ */
+static void ReadDir(Watch* w, WatchNode* dir) {
+  w->sweep.dirs_read++;
+
+  DynamicArray* names = NULL;
+  DIR* dirp = opendir(w->path);
+  if (!dirp) {
+    Fail(w, kDuOpOpenDir, errno);
+  } else if (!(names = DuReadNames(dirp, 1))) {
+    Fail(w, kDuOpAlloc, ENOMEM);
+    return;
+  }
+
+  DynamicArray* old = dir->children;
+  size_t count = names ? names->len : 0;
+  DynamicArray* merged = InitDynamicArray(count ? count : 1,
+                                          sizeof(WatchNode*));
+  if (!merged) {
+    DuFreeNames(names);
+    Fail(w, kDuOpAlloc, ENOMEM);
+    return;
+  }
+
+  WatchNode** children = (WatchNode**)old->data;
+  WatchNode** out = (WatchNode**)merged->data;
+  size_t i = 0;
+  size_t j = 0;
+  while ((i < old->len || j < count) && !Stopping(w)) {
+    char* name = j < count ? ((char**)names->data)[j] : NULL;
+    int cmp = i == old->len ? 1 : !name ? -1 : strcmp(children[i]->name, name);
+
+    size_t saved;
+    if (Enter(w, cmp <= 0 ? children[i]->name : name, &saved) < 0) {
+      // Only new names can be too long; held children already fit
+      free(name);
+      j++;
+      continue;
+    }
+
+    WatchNode* child = NULL;
+    if (cmp < 0) {
+      Remove(w, children[i++], 1);
+    } else if (cmp == 0) {
+      free(name);
+      j++;
+      child = Refresh(w, children[i++]);
+    } else {
+      j++;
+      struct stat statbuf;
+      if (Stat(w, &statbuf) == 0) {
+        child = Build(w, name, &statbuf);
+      } else {
+        free(name);
+        if (errno != ENOENT) {  // already gone again, not an error
+          Fail(w, kDuOpStat, errno);
+        }
+      }
+    }
+    Leave(w, saved);
+
+    if (child) {
+      out[merged->len++] = child;
+    }
+  }
+
+  // Stopped midway, so the tree is only going to be freed
+  while (i < old->len) {
+    Remove(w, children[i++], 0);
+  }
+  while (j < count) {
+    free(((char**)names->data)[j++]);
+  }
+
+  FreeDynamicArray(names);
+  FreeDynamicArray(old);
+  dir->children = merged;
+}
+
+/**
+ * @brief Sums up the total of a node, at `w->path`, counting each hard-linked
+ *        file once, and reports it if it changed since it was last reported.
+ *
+ * @param w    Watch state.
+ * @param node Node to total.
+ *
+ * @return Returns the total in kilobytes.
+ */
+static blkcnt_t Total(Watch* w, WatchNode* node) {
+  blkcnt_t total = node->own;
+
+  if (node->children) {
+    WatchNode** children = (WatchNode**)node->children->data;
+    for (size_t i = 0; i < node->children->len && !w->stopped; i++) {
+      size_t saved;
+      if (Enter(w, children[i]->name, &saved) == 0) {
+        total += Total(w, children[i]);
+        Leave(w, saved);
+      }
+    }
+  } else if (S_ISREG(node->mode) && node->nlink > 1 &&
+             !w->opts->count_links) {
+    DuInode* seen = SearchInode(w->seen, node->dev, node->ino);
+    if (seen) {
+      if (--seen->remaining == 0) {
+        EvictInode(w->seen, seen);
+      }
+      return 0;
+    }
+    if (InsertInode(w->seen, node->dev, node->ino, node->nlink - 1) < 0) {
+      Fail(w, kDuOpInsert, errno ? errno : ENOMEM);
+      return 0;
+    }
+  }
+
+  if ((node->children || w->opts->include_files) && total != node->reported &&
+      !w->stopped) {
+    Report(w, total);
+    node->reported = total;
+  }
+  return total;
+}
+
+/**
+ * @brief Frees a node and its subtree, at `w->path`, reporting the removal of
+ *        every entry that was reported, in post-order, if asked to.
+ *
+ * @param w      Watch state.
+ * @param node   Node to free.
+ * @param report Whether to report the removed entries.
+ */
+static void Remove(Watch* w, WatchNode* node, int report) {
+  if (node->children) {
+    WatchNode** children = (WatchNode**)node->children->data;
+    for (size_t i = 0; i < node->children->len; i++) {
+      size_t saved;
+      int entered = report && Enter(w, children[i]->name, &saved) == 0;
+      Remove(w, children[i], entered);
+      if (entered) {
+        Leave(w, saved);
+      }
+    }
+    FreeDynamicArray(node->children);
+  }
+
+  if (report && node->reported >= 0 && !w->stopped) {
+    Report(w, -1);
+  }
+  free(node->name);
+  free(node);
+}
+
+/**
+ * @brief Copies the fields of a stat result that a node keeps.
+ */
+static void Update(WatchNode* node, const struct stat* statbuf) {
+  node->dev = statbuf->st_dev;
+  node->ino = statbuf->st_ino;
+  node->mode = statbuf->st_mode;
+  node->nlink = statbuf->st_nlink;
+  node->mtime = statbuf->st_mtim;
+  node->ctime = statbuf->st_ctim;
+  node->own = statbuf->st_blocks / 2;
+}
+
+/**
+ * @brief Tells whether the mtime or ctime of an entry moved since its node
+ *        was updated, which for a directory means its names may have changed.
+ */
+static int Changed(const WatchNode* node, const struct stat* statbuf) {
+  return statbuf->st_mtim.tv_sec != node->mtime.tv_sec ||
+         statbuf->st_mtim.tv_nsec != node->mtime.tv_nsec ||
+         statbuf->st_ctim.tv_sec != node->ctime.tv_sec ||
+         statbuf->st_ctim.tv_nsec != node->ctime.tv_nsec;
+}
+
+/**
+ * @brief Stats the entry at `w->path`, counting the call.
+ *
+ * @return Returns 0 on success, or -1 with errno set.
+ */
+static int Stat(Watch* w, struct stat* statbuf) {
+  w->sweep.stats++;
+  return lstat(w->path, statbuf);
+}
+
+/**
+ * @brief Appends a name to `w->path`, one level deeper.
+ *
+ * @param w     Watch state.
+ * @param name  Entry name.
+ * @param saved Receives the length to restore with `Leave`.
+ *
+ * @return Returns 0 on success, or -1 after reporting a path too long.
+ */
+static int Enter(Watch* w, const char* name, size_t* saved) {
+  size_t len = strlen(name);
+  if (w->len + 1 + len >= kPathMax) {
+    Fail(w, kDuOpPath, ENAMETOOLONG);
+    return -1;
+  }
+
+  *saved = w->len;
+  w->path[w->len] = '/';
+  memcpy(w->path + w->len + 1, name, len + 1);
+  w->len += 1 + len;
+  w->depth++;
+  return 0;
+}
+
+/**
+ * @brief Restores `w->path` to what it was before `Enter`.
+ */
+static void Leave(Watch* w, size_t saved) {
+  w->len = saved;
+  w->path[saved] = '\0';
+  w->depth--;
+}
+
+/**
+ * @brief Hands the entry at `w->path` to the visitor, counting it, and
+ *        records whether it asked to stop.
+ *
+ * @param w          Watch state.
+ * @param disk_usage Total in kilobytes, or -1 for a removed entry.
+ */
+static void Report(Watch* w, blkcnt_t disk_usage) {
+  w->sweep.changed++;
+
+  const DuWatchOptions* opts = w->opts;
+  DuEntry entry = {
+      .path = w->path,
+      .depth = w->depth,
+      .statbuf = NULL,
+      .disk_usage = disk_usage,
+  };
+  if (opts->visit && opts->visit(&entry, opts->ctx)) {
+    w->stopped = 1;
+  }
+}
+
+/**
+ * @brief Sleeps until the next sweep is due, `interval` seconds after the
+ *        previous one started, or at once if that time has passed.
+ *
+ * @param w    Watch state.
+ * @param next Start of the previous sweep, advanced to the next one.
+ *
+ * @return Returns 0 once the next sweep is due, or -1 if stopped meanwhile.
+ */
+static int Wait(Watch* w, struct timespec* next) {
+  double interval = w->opts->interval;
+  time_t whole = (time_t)interval;
+  next->tv_sec += whole;
+  next->tv_nsec += (long)((interval - (double)whole) * 1e9);
+  if (next->tv_nsec >= 1000000000L) {
+    next->tv_sec++;
+    next->tv_nsec -= 1000000000L;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec > next->tv_sec ||
+      (now.tv_sec == next->tv_sec && now.tv_nsec > next->tv_nsec)) {
+    *next = now;
+  }
+
+  // Interrupted by a signal, which may be the one asking to stop
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) ==
+         EINTR) {
+    if (Stopping(w)) {
+      return -1;
+    }
+  }
+  return Stopping(w) ? -1 : 0;
+}
+
+/**
+ * @brief Tells whether the watch is ending, having failed or been asked to
+ *        stop.
+ */
+static int Stopping(const Watch* w) {
+  return w->error || w->stopped || (w->opts->stop && *w->opts->stop);
+}
+
+/**
+ * @brief Records the first failure that ends the watch, and forwards every
+ *        failure, on `w->path`, to the error callback.
+ *
+ * @param w      Watch state.
+ * @param op     Operation that failed.
+ * @param errnum errno value describing the failure.
+ */
+static void Fail(Watch* w, DuOp op, int errnum) {
+  if (!errnum) {
+    errnum = EIO;
+  }
+  if (!(w->opts->keep_going && DuSkippable(op)) && !w->error) {
+    w->error = errnum;
+  }
+
+  if (w->opts->on_error) {
+    w->opts->on_error(w->path, op, errnum, w->opts->ctx);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <signal.h>     // sig_atomic_t
+#include <stddef.h>     // size_t
+
+#include "libdu.h"
+
+/**
+ * Polling watch. The tree is scanned once into memory, keeping the stat
+ * fields of every entry, and then swept on every tick: directories are
+ * stat'ed again, only those whose mtime or ctime changed are read again, and
+ * only the files of those are stat'ed again. The totals are then summed up in
+ * memory and the entries whose totals changed are reported. Changes to a file
+ * whose directory did not change, such as growth or a new link elsewhere,
+ * are only seen once that directory changes.
+ */
+
+/**
+ * @brief Work done by one sweep, or by the first scan.
+ */
+typedef struct DuSweep {
+  size_t stats;      // lstat() calls
+  size_t dirs_read;  // directories read, for being new or changed
+  size_t changed;    // entries reported
+} DuSweep;
+
+/**
+ * @brief Sweep callback, invoked after the first scan and after every sweep,
+ *        once its entries have been reported. Returning non-zero stops the
+ *        watch.
+ */
+typedef int (*DuSweepFn)(const DuSweep *sweep, void *ctx);
+
+typedef struct DuWatchOptions {
+  double interval;    // seconds from the start of a sweep to the next one
+  int include_files;  // report files, not just directories
+  int keep_going;     // skip entries that cannot be read, see DuOptions
+  int count_links;    // count every link of a file, see DuOptions
+  const volatile sig_atomic_t *stop;  // the watch ends once this is set, may
+                                      // be NULL
+  DuVisitFn visit;    // every entry after the first scan, then those whose
+                      // total changed or that were removed, in post-order;
+                      // `statbuf` is NULL and removed entries have a
+                      // `disk_usage` of -1
+  DuSweepFn sweep;    // may be NULL
+  DuErrorFn on_error; // may be NULL
+  void *ctx;          // passed to the callbacks
+} DuWatchOptions;
+
+// Watch Functions
+int DuWatchRun(const char *rootpath, const DuWatchOptions *opts);
+
+#endif  // WATCH_H_